@@ -0,0 +1,56 @@
+# Compares the system allocator with the pooled one on short-lived states
+# doing typical request work: load libraries, build some tables and strings,
+# run a bit of code, throw the state away. The last run reuses one pooled
+# state and resets it after every request instead.
+#
+# No reference numbers are recorded yet: run it on the target machine
+# before relying on the pool allocator.
+#
+#   rake bench
+#   ruby -Ilib bench/allocator.rb [iterations]
+
+require 'benchmark'
+require 'rlua'
+
+ITERATIONS = (ARGV[0] || 5_000).to_i
+
+PAYLOAD = {
+  'user'  => { 'id' => 42, 'name' => 'zaphod', 'roles' => %w(admin editor viewer) },
+  'items' => (1..50).map { |i| { 'sku' => "sku-#{i}", 'price' => i * 1.5, 'qty' => i % 7 } },
+}
+
+SCRIPT = <<-LUA
+  local total, names = 0, {}
+  for _, item in ipairs(request.items) do
+    total = total + item.price * item.qty
+    names[#names + 1] = string.format("%s x%d", item.sku, item.qty)
+  end
+  return total, table.concat(names, ", ")
+LUA
+
+def rss_kb
+  File.read('/proc/self/status')[/VmRSS:\s+(\d+)/, 1].to_i
+rescue Errno::ENOENT
+  0
+end
+
+def request(state)
+  state.__load_stdlib :all
+  state.request = PAYLOAD
+  state.__eval SCRIPT
+end
+
+RUNS = {
+  'system' => -> { ITERATIONS.times { request(Lua::State.new) } },
+  'pool'   => -> { ITERATIONS.times { request(Lua::State.new(allocator: :pool)) } },
+  'reset'  => -> { state = Lua::State.new(allocator: :pool); ITERATIONS.times { request(state.reset) } },
+}
+
+puts "#{ITERATIONS} requests per run"
+Benchmark.bm(8) do |bm|
+  RUNS.each do |name, run|
+    before = rss_kb
+    bm.report(name) { run.call; GC.start }
+    puts "#{' ' * 9}RSS growth: #{rss_kb - before} kB"
+  end
+end
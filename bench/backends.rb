@@ -0,0 +1,55 @@
+# Times typical workloads against the Lua implementation the extension was
+# built with: pure Lua number crunching, table churn, string building,
+# Ruby callbacks and value conversion. Run it once per build to compare
+# Lua 5.4 with LuaJIT:
+#
+#   rake bench:backends
+#   ruby -Ilib bench/backends.rb [iterations]
+
+require 'benchmark'
+require 'rlua'
+
+ITERATIONS = (ARGV[0] || 20).to_i
+
+WORKLOADS = {
+  'numeric' => <<-LUA,
+    local sum = 0
+    for i = 1, 1000000 do sum = sum + math.sqrt(i) * (i % 7) end
+    return sum
+  LUA
+  'tables' => <<-LUA,
+    local list = {}
+    for i = 1, 100000 do list[i] = { id = i, name = "item" } end
+    local n = 0
+    for _, item in ipairs(list) do n = n + item.id end
+    return n
+  LUA
+  'strings' => <<-LUA,
+    local parts = {}
+    for i = 1, 20000 do parts[#parts + 1] = string.format("%d:%s", i, "x") end
+    return #table.concat(parts, ",")
+  LUA
+  'callbacks' => <<-LUA,
+    local sum = 0
+    for i = 1, 20000 do sum = sum + add(i, 1) end
+    return sum
+  LUA
+}
+
+PAYLOAD = (1..1000).map { |i| { 'id' => i, 'tags' => %w(a b c), 'price' => i * 0.5 } }
+
+state = Lua::State.new
+state.__load_stdlib :all
+state.add = lambda { |a, b| a + b }
+
+puts "#{Lua::BACKEND_VERSION}, #{ITERATIONS} iterations"
+Benchmark.bm(10) do |bm|
+  WORKLOADS.each do |name, script|
+    chunk = state.__eval "return function() #{script} end"
+    bm.report(name) { ITERATIONS.times { chunk.call } }
+  end
+
+  bm.report('conversion') do
+    ITERATIONS.times { state.payload = PAYLOAD; state.payload.to_ary }
+  end
+end
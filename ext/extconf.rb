@@ -2,11 +2,31 @@ require "mkmf"
 
 $CFLAGS += " -std=c99 -Wno-declaration-after-statement"
 
-dir_config('lua5.4')
+if with_config('luajit')
+  # LuaJIT implements the Lua 5.1 API; rlua_compat.h fills in the rest.
+  dir_config('luajit')
 
-unless have_library('lua5.4', 'luaL_newstate') or have_library('lua.5.4', 'luaL_newstate')
-  puts ' extconf failure: need liblua5.4'
-  exit 1
+  unless pkg_config('luajit') or find_header('luajit.h', '/usr/include/luajit-2.1', '/usr/local/include/luajit-2.1')
+    puts ' extconf failure: need LuaJIT headers'
+    exit 1
+  end
+
+  unless have_library('luajit-5.1', 'luaL_newstate')
+    puts ' extconf failure: need libluajit-5.1'
+    exit 1
+  end
+
+  $defs << '-DRLUA_LUAJIT'
+else
+  dir_config('lua5.4')
+
+  unless have_library('lua5.4', 'luaL_newstate') or have_library('lua.5.4', 'luaL_newstate')
+    puts ' extconf failure: need liblua5.4'
+    exit 1
+  end
 end
 
+have_header('pthread.h')
+have_header('sys/mman.h')
+
 create_makefile("rlua")
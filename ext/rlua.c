@@ -1,56 +1,580 @@
 #include <ruby.h>
-#include <lua5.4/lua.h>
-#include <lua5.4/lauxlib.h>
-#include <lua5.4/lualib.h>
+#include <ruby/thread.h>
+#include <ruby/thread_native.h>
+#include "rlua_compat.h"
 #include <ctype.h>
 #include <ruby/encoding.h>
 
-VALUE mLua, cLuaState, cLuaMultret, cLuaFunction, cLuaTable;
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <ruby/atomic.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+VALUE mLua, cLuaState, cLuaMultret, cLuaFunction, cLuaTable, cLuaPath, cLuaError, cLuaWorkerPool, cLuaBundle;
+VALUE cLuaSharedTable, cLuaBuffer, cLuaChannel;
+
+static ID id_call, id_args, id_keys, id_trace, id_source_location, id_keyword_init;
 
-static VALUE rlua_makeref(lua_State* state)
+/*
+ * Ruby objects referenced from Lua (e.g. procs wrapped into Lua functions)
+ * are linked into a per-state list, so that they are marked (and pinned)
+ * for as long as Lua can reach them.
+ */
+typedef struct rlua_Anchor {
+  VALUE value;
+  struct rlua_Anchor *prev, *next;
+} rlua_Anchor;
+
+// Growable malloc'd buffer; see rlua_packet_write.
+typedef struct {
+  char* data;
+  size_t size, capa;
+} rlua_Packet;
+
+/*
+ * Timings of Ruby callbacks sharing one name. Bucket i of the histogram
+ * counts calls which took less than 2**i nanoseconds; the last one also
+ * counts everything slower.
+ */
+#define RLUA_PROFILE_BUCKETS 32
+
+typedef struct rlua_Profile {
+  char* name;
+  long name_len;
+  uint64_t calls, total_ns;
+  uint64_t histogram[RLUA_PROFILE_BUCKETS];
+  struct rlua_Profile* next;
+} rlua_Profile;
+
+/*
+ * Per-interpreter bookkeeping. Everything is kept in C, so that Lua::State
+ * objects do not share any Ruby objects and can be used from any Ractor.
+ */
+typedef struct {
+  lua_State* state;              // NULL once the interpreter is closed
+  VALUE self;                    // Lua::State object; Qnil once it is freed
+  long holders;                  // Lua::State plus every Lua::Table/Lua::Function
+  int* dead;                     // references of collected objects, released lazily
+  long ndead, dead_capa;
+  rb_nativethread_lock_t lock;   // protects holders and dead, which GC touches
+  rlua_Anchor anchors;
+  int max_depth;                 // limits of Ruby to Lua conversion
+  long max_elements;             // 0 if unlimited
+  int symbols;                   // registry reference of Symbol cache
+  int symbolize_keys;            // return string keys of Table.next as Symbols
+  rlua_Packet trace;             // frames of the last error, see rlua_error_handler
+  int interrupt_interval;        // instructions between rlua_interrupt_hook calls
+  int pending_tag;               // Ruby jump interrupted Lua code; re-raised by rlua_pcall
+  VALUE pending;
+  VALUE callback_error;          // StandardError of the last failed callback, see rlua_callback_failed
+  VALUE callback_message;        // ... and the Lua error message it became
+  int in_pcall;                  // Lua runs under our lua_pcall rather than under Ruby code
+  struct rlua_Arena* arena;      // NULL if the state uses the system allocator
+  rlua_Profile* profiles;        // in order of registration; freed with the state
+  int profile_callbacks;         // profile every callback, not only named ones
+  int async_threads;             // registry reference of coroutines run by rlua_async_run
+  int shapes;                    // registry reference of Struct shapes, see rlua_push_shape
+  VALUE waiter;                  // Thread blocked in a Lua channel operation, or 0
+} rlua_State;
+
+// Lua::Table and Lua::Function are references into registry of their state.
+typedef struct {
+  rlua_State* owner;
+  VALUE state;
+  int ref;
+} rlua_Ref;
+
+// Upvalue of Lua closures which call Ruby procs.
+typedef struct {
+  rlua_Anchor anchor;
+  rlua_State* owner;             // saves a lookup of RLUA_STATE per call
+  rlua_Profile* profile;         // NULL unless the callback is profiled
+  int async;                     // yields to rlua_async_run when possible
+} rlua_Callback;
+
+#define RLUA_STATE(state) (*(rlua_State**) lua_getextraspace(state))
+
+#define RLUA_DEFAULT_MAX_DEPTH 100
+
+/*
+ * Pooled allocator for Lua states. Blocks of up to RLUA_ARENA_MAX_SMALL
+ * bytes are rounded up to a multiple of RLUA_ARENA_QUANTUM and carved from
+ * large chunks; freed blocks go to a free list of their size class and are
+ * reused for the next allocation of that class. Chunks are never returned
+ * one by one: all of them are released at once after the state is closed.
+ * Larger blocks go straight to the system allocator. Closing still costs
+ * as much as with the system allocator, as lua_close visits every object
+ * to run finalizers; only the frees of small blocks are skipped.
+ */
+#define RLUA_ARENA_QUANTUM   16
+#define RLUA_ARENA_MAX_SMALL 512
+#define RLUA_ARENA_CLASSES   (RLUA_ARENA_MAX_SMALL / RLUA_ARENA_QUANTUM)
+#define RLUA_ARENA_CHUNK     (64 * 1024)
+
+typedef struct rlua_ArenaChunk {
+  struct rlua_ArenaChunk* next;
+  size_t size;
+} rlua_ArenaChunk;
+
+typedef struct rlua_Arena {
+  void* free[RLUA_ARENA_CLASSES];  // singly-linked through the blocks
+  char* cursor;                    // unused tail of the current chunk
+  size_t left;
+  rlua_ArenaChunk* chunks;
+  size_t chunk_bytes;
+  int closing;                     // small blocks are not recycled any more
+} rlua_Arena;
+
+#define RLUA_ARENA_CLASS(size) (((size) - 1) / RLUA_ARENA_QUANTUM)
+#define RLUA_ARENA_HEADER \
+  ((sizeof(rlua_ArenaChunk) + RLUA_ARENA_QUANTUM - 1) / RLUA_ARENA_QUANTUM * RLUA_ARENA_QUANTUM)
+
+static void* rlua_arena_small(rlua_Arena* arena, size_t size)
+{
+  int class = RLUA_ARENA_CLASS(size);
+  size_t block = (class + 1) * RLUA_ARENA_QUANTUM;
+
+  void* ptr = arena->free[class];
+  if(ptr) {
+    arena->free[class] = *(void**) ptr;
+    return ptr;
+  }
+
+  if(arena->left < block) {
+    // The tail of the old chunk is left unused; it is smaller than any block
+    // which could not be served from it.
+    rlua_ArenaChunk* chunk = malloc(RLUA_ARENA_CHUNK);
+    if(chunk == NULL)
+      return NULL;
+
+    chunk->next = arena->chunks;
+    chunk->size = RLUA_ARENA_CHUNK;
+    arena->chunks = chunk;
+    arena->chunk_bytes += RLUA_ARENA_CHUNK;
+    arena->cursor = (char*) chunk + RLUA_ARENA_HEADER;
+    arena->left = RLUA_ARENA_CHUNK - RLUA_ARENA_HEADER;
+  }
+
+  ptr = arena->cursor;
+  arena->cursor += block;
+  arena->left -= block;
+
+  return ptr;
+}
+
+static void rlua_arena_release(rlua_Arena* arena, void* ptr, size_t size)
+{
+  if(size > RLUA_ARENA_MAX_SMALL) {
+    free(ptr);
+  } else if(!arena->closing) {
+    int class = RLUA_ARENA_CLASS(size);
+    *(void**) ptr = arena->free[class];
+    arena->free[class] = ptr;
+  }
+}
+
+static void* rlua_arena_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+  rlua_Arena* arena = ud;
+
+  if(nsize == 0) {
+    if(ptr)
+      rlua_arena_release(arena, ptr, osize);
+    return NULL;
+  }
+
+  if(ptr == NULL)   // osize is a type tag here
+    return nsize > RLUA_ARENA_MAX_SMALL ? malloc(nsize) : rlua_arena_small(arena, nsize);
+
+  if(osize > RLUA_ARENA_MAX_SMALL && nsize > RLUA_ARENA_MAX_SMALL)
+    return realloc(ptr, nsize);
+  if(osize <= RLUA_ARENA_MAX_SMALL && nsize <= RLUA_ARENA_MAX_SMALL &&
+     RLUA_ARENA_CLASS(osize) == RLUA_ARENA_CLASS(nsize))
+    return ptr;
+
+  void* moved = nsize > RLUA_ARENA_MAX_SMALL ? malloc(nsize) : rlua_arena_small(arena, nsize);
+  if(moved == NULL)
+    return NULL;
+
+  memcpy(moved, ptr, osize < nsize ? osize : nsize);
+  rlua_arena_release(arena, ptr, osize);
+
+  return moved;
+}
+
+// Returns all chunks at once. The state must already be closed.
+static void rlua_arena_free(rlua_Arena* arena)
+{
+  rlua_ArenaChunk* chunk = arena->chunks;
+  while(chunk) {
+    rlua_ArenaChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  free(arena);
+}
+
+static int rlua_panic(lua_State* state)
+{
+  const char* message = lua_tostring(state, -1);
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+          message ? message : "error object is not a string");
+  return 0;
+}
+
+static void rlua_anchor_link(rlua_State* rstate, rlua_Anchor* anchor)
+{
+  anchor->prev = &rstate->anchors;
+  anchor->next = rstate->anchors.next;
+  anchor->next->prev = anchor;
+  rstate->anchors.next = anchor;
+}
+
+static void rlua_anchor_unlink(rlua_Anchor* anchor)
+{
+  anchor->prev->next = anchor->next;
+  anchor->next->prev = anchor->prev;
+  anchor->prev = anchor->next = anchor;
+}
+
+static void rlua_state_release(rlua_State* rstate)
+{
+  rb_nativethread_lock_lock(&rstate->lock);
+  long holders = --rstate->holders;
+  rb_nativethread_lock_unlock(&rstate->lock);
+
+  if(holders == 0) {
+    rb_nativethread_lock_destroy(&rstate->lock);
+    free(rstate->dead);
+    xfree(rstate);
+  }
+}
+
+static void rlua_state_close(rlua_State* rstate)
+{
+  rstate->self = Qnil;
+
+  // lua_close still visits every object to run finalizers, but small blocks
+  // freed by it are dropped with their chunks instead of being recycled.
+  if(rstate->arena)
+    rstate->arena->closing = 1;
+
+  if(rstate->state) {
+    lua_close(rstate->state);
+    rstate->state = NULL;
+  }
+
+  if(rstate->arena) {
+    rlua_arena_free(rstate->arena);
+    rstate->arena = NULL;
+  }
+
+  rstate->ndead = 0;
+
+  free(rstate->trace.data);
+  rstate->trace.data = NULL;
+  rstate->trace.size = rstate->trace.capa = 0;
+
+  // Callbacks pointing to profiles were collected by lua_close.
+  while(rstate->profiles) {
+    rlua_Profile* profile = rstate->profiles;
+    rstate->profiles = profile->next;
+    free(profile->name);
+    free(profile);
+  }
+}
+
+static void rlua_state_mark(void* ptr)
+{
+  rlua_State* rstate = ptr;
+  rlua_Anchor* anchor;
+
+  // Lua holds raw VALUEs, so these must not move: rb_gc_mark pins them.
+  for(anchor = rstate->anchors.next; anchor != &rstate->anchors; anchor = anchor->next)
+    rb_gc_mark(anchor->value);
+  rb_gc_mark(rstate->pending);
+  rb_gc_mark(rstate->callback_error);
+  rb_gc_mark(rstate->callback_message);
+}
+
+static void rlua_state_free(void* ptr)
+{
+  rlua_State* rstate = ptr;
+
+  rlua_state_close(rstate);
+  rlua_state_release(rstate);
+}
+
+static size_t rlua_state_memsize(const void* ptr)
+{
+  const rlua_State* rstate = ptr;
+  return sizeof(rlua_State) + rstate->dead_capa * sizeof(int) +
+         (rstate->arena ? sizeof(rlua_Arena) + rstate->arena->chunk_bytes : 0);
+}
+
+static void rlua_state_compact(void* ptr)
+{
+  rlua_State* rstate = ptr;
+  rstate->self = rb_gc_location(rstate->self);
+}
+
+static const rb_data_type_t rlua_state_type = {
+  .wrap_struct_name = "rlua_state",
+  .function = {
+    .dmark    = rlua_state_mark,
+    .dfree    = rlua_state_free,
+    .dsize    = rlua_state_memsize,
+    .dcompact = rlua_state_compact,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void rlua_ref_mark(void* ptr)
+{
+  rlua_Ref* ref = ptr;
+  rb_gc_mark(ref->state);
+}
+
+static void rlua_ref_free(void* ptr)
+{
+  rlua_Ref* ref = ptr;
+  rlua_State* rstate = ref->owner;
+
+  if(rstate) {
+    // This may run on any thread, in the middle of Lua code executed by
+    // owner of the state, so the reference is only queued for release.
+    rb_nativethread_lock_lock(&rstate->lock);
+    if(rstate->state && ref->ref >= 0) {
+      if(rstate->ndead == rstate->dead_capa) {
+        long capa = rstate->dead_capa ? rstate->dead_capa * 2 : 16;
+        int* dead = realloc(rstate->dead, capa * sizeof(int));
+        if(dead) {
+          rstate->dead = dead;
+          rstate->dead_capa = capa;
+        }
+      }
+      if(rstate->ndead < rstate->dead_capa)
+        rstate->dead[rstate->ndead++] = ref->ref;
+    }
+    rb_nativethread_lock_unlock(&rstate->lock);
+
+    rlua_state_release(rstate);
+  }
+
+  xfree(ref);
+}
+
+static const rb_data_type_t rlua_ref_type = {
+  .wrap_struct_name = "rlua_ref",
+  .function = {
+    .dmark = rlua_ref_mark,
+    .dfree = rlua_ref_free,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void rlua_release_dead(rlua_State* rstate)
+{
+  lua_State* state = rstate->state;
+
+  rb_nativethread_lock_lock(&rstate->lock);
+  while(rstate->ndead > 0)
+    luaL_unref(state, LUA_REGISTRYINDEX, rstate->dead[--rstate->ndead]);
+  rb_nativethread_lock_unlock(&rstate->lock);
+}
+
+static rlua_State* rlua_get_rstate(VALUE object)
+{
+  rlua_State* rstate;
+
+  if(rb_typeddata_is_kind_of(object, &rlua_state_type)) {
+    rstate = DATA_PTR(object);
+  } else if(rb_typeddata_is_kind_of(object, &rlua_ref_type)) {
+    rstate = ((rlua_Ref*) DATA_PTR(object))->owner;
+  } else {
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Lua::State, Lua::Table or Lua::Function)",
+             rb_obj_classname(object));
+  }
+
+  if(rstate == NULL || rstate->state == NULL)
+    rb_raise(rb_eArgError, "uninitialized %s", rb_obj_classname(object));
+
+  // Lua code waiting on a channel has C frames on the interpreter's stack;
+  // another thread entering it would have them unwound under its feet.
+  if(rstate->waiter && rstate->waiter != rb_thread_current())
+    rb_raise(rb_eThreadError, "Lua::State is blocked on a channel in another thread");
+
+  return rstate;
+}
+
+// Returns Lua interpreter which +object+ (a state, table or function) belongs to.
+static lua_State* rlua_get_state(VALUE object)
+{
+  rlua_State* rstate = rlua_get_rstate(object);
+
+  if(rstate->ndead > 0)
+    rlua_release_dead(rstate);
+
+  return rstate->state;
+}
+
+static int rlua_makeref(lua_State* state)
 {
-  VALUE ref;
                                                      // stack: |objt|...
-  lua_getfield(state, LUA_REGISTRYINDEX, "rlua");    //        |refs|objt|...
-  lua_pushvalue(state, -2);                          //        |objt|refs|objt|...
-  ref = INT2FIX(luaL_ref(state, -2));                //        |refs|objt|...
-  lua_pop(state, 1);                                 //        |objt|...
+  lua_pushvalue(state, -1);                          //        |objt|objt|...
+  return luaL_ref(state, LUA_REGISTRYINDEX);         //        |objt|...
+}
 
-  return ref;
+static void rlua_ref_attach(rlua_Ref* ref, rlua_State* rstate, int index)
+{
+  rb_nativethread_lock_lock(&rstate->lock);
+  rstate->holders++;
+  rb_nativethread_lock_unlock(&rstate->lock);
+
+  ref->owner = rstate;
+  ref->state = rstate->self;
+  ref->ref   = index;
 }
 
-static VALUE rlua_finalize_ref(VALUE id, VALUE rbState)
+// Wraps the value on top of the stack into a new +klass+ object.
+static VALUE rlua_wrap_ref(VALUE klass, lua_State* state)
 {
-  lua_State* state;
-  Data_Get_Struct(rbState, lua_State, state);
+  rlua_Ref* ref;
+  VALUE object = TypedData_Make_Struct(klass, rlua_Ref, &rlua_ref_type, ref);
+  ref->ref = LUA_NOREF;
 
-  int ref = FIX2INT(rb_hash_aref(rb_iv_get(rbState, "@refs"), id));
+  rlua_ref_attach(ref, RLUA_STATE(state), rlua_makeref(state));
 
-  lua_getfield(state, LUA_REGISTRYINDEX, "rlua");
-  luaL_unref(state, -1, ref);
-  lua_pop(state, 1);
+  return object;
+}
 
-  rb_hash_delete(rb_iv_get(rbState, "@refs"), id);
+static void rlua_push_ref(lua_State* state, rlua_State* rstate, VALUE value)
+{
+  rlua_Ref* ref = DATA_PTR(value);
 
-  return Qnil;
+  if(ref->owner != rstate)
+    rb_raise(rb_eTypeError, "%s belongs to another Lua::State", rb_obj_classname(value));
+
+  lua_rawgeti(state, LUA_REGISTRYINDEX, ref->ref);             // stack: |objt|...
+}
+
+static int call_ruby_proc(lua_State* state);
+static int rlua_bundle_gc(lua_State* state);
+static int rlua_push_shared(lua_State* state, VALUE value);
+static void rlua_shared_register(lua_State* state);
+static void rlua_buffer_register(lua_State* state);
+static int rlua_push_channel(lua_State* state, VALUE value);
+static void rlua_channel_register(lua_State* state);
+
+static int rlua_callback_gc(lua_State* state)
+{
+  rlua_Callback* callback = lua_touserdata(state, 1);
+  rlua_anchor_unlink(&callback->anchor);
+  return 0;
 }
 
-static void rlua_add_ref_finalizer(VALUE state, VALUE ref, VALUE object)
+// Returns "file:line" of a proc or method, or the class name of other callables.
+static VALUE rlua_callback_name(VALUE proc)
 {
-  rb_hash_aset(rb_iv_get(state, "@refs"), rb_obj_id(object), ref);
+  if(rb_respond_to(proc, id_source_location)) {
+    VALUE location = rb_funcall(proc, id_source_location, 0);
+    if(RB_TYPE_P(location, T_ARRAY) && RARRAY_LEN(location) >= 2)
+      return rb_sprintf("%"PRIsVALUE":%"PRIsVALUE, RARRAY_AREF(location, 0), RARRAY_AREF(location, 1));
+  }
 
-  VALUE mObjectSpace = rb_const_get(rb_cObject, rb_intern("ObjectSpace"));
-  VALUE proc = rb_proc_new(rlua_finalize_ref, state);
-  rb_funcall(mObjectSpace, rb_intern("define_finalizer"), 2, object, proc);
+  return rb_class_name(rb_obj_class(proc));
 }
 
-static VALUE rlua_get_var(lua_State *state)
+// Finds or creates the profile called +name+.
+static rlua_Profile* rlua_profile_get(rlua_State* rstate, VALUE name)
 {
-  VALUE rbLuaState;
-  lua_getfield(state, LUA_REGISTRYINDEX, "rlua_state");
-  rbLuaState = (VALUE) lua_touserdata(state, -1);
-  lua_pop(state, 1);
+  rlua_Profile** link;
+  for(link = &rstate->profiles; *link; link = &(*link)->next) {
+    rlua_Profile* profile = *link;
+    if(profile->name_len == RSTRING_LEN(name) && !memcmp(profile->name, RSTRING_PTR(name), profile->name_len))
+      return profile;
+  }
+
+  rlua_Profile* profile = calloc(1, sizeof(rlua_Profile));
+  if(profile == NULL || (profile->name = malloc(RSTRING_LEN(name) + 1)) == NULL) {
+    free(profile);
+    rb_raise(rb_eNoMemError, "cannot allocate callback profile");
+  }
+  memcpy(profile->name, RSTRING_PTR(name), RSTRING_LEN(name));
+  profile->name[RSTRING_LEN(name)] = 0;
+  profile->name_len = RSTRING_LEN(name);
+
+  *link = profile;
+  return profile;
+}
+
+/*
+ * Pushes a Lua closure calling Ruby +proc+. Calls are profiled under +name+
+ * if it is not nil, or under rlua_callback_name if the state profiles every
+ * callback. See rlua_async_run for +async+.
+ */
+static void rlua_push_callback(lua_State* state, VALUE proc, VALUE name, int async)
+{
+  rlua_State* rstate = RLUA_STATE(state);
+  rlua_Profile* profile = NULL;
+
+  if(name == Qnil && rstate->profile_callbacks)
+    name = rlua_callback_name(proc);
+  if(name != Qnil) {
+    if(SYMBOL_P(name))
+      name = rb_sym2str(name);
+    StringValue(name);
+    profile = rlua_profile_get(rstate, name);
+  }
+
+  rlua_Callback* callback = lua_newuserdatauv(state, sizeof(rlua_Callback), 0);
+  callback->anchor.value = proc;
+  callback->owner = rstate;
+  callback->profile = profile;
+  callback->async = async;
+  rlua_anchor_link(rstate, &callback->anchor);
+  luaL_setmetatable(state, "rlua.callback");
+
+  lua_pushcclosure(state, call_ruby_proc, 1);
+}
+
+/*
+ * Static Symbols are pushed as strings which are created once per state and
+ * kept in a table keyed by Symbol ID; their IDs are never reused. Dynamic
+ * Symbols, like those made by State#symbolize_keys, are not cached, as
+ * SYM2ID would make them permanent.
+ */
+static void rlua_push_symbol(lua_State* state, rlua_State* rstate, VALUE symbol)
+{
+  if(RB_DYNAMIC_SYM_P(symbol)) {
+    VALUE name = rb_sym2str(symbol);
+    lua_pushlstring(state, RSTRING_PTR(name), RSTRING_LEN(name));   // stack: |str |...
+    return;
+  }
+
+  ID id = SYM2ID(symbol);
+  lua_rawgeti(state, LUA_REGISTRYINDEX, rstate->symbols);             // stack: |syms|...
+  if(lua_rawgetp(state, -1, (void*) id) != LUA_TSTRING) {            //        |str?|syms|...
+    VALUE name = rb_id2str(id);
+    lua_pop(state, 1);                                               //        |syms|...
+    lua_pushlstring(state, RSTRING_PTR(name), RSTRING_LEN(name));    //        |str |syms|...
+    lua_pushvalue(state, -1);                                        //        |str |str |syms|...
+    lua_rawsetp(state, -3, (void*) id);                              //        |str |syms|...
+  }
+  lua_remove(state, -2);                                             //        |str |...
+}
 
+static VALUE rlua_get_var(lua_State *state)
+{
   switch(lua_type(state, -1)) {
     case LUA_TNONE:
     case LUA_TNIL:
@@ -73,7 +597,7 @@ static VALUE rlua_get_var(lua_State *state)
 
     case LUA_TNUMBER:
       if (lua_isinteger(state, -1)) {
-        return INT2FIX(lua_tointeger(state, -1));
+        return LL2NUM(lua_tointeger(state, -1));
       } else {
         return rb_float_new(lua_tonumber(state, -1));
       }
@@ -86,17 +610,188 @@ static VALUE rlua_get_var(lua_State *state)
     }
 
     case LUA_TTABLE:
-      return rb_funcall(cLuaTable, rb_intern("new"), 2, rbLuaState, rlua_makeref(state));
+      return rlua_wrap_ref(cLuaTable, state);
 
     case LUA_TFUNCTION:
-      return rb_funcall(cLuaFunction, rb_intern("new"), 2, rbLuaState, rlua_makeref(state));
+      return rlua_wrap_ref(cLuaFunction, state);
 
     default:
       rb_bug("rlua_get_var: unknown type %s", lua_typename(state, lua_type(state, -1)));
   }
 }
 
-static void rlua_push_var(lua_State *state, VALUE value)
+/*
+ * Struct and Data objects are converted to tables keyed by member names.
+ * The names of every class are converted once per state and kept in a
+ * "shape": a userdata anchoring the class (so that its address, the key of
+ * the shapes table, is never reused) with the array of names as user value.
+ */
+typedef struct {
+  rlua_Anchor anchor;
+} rlua_Shape;
+
+static VALUE rlua_cData = Qnil;  // ::Data of Ruby 3.2+, set by Init_rlua
+
+// Range and other core classes are T_STRUCT as well, but have no members.
+static int rlua_shaped(VALUE value)
+{
+  if(!RB_TYPE_P(value, T_STRUCT))
+    return 0;
+  return RTEST(rb_obj_is_kind_of(value, rb_cStruct)) ||
+         (rlua_cData != Qnil && RTEST(rb_obj_is_kind_of(value, rlua_cData)));
+}
+
+static int rlua_shape_gc(lua_State* state)
+{
+  rlua_Shape* shape = lua_touserdata(state, 1);
+  rlua_anchor_unlink(&shape->anchor);
+  return 0;
+}
+
+// Pushes the array of member names of Struct or Data class +klass+.
+static void rlua_push_shape(lua_State* state, rlua_State* rstate, VALUE klass)
+{
+  lua_rawgeti(state, LUA_REGISTRYINDEX, rstate->shapes);             // stack: |shps|...
+  if(lua_rawgetp(state, -1, (void*) klass) != LUA_TUSERDATA) {       //        |shp?|shps|...
+    lua_pop(state, 1);                                               //        |shps|...
+
+    VALUE members = rb_struct_s_members(klass);
+    long n = RARRAY_LEN(members);
+
+    rlua_Shape* shape = lua_newuserdatauv(state, sizeof(rlua_Shape), 1);
+    shape->anchor.value = klass;
+    rlua_anchor_link(rstate, &shape->anchor);
+    luaL_setmetatable(state, "rlua.shape");                          //        |shpe|shps|...
+
+    lua_createtable(state, n > INT_MAX ? INT_MAX : (int) n, 0);     //        |keys|shpe|shps|...
+    for(long i = 0; i < n; i++) {
+      rlua_push_symbol(state, rstate, RARRAY_AREF(members, i));
+      lua_rawseti(state, -2, i + 1);
+    }
+    lua_setiuservalue(state, -2, 1);                                 //        |shpe|shps|...
+
+    lua_pushvalue(state, -1);
+    lua_rawsetp(state, -3, (void*) klass);
+  }
+
+  lua_getiuservalue(state, -1, 1);                                   //        |keys|shpe|shps|...
+  lua_replace(state, -3);                                            //        |shpe|keys|...
+  lua_pop(state, 1);                                                 //        |keys|...
+}
+
+/*
+ * Conversion of nested Arrays, Hashes and Structs. Every container is converted once
+ * and its table is remembered in a "seen" table keyed by the object address
+ * (which cannot move, as the object is referenced from the C stack), so shared
+ * substructures stay shared and cycles become Lua cycles.
+ */
+struct rlua_push {
+  lua_State* state;
+  rlua_State* rstate;
+  VALUE value;
+  int seen;                      // stack index of the seen table
+  int depth;
+  long elements;
+  int max_depth;
+  long max_elements;
+};
+
+static void rlua_push_value(lua_State *state, VALUE value, struct rlua_push* push);
+
+static void rlua_push_count(struct rlua_push* push, long count)
+{
+  push->elements += count;
+  if(push->max_elements > 0 && push->elements > push->max_elements)
+    rb_raise(rb_eArgError, "more than %ld elements to convert", push->max_elements);
+}
+
+static void rlua_check_key(VALUE key)
+{
+  if(NIL_P(key) || (RB_FLOAT_TYPE_P(key) && isnan(RFLOAT_VALUE(key))))
+    rb_raise(rb_eArgError, "cannot use %"PRIsVALUE" as a Lua table key", rb_inspect(key));
+}
+
+static int rlua_push_pair(VALUE key, VALUE value, VALUE data)
+{
+  struct rlua_push* push = (struct rlua_push*) data;
+
+  rlua_check_key(key);
+
+  rlua_push_value(push->state, key, push);
+  rlua_push_value(push->state, value, push);
+  lua_rawset(push->state, -3);
+
+  return ST_CONTINUE;
+}
+
+static void rlua_push_container(struct rlua_push* push, VALUE value)
+{
+  lua_State* state = push->state;
+
+  if(lua_rawgetp(state, push->seen, (void*) value) == LUA_TTABLE)
+    return;
+  lua_pop(state, 1);
+
+  if(push->depth >= push->max_depth)
+    rb_raise(rb_eArgError, "nesting of %d is too deep", push->depth + 1);
+  if(!lua_checkstack(state, 5))
+    rb_raise(rb_eNoMemError, "cannot grow Lua stack");
+
+  push->depth++;
+  if(RB_TYPE_P(value, T_ARRAY)) {
+    long length = RARRAY_LEN(value);
+    rlua_push_count(push, length);
+
+    lua_createtable(state, length > INT_MAX ? INT_MAX : (int) length, 0);
+    lua_pushvalue(state, -1);
+    lua_rawsetp(state, push->seen, (void*) value);
+
+    for(long i = 0; i < RARRAY_LEN(value); i++) {
+      rlua_push_value(state, RARRAY_AREF(value, i), push);
+      lua_rawseti(state, -2, i + 1);
+    }
+  } else if(RB_TYPE_P(value, T_HASH)) {
+    long size = RHASH_SIZE(value);
+    rlua_push_count(push, size);
+
+    lua_createtable(state, 0, size > INT_MAX ? INT_MAX : (int) size);
+    lua_pushvalue(state, -1);
+    lua_rawsetp(state, push->seen, (void*) value);
+
+    rb_hash_foreach(value, rlua_push_pair, (VALUE) push);
+  } else {
+    long length = RSTRUCT_LEN(value);
+    rlua_push_count(push, length);
+
+    rlua_push_shape(state, push->rstate, rb_obj_class(value));
+                                                   // stack: |keys|...
+    int keys = lua_gettop(state);
+
+    lua_createtable(state, 0, length > INT_MAX ? INT_MAX : (int) length);
+    lua_pushvalue(state, -1);
+    lua_rawsetp(state, push->seen, (void*) value); //        |tbl |keys|...
+
+    for(long i = 0; i < length; i++) {
+      lua_rawgeti(state, keys, i + 1);
+      rlua_push_value(state, RSTRUCT_GET(value, i), push);
+      lua_rawset(state, -3);
+    }
+    lua_remove(state, keys);                       //        |tbl |...
+  }
+  push->depth--;
+}
+
+static VALUE rlua_push_protected(VALUE data)
+{
+  struct rlua_push* push = (struct rlua_push*) data;
+  rlua_push_container(push, push->value);
+  return Qnil;
+}
+
+// Elements of containers use the rlua_State of +push+; other values look it up.
+#define RLUA_PUSH_RSTATE(state, push) ((push) ? (push)->rstate : RLUA_STATE(state))
+
+static void rlua_push_value(lua_State *state, VALUE value, struct rlua_push* push)
 {
   switch (TYPE(value)) {
     case T_NIL:
@@ -108,6 +803,10 @@ static void rlua_push_var(lua_State *state, VALUE value)
       lua_pushlstring(state, RSTRING_PTR(string), RSTRING_LEN(string));
       break;
     }
+    case T_SYMBOL:
+      rlua_push_symbol(state, RLUA_PUSH_RSTATE(state, push), value);
+      break;
+
     case T_FIXNUM:
       lua_pushinteger(state, FIX2LONG(value));
       break;
@@ -117,131 +816,653 @@ static void rlua_push_var(lua_State *state, VALUE value)
        lua_pushnumber(state, NUM2DBL(value));
        break;
 
-    case T_ARRAY: {
-      int table, i;
-
-      lua_newtable(state);
-      table = lua_gettop(state);
-       for(i = 0; i < RARRAY_LEN(value); i++) {
-         rlua_push_var(state, RARRAY_PTR(value)[i]);
-         lua_rawseti(state, table, i+1);
-      }
+    case T_ARRAY:
+    case T_HASH:
+      rlua_push_container(push, value);
       break;
-    }
 
-    case T_HASH: {
-      int i;
-      VALUE keys;
+    case T_DATA:
+      if(rb_typeddata_is_kind_of(value, &rlua_ref_type)) {
+        rlua_push_ref(state, RLUA_PUSH_RSTATE(state, push), value);
+        break;
+      } else if(rlua_push_shared(state, value)) {
+        break;
+      } else if(rlua_push_channel(state, value)) {
+        break;
+      } else if(rb_typeddata_is_kind_of(value, &rlua_state_type)) {
+        if(DATA_PTR(value) != RLUA_STATE(state))
+          rb_raise(rb_eTypeError, "cannot pass Lua::State to another Lua::State");
+#ifdef LUA_RIDX_MAINTHREAD
+        lua_rawgeti(state, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+        lua_pushthread(RLUA_STATE(state)->state);
+        lua_xmove(RLUA_STATE(state)->state, state, 1);
+#endif
+        break;
+      }
+      /* fallthrough */
 
-      lua_newtable(state);
-      keys = rb_funcall(value, rb_intern("keys"), 0);
-      for(i = 0; i < RARRAY_LEN(keys); i++) {
-        VALUE key = RARRAY_PTR(keys)[i];
-        rlua_push_var(state, key);
-        rlua_push_var(state, rb_hash_aref(value, key));
-        lua_settable(state, -3);
+    case T_STRUCT:
+      if(rlua_shaped(value)) {
+        rlua_push_container(push, value);
+        break;
       }
-      break;
-    }
+      /* fallthrough */
 
     default:
       if(value == Qtrue || value == Qfalse) {
         lua_pushboolean(state, value == Qtrue);
-      } else if(rb_obj_class(value) == cLuaTable || rb_obj_class(value) == cLuaFunction) {
-        lua_getfield(state, LUA_REGISTRYINDEX, "rlua");              // stack: |refs|...
-        lua_rawgeti(state, -1, FIX2INT(rb_iv_get(value, "@ref")));   //        |objt|refs|...
-        lua_remove(state, -2);                                       //        |objt|...
-      } else if(rb_obj_class(value) == cLuaState) {
-        lua_State* state;
-        Data_Get_Struct(rb_iv_get(value, "@state"), lua_State, state);
-        lua_pushthread(state);
-      } else if(rb_respond_to(value, rb_intern("call"))) {
-        VALUE rbLuaState;
-        lua_getfield(state, LUA_REGISTRYINDEX, "rlua_state");
-        rbLuaState = (VALUE) lua_touserdata(state, -1);
-        lua_pop(state, 1);
-
-        rlua_push_var(state, rb_funcall(cLuaFunction, rb_intern("new"), 2, rbLuaState, value));
+      } else if(rb_respond_to(value, id_call)) {
+        rlua_push_callback(state, value, Qnil, 0);
       } else {
         rb_raise(rb_eTypeError, "wrong argument type %s", rb_obj_classname(value));
       }
   }
 }
 
-static const char* rlua_reader(lua_State* state, void *data, size_t *size)
+static void rlua_push_var(lua_State *state, VALUE value)
 {
-  VALUE code = (VALUE) data;
+  if(!RB_TYPE_P(value, T_ARRAY) && !RB_TYPE_P(value, T_HASH) && !rlua_shaped(value)) {
+    rlua_push_value(state, value, NULL);
+    return;
+  }
 
-  if(rb_iv_get(code, "@read") != Qnil) {
-    *size = 0;
-    return NULL;
-  } else {
-    *size = RSTRING_LEN(code);
-    rb_iv_set(code, "@read", Qtrue);
-    return RSTRING_PTR(code);
+  rlua_State* rstate = RLUA_STATE(state);
+  int top = lua_gettop(state), error;
+  struct rlua_push push = { state, rstate, value, top + 1, 0, 0, rstate->max_depth, rstate->max_elements };
+
+  if(!lua_checkstack(state, 4))
+    rb_raise(rb_eNoMemError, "cannot grow Lua stack");
+  lua_newtable(state);                            // stack: |seen|...
+
+  rb_protect(rlua_push_protected, (VALUE) &push, &error);
+  if(error) {
+    lua_settop(state, top);
+    rb_jump_tag(error);
   }
+
+  lua_remove(state, top + 1);                     //        |tbl|...
 }
 
-static void rlua_load_string(lua_State* state, VALUE code, VALUE chunkname)
+struct rlua_chunk {
+  const char* code;
+  size_t size;
+};
+
+static const char* rlua_reader(lua_State* state, void *data, size_t *size)
+{
+  struct rlua_chunk* chunk = data;
+
+  *size = chunk->size;
+  chunk->size = 0;
+
+  return *size ? chunk->code : NULL;
+}
+
+static int rlua_load_status(lua_State* state, VALUE code, VALUE chunkname)
 {
   Check_Type(code, T_STRING);
   Check_Type(chunkname, T_STRING);
 
   // do not interfere with users' string
   VALUE interm_code = rb_str_new3(code);
+  struct rlua_chunk chunk = { RSTRING_PTR(interm_code), RSTRING_LEN(interm_code) };
 
-  int retval = lua_load(state, rlua_reader, (void*) interm_code, RSTRING_PTR(chunkname), NULL);
-  if(retval != 0) {
-    size_t errlen;
-    const char* errstr = lua_tolstring(state, -1, &errlen);
-    VALUE error = rb_str_new(errstr, errlen);
-    lua_pop(state, 1);
-    if(retval == LUA_ERRMEM)
-      rb_exc_raise(rb_exc_new3(rb_eNoMemError, error));
-    else if(retval == LUA_ERRSYNTAX)
-      rb_exc_raise(rb_exc_new3(rb_eSyntaxError, error));
-  }
+  int retval = lua_load(state, rlua_reader, &chunk, StringValueCStr(chunkname), NULL);
+  RB_GC_GUARD(interm_code);
+
+  return retval;
 }
 
-static VALUE rlua_pcall(lua_State* state, int argc)
+// Converts error object on top of the stack to a message, without
+// invoking any metamethods.
+static VALUE rlua_error_message(lua_State* state)
 {
-  // stack: |argN-arg1|func|...
-  //         <N pts.>  <1>
-  int base = lua_gettop(state) - 1 - argc;
+  size_t errlen;
+  const char* errstr;
 
-  int retval = lua_pcall(state, argc, LUA_MULTRET, 0);
-  if(retval != 0) {
-    size_t errlen;
-    const char* errstr = lua_tolstring(state, -1, &errlen);
-    VALUE error = rb_str_new(errstr, errlen);
-    lua_pop(state, 1);
+  if(lua_type(state, -1) == LUA_TSTRING || lua_type(state, -1) == LUA_TNUMBER)
+    errstr = lua_tolstring(state, -1, &errlen);
+  else
+    return rb_sprintf("(error object is a %s value)", luaL_typename(state, -1));
 
-    if(retval == LUA_ERRRUN)
-      rb_exc_raise(rb_exc_new3(rb_eRuntimeError, error));
-    else if(retval == LUA_ERRSYNTAX)
-      rb_exc_raise(rb_exc_new3(rb_eSyntaxError, error));
-    else
-      rb_fatal("unknown lua_pcall return value");
-  } else {
-    VALUE retval;
-    int n = lua_gettop(state) - base;
-    if(n == 0) {
-      return Qnil;
-    } else if(n == 1) {
-      retval = rlua_get_var(state);
+  return rb_str_new(errstr, errlen);
+}
+
+static int rlua_packet_write(rlua_Packet* packet, const void* data, size_t size);
+
+#define RLUA_TRACE_FRAMES 32
+
+/*
+ * Message handler of rlua_pcall. Copies source, line and function name of
+ * every active frame into the trace buffer of the state as NUL-terminated
+ * strings; they are only parsed and formatted if Lua::Error#backtrace is
+ * read. The error value itself is returned unchanged.
+ */
+static int rlua_error_handler(lua_State* state)
+{
+  rlua_Packet* trace = &RLUA_STATE(state)->trace;
+  lua_Debug ar;
+  char line[16];
+
+  trace->size = 0;
+  for(int level = 1; level <= RLUA_TRACE_FRAMES && lua_getstack(state, level, &ar); level++) {
+    lua_getinfo(state, "Sln", &ar);
+    snprintf(line, sizeof(line), "%d", ar.currentline);
+
+    const char* name = ar.name ? ar.name : (*ar.what == 'm' ? "main chunk" : "?");
+    if(!rlua_packet_write(trace, ar.short_src, strlen(ar.short_src) + 1) ||
+       !rlua_packet_write(trace, line, strlen(line) + 1) ||
+       !rlua_packet_write(trace, name, strlen(name) + 1))
+      break;
+  }
+
+  return 1;
+}
+
+// Pops error object and raises exception for +status+. Runtime errors
+// which passed through rlua_error_handler carry its trace if +traced+.
+static void rlua_raise_error(lua_State* state, int status, int traced)
+{
+  rlua_State* rstate = RLUA_STATE(state);
+
+  // An error raised by a Ruby callback which Lua did not handle is
+  // re-raised as the original exception.
+  VALUE original = rstate->callback_error, message = rstate->callback_message;
+  rstate->callback_error = rstate->callback_message = Qnil;
+  if(status == LUA_ERRRUN && original != Qnil && lua_type(state, -1) == LUA_TSTRING) {
+    size_t length;
+    const char* string = lua_tolstring(state, -1, &length);
+    if((size_t) RSTRING_LEN(message) == length && !memcmp(RSTRING_PTR(message), string, length)) {
       lua_pop(state, 1);
-      return retval;
-    } else if(n > 1) {
-      retval = rb_ary_new();
-      while(n--) {
-        rb_ary_unshift(retval, rlua_get_var(state));
-        lua_pop(state, 1);
-      }
-    } else {
-      rb_bug("base > top!");
+      rb_exc_raise(original);
+    }
+  }
+
+  VALUE error = rlua_error_message(state);
+  lua_pop(state, 1);
+
+  if(status == LUA_ERRMEM)
+    rb_exc_raise(rb_exc_new3(rb_eNoMemError, error));
+  else if(status == LUA_ERRSYNTAX)
+    rb_exc_raise(rb_exc_new3(rb_eSyntaxError, error));
+
+  VALUE exception = rb_exc_new3(cLuaError, error);
+  if(traced && status == LUA_ERRRUN) {
+    rlua_Packet* trace = &RLUA_STATE(state)->trace;
+    rb_ivar_set(exception, id_trace, rb_str_new(trace->data, trace->size));
+  }
+  rb_exc_raise(exception);
+}
+
+static void rlua_load_string(lua_State* state, VALUE code, VALUE chunkname)
+{
+  int retval = rlua_load_status(state, code, chunkname);
+  if(retval != LUA_OK)
+    rlua_raise_error(state, retval, 0);
+}
+
+/*
+ * Count hook which lets Ruby threads, signal handlers, Thread#raise and
+ * Timeout run while Lua code is executing. If an interrupt raises, the
+ * Lua call is unwound with an error (again on every hook call, should Lua
+ * code catch it) and the Ruby exception is re-raised by rlua_check_pending.
+ */
+static VALUE rlua_check_ints(VALUE unused)
+{
+  rb_thread_check_ints();
+  return Qnil;
+}
+
+static void rlua_interrupt_hook(lua_State* state, lua_Debug* ar)
+{
+  rlua_State* rstate = RLUA_STATE(state);
+
+  // Lua errors may only unwind to lua_pcall of this extension, never
+  // through Ruby frames (e.g. a metamethod run by Lua::Table#[]).
+  if(!rstate->in_pcall)
+    return;
+
+  if(!rstate->pending_tag) {
+    rb_protect(rlua_check_ints, Qnil, &rstate->pending_tag);
+    if(!rstate->pending_tag)
+      return;
+    rstate->pending = rb_errinfo();
+  }
+
+  lua_pushliteral(state, "interrupted by Ruby");
+  lua_error(state);
+}
+
+static int rlua_protected_call(lua_State* state, int argc, int handler)
+{
+  rlua_State* rstate = RLUA_STATE(state);
+
+  if(!rstate->in_pcall)
+    rstate->callback_error = rstate->callback_message = Qnil;
+
+  rstate->in_pcall++;
+  int retval = lua_pcall(state, argc, LUA_MULTRET, handler);
+  rstate->in_pcall--;
+
+  return retval;
+}
+
+// Re-raises a Ruby interrupt caught by rlua_interrupt_hook, if any, after
+// restoring the stack to +base+.
+static void rlua_check_pending(lua_State* state, int base)
+{
+  rlua_State* rstate = RLUA_STATE(state);
+  int tag = rstate->pending_tag;
+
+  if(!tag)
+    return;
+
+  VALUE pending = rstate->pending;
+  rstate->pending_tag = 0;
+  rstate->pending = Qnil;
+  lua_settop(state, base);
+
+  if(rb_obj_is_kind_of(pending, rb_eException))
+    rb_exc_raise(pending);
+  rb_jump_tag(tag);
+}
+
+// Pops values above +base+ and appends them to +results+ in order.
+static void rlua_push_results(lua_State* state, int base, VALUE results)
+{
+  int top = lua_gettop(state);
+
+  for(int i = base + 1; i <= top; i++) {
+    lua_pushvalue(state, i);
+    rb_ary_push(results, rlua_get_var(state));
+    lua_pop(state, 1);
+  }
+  lua_settop(state, base);
+}
+
+// Pops values above +base+: nil for none, the value for one, an Array for more.
+static VALUE rlua_results(lua_State* state, int base)
+{
+  VALUE results;
+  int n = lua_gettop(state) - base;
+  if(n == 0) {
+    return Qnil;
+  } else if(n == 1) {
+    results = rlua_get_var(state);
+    lua_pop(state, 1);
+  } else if(n > 1) {
+    results = rb_ary_new_capa(n);
+    rlua_push_results(state, base, results);
+  } else {
+    rb_bug("base > top!");
+  }
+
+  return results;
+}
+
+static VALUE rlua_pcall(lua_State* state, int argc)
+{
+  // stack: |argN-arg1|func|...
+  //         <N pts.>  <1>
+  int base = lua_gettop(state) - 1 - argc;
+
+  lua_pushcfunction(state, rlua_error_handler);
+  lua_insert(state, base + 1);                     // stack: |argN-arg1|func|hdlr|...
+
+  int retval = rlua_protected_call(state, argc, base + 1);
+  lua_remove(state, base + 1);
+  rlua_check_pending(state, base);
+  if(retval != LUA_OK)
+    rlua_raise_error(state, retval, 1);
+
+  return rlua_results(state, base);
+}
+
+/*
+ * Builds a result of a non-raising call like Lua pcall does:
+ * [true, *results] or [false, message, error_value]. The error value is
+ * converted as any other Lua value, so tables stay tables.
+ */
+static VALUE rlua_try_results(lua_State* state, int base, int status)
+{
+  VALUE results = rb_ary_new_capa(lua_gettop(state) - base + 1);
+
+  if(status == LUA_OK) {
+    rb_ary_push(results, Qtrue);
+  } else {
+    rb_ary_push(results, Qfalse);
+    rb_ary_push(results, rlua_error_message(state));
+  }
+  rlua_push_results(state, base, results);
+
+  return results;
+}
+
+static void rlua_state_init(rlua_State* rstate)
+{
+  rstate->self = Qnil;
+  rstate->pending = Qnil;
+  rstate->callback_error = Qnil;
+  rstate->callback_message = Qnil;
+  rstate->holders = 1;
+  rstate->max_depth = RLUA_DEFAULT_MAX_DEPTH;
+  rb_nativethread_lock_initialize(&rstate->lock);
+  rstate->anchors.prev = rstate->anchors.next = &rstate->anchors;
+}
+
+static VALUE rlua_state_alloc(VALUE klass)
+{
+  rlua_State* rstate;
+  VALUE self = TypedData_Make_Struct(klass, rlua_State, &rlua_state_type, rstate);
+
+  rlua_state_init(rstate);
+
+  return self;
+}
+
+static VALUE rlua_ref_alloc(VALUE klass)
+{
+  rlua_Ref* ref;
+  VALUE self = TypedData_Make_Struct(klass, rlua_Ref, &rlua_ref_type, ref);
+
+  ref->state = Qnil;
+  ref->ref = LUA_NOREF;
+
+  return self;
+}
+
+/*
+ * Converts the key on top of the stack, honoring State#symbolize_keys. The
+ * Symbols are dynamic, so keys made up by Lua code can be collected again.
+ */
+static VALUE rlua_get_key(lua_State* state, rlua_State* rstate)
+{
+  if(rstate->symbolize_keys && lua_type(state, -1) == LUA_TSTRING) {
+    size_t length;
+    const char* string = lua_tolstring(state, -1, &length);
+    return rb_str_intern(rb_enc_str_new(string, length, rb_default_external_encoding()));
+  }
+
+  return rlua_get_var(state);
+}
+
+/*
+ * Change-tracked tables, see Lua::Table#track_changes!. A tracked table is
+ * an empty proxy; its metatable holds the contents (__index, the shadow
+ * table), the dirty keys (__changes, key => RLUA_TRACK_*) and, for tables
+ * tracked as part of another one, the place they are stored at (__parent
+ * and __parentkey), to which their changes propagate.
+ */
+enum { RLUA_TRACK_SET = 1, RLUA_TRACK_NESTED = 2 };
+
+static int rlua_track_newindex(lua_State* state);
+
+static int rlua_tracked(lua_State* state, int index)
+{
+  if(!lua_getmetatable(state, index))               // stack: |meta|...
+    return 0;
+
+  lua_getfield(state, -1, "__newindex");            //        |nidx|meta|...
+  int tracked = lua_tocfunction(state, -1) == rlua_track_newindex;
+  lua_pop(state, 2);                                //        ...
+
+  return tracked;
+}
+
+// Pushes a field of the metatable of the tracked table at +index+.
+static void rlua_track_field(lua_State* state, int index, const char* name)
+{
+  lua_getmetatable(state, index);                   // stack: |meta|...
+  lua_getfield(state, -1, name);                    //        |valu|meta|...
+  lua_remove(state, -2);                            //        |valu|...
+}
+
+// Replaces a tracked table on top of the stack with its contents.
+static void rlua_track_contents(lua_State* state)
+{
+  if(rlua_tracked(state, -1)) {                     // stack: |this|...
+    rlua_track_field(state, -1, "__index");         //        |shdw|this|...
+    lua_remove(state, -2);                          //        |shdw|...
+  }
+}
+
+// Records a change of +key+ in the tracked +table+, and in its ancestors.
+static void rlua_track_mark(lua_State* state, int table, int key, int kind)
+{
+  int top = lua_gettop(state);
+  luaL_checkstack(state, 8, NULL);
+
+  lua_pushvalue(state, table);                      // stack: |tbl |...
+  lua_pushvalue(state, key);                        //        |key |tbl |...
+  while(rlua_tracked(state, -2)) {
+    rlua_track_field(state, -2, "__changes");       //        |chgs|key |tbl |...
+    lua_pushvalue(state, -2);                       //        |key |chgs|key |tbl |...
+    int old = lua_rawget(state, -2) == LUA_TNIL ? 0 : (int) lua_tointeger(state, -1);
+    lua_pop(state, 1);                              //        |chgs|key |tbl |...
+    if(old == RLUA_TRACK_SET || old == kind)
+      break;
+
+    lua_pushvalue(state, -2);                       //        |key |chgs|key |tbl |...
+    lua_pushinteger(state, kind);                   //        |kind|key |chgs|key |tbl |...
+    lua_rawset(state, -3);                          //        |chgs|key |tbl |...
+    if(old != 0)
+      break;
+
+    // Propagate to the parent, unless the table was since replaced there.
+    rlua_track_field(state, -3, "__parent");        //        |prnt|chgs|key |tbl |...
+    if(lua_isnil(state, -1))
+      break;
+    rlua_track_field(state, -4, "__parentkey");     //        |pkey|prnt|chgs|key |tbl |...
+    rlua_track_field(state, -2, "__index");         //        |pshd|pkey|prnt|chgs|key |tbl |...
+    lua_pushvalue(state, -2);                       //        |pkey|pshd|pkey|prnt|chgs|key |tbl |...
+    lua_rawget(state, -2);                          //        |chld|pshd|pkey|prnt|chgs|key |tbl |...
+    int attached = lua_rawequal(state, -1, -7);
+    lua_pop(state, 2);                              //        |pkey|prnt|chgs|key |tbl |...
+    if(!attached)
+      break;
+
+    lua_replace(state, -4);                         //        |prnt|chgs|pkey|tbl |...
+    lua_replace(state, -4);                         //        |chgs|pkey|prnt|...
+    lua_pop(state, 1);                              //        |pkey|prnt|...
+    kind = RLUA_TRACK_NESTED;
+  }
+
+  lua_settop(state, top);
+}
+
+static int rlua_track_len(lua_State* state)
+{
+  rlua_track_field(state, 1, "__index");
+  lua_pushinteger(state, (lua_Integer) lua_rawlen(state, -1));
+  return 1;
+}
+
+static int rlua_track_next(lua_State* state)
+{
+  lua_settop(state, 2);
+  if(lua_next(state, 1))
+    return 2;
+
+  lua_pushnil(state);
+  return 1;
+}
+
+static int rlua_track_pairs(lua_State* state)
+{
+  lua_pushcfunction(state, rlua_track_next);
+  rlua_track_field(state, 1, "__index");
+  lua_pushnil(state);
+  return 3;
+}
+
+// Turns the table at +index+ into a tracking proxy, unless it has a metatable.
+static void rlua_track_table(lua_State* state, int index, int nested, int parent, int key)
+{
+  luaL_checkstack(state, 8, "tables are nested too deeply");
+  index = lua_absindex(state, index);
+  if(parent) {
+    parent = lua_absindex(state, parent);
+    key = lua_absindex(state, key);
+  }
+
+  if(lua_getmetatable(state, index)) {
+    lua_pop(state, 1);
+    return;
+  }
+
+  lua_newtable(state);                              // stack: |shdw|...
+  lua_pushnil(state);                               //        |nil |shdw|...
+  while(lua_next(state, index)) {                   //        |valu|key |shdw|...
+    lua_pushvalue(state, -2);                       //        |key |valu|key |shdw|...
+    lua_insert(state, -2);                          //        |valu|key |key |shdw|...
+    lua_rawset(state, -4);                          //        |key |shdw|...
+    lua_pushvalue(state, -1);                       //        |key |key |shdw|...
+    lua_pushnil(state);                             //        |nil |key |key |shdw|...
+    lua_rawset(state, index);                       //        |key |shdw|...
+  }
+
+  lua_createtable(state, 0, 8);                     //        |meta|shdw|...
+  lua_pushvalue(state, -2);
+  lua_setfield(state, -2, "__index");
+  lua_pushcfunction(state, rlua_track_newindex);
+  lua_setfield(state, -2, "__newindex");
+  lua_pushcfunction(state, rlua_track_len);
+  lua_setfield(state, -2, "__len");
+  lua_pushcfunction(state, rlua_track_pairs);
+  lua_setfield(state, -2, "__pairs");
+  lua_newtable(state);
+  lua_setfield(state, -2, "__changes");
+  lua_pushboolean(state, nested);
+  lua_setfield(state, -2, "__nested");
+  if(parent) {
+    lua_pushvalue(state, parent);
+    lua_setfield(state, -2, "__parent");
+    lua_pushvalue(state, key);
+    lua_setfield(state, -2, "__parentkey");
+  }
+  lua_setmetatable(state, index);                   //        |shdw|...
+
+  if(nested) {
+    lua_pushnil(state);                             //        |nil |shdw|...
+    while(lua_next(state, -2)) {                    //        |valu|key |shdw|...
+      if(lua_type(state, -1) == LUA_TTABLE)
+        rlua_track_table(state, -1, 1, index, -2);
+      lua_pop(state, 1);                            //        |key |shdw|...
     }
-    return retval;
   }
+  lua_pop(state, 1);                                //        ...
+}
+
+static int rlua_track_newindex(lua_State* state)
+{
+  lua_settop(state, 3);                             // stack: |valu|key |this|
+  rlua_track_field(state, 1, "__index");            //        |shdw|valu|key |this|
+  lua_pushvalue(state, 2);
+  lua_rawget(state, 4);                             //        |old |shdw|valu|key |this|
+  int same = lua_rawequal(state, 3, 5);
+  lua_pop(state, 1);                                //        |shdw|valu|key |this|
+  if(same)
+    return 0;
+
+  if(lua_type(state, 3) == LUA_TTABLE) {
+    rlua_track_field(state, 1, "__nested");         //        |nstd|shdw|valu|key |this|
+    if(lua_toboolean(state, -1))
+      rlua_track_table(state, 3, 1, 1, 2);
+    lua_pop(state, 1);                              //        |shdw|valu|key |this|
+  }
+
+  lua_pushvalue(state, 2);
+  lua_pushvalue(state, 3);
+  lua_rawset(state, 4);                             //        |shdw|valu|key |this|
+  rlua_track_mark(state, 1, 2, RLUA_TRACK_SET);
+  return 0;
+}
+
+static int rlua_track_install(lua_State* state)
+{
+  rlua_track_table(state, 1, lua_toboolean(state, 2), 0, 0);
+  return 0;
+}
+
+// Converts the journal of the tracked table on top of the stack.
+static VALUE rlua_track_changes(lua_State* state)
+{
+  if(!lua_checkstack(state, 6))
+    rb_raise(rb_eNoMemError, "cannot grow Lua stack");
+
+  rlua_State* rstate = RLUA_STATE(state);
+  VALUE changes = rb_hash_new();
+  rlua_track_field(state, -1, "__index");           // stack: |shdw|this|...
+  rlua_track_field(state, -2, "__changes");         //        |chgs|shdw|this|...
+  lua_pushnil(state);                               //        |nil |chgs|shdw|this|...
+  while(lua_next(state, -2)) {                      //        |kind|key |chgs|shdw|this|...
+    int kind = (int) lua_tointeger(state, -1);
+    lua_pop(state, 1);                              //        |key |chgs|shdw|this|...
+    VALUE key = rlua_get_key(state, rstate);
+    lua_pushvalue(state, -1);                       //        |key |key |chgs|shdw|this|...
+    lua_rawget(state, -4);                          //        |valu|key |chgs|shdw|this|...
+    VALUE value;
+    if(kind == RLUA_TRACK_NESTED && rlua_tracked(state, -1))
+      value = rlua_track_changes(state);
+    else
+      value = rlua_get_var(state);
+    lua_pop(state, 1);                              //        |key |chgs|shdw|this|...
+    rb_hash_aset(changes, key, value);
+  }
+  lua_pop(state, 2);                                //        |this|...
+
+  return changes;
+}
+
+// Clears the journal of the tracked table on top of the stack and of its children.
+static void rlua_track_reset(lua_State* state)
+{
+  if(!lua_checkstack(state, 6))
+    rb_raise(rb_eNoMemError, "cannot grow Lua stack");
+
+  rlua_track_field(state, -1, "__index");           // stack: |shdw|this|...
+  rlua_track_field(state, -2, "__changes");         //        |chgs|shdw|this|...
+  lua_pushnil(state);                               //        |nil |chgs|shdw|this|...
+  while(lua_next(state, -2)) {                      //        |kind|key |chgs|shdw|this|...
+    lua_pop(state, 1);                              //        |key |chgs|shdw|this|...
+    lua_pushvalue(state, -1);                       //        |key |key |chgs|shdw|this|...
+    lua_pushnil(state);                             //        |nil |key |key |chgs|shdw|this|...
+    lua_rawset(state, -4);                          //        |key |chgs|shdw|this|...
+    lua_pushvalue(state, -1);                       //        |key |key |chgs|shdw|this|...
+    lua_rawget(state, -4);                          //        |valu|key |chgs|shdw|this|...
+    if(rlua_tracked(state, -1))
+      rlua_track_reset(state);
+    lua_pop(state, 1);                              //        |key |chgs|shdw|this|...
+  }
+  lua_pop(state, 2);                                //        |this|...
+}
+
+/*
+ * Takes a new reference to the value of registry slot +index+, which must be
+ * of +type+. The slot itself is never adopted: it may be one of the
+ * predefined registry entries, or a reference which another object releases.
+ */
+static int rlua_copy_ref(lua_State* state, VALUE index, int type)
+{
+  if(lua_rawgeti(state, LUA_REGISTRYINDEX, FIX2INT(index)) != type) { // stack: |valu|...
+    lua_pop(state, 1);                                                //        ...
+    rb_raise(rb_eArgError, "registry slot %d does not hold a %s", FIX2INT(index), lua_typename(state, type));
+  }
+
+  int ref = rlua_makeref(state);
+  lua_pop(state, 1);                                                  //        ...
+
+  return ref;
+}
+
+static rlua_Ref* rlua_get_ref(VALUE self)
+{
+  rlua_Ref* ref = rb_check_typeddata(self, &rlua_ref_type);
+  if(ref->owner != NULL)
+    rb_raise(rb_eArgError, "%s is already initialized", rb_obj_classname(self));
+
+  return ref;
 }
 
 /* :nodoc: */
@@ -250,28 +1471,21 @@ static VALUE rbLuaTable_initialize(int argc, VALUE* argv, VALUE self)
   VALUE rbLuaState, ref;
   rb_scan_args(argc, argv, "11", &rbLuaState, &ref);
 
-  VALUE stateSource = rb_obj_class(rbLuaState);
-  if(stateSource != cLuaState && stateSource != cLuaTable && stateSource != cLuaFunction)
-    rb_raise(rb_eTypeError, "wrong argument type %s (expected Lua::State, Lua::Table or Lua::Function)",
-           rb_obj_classname(rbLuaState));
-
-  VALUE rbState = rb_iv_get(rbLuaState, "@state");
-  rb_iv_set(self, "@state", rbState);
+  rlua_Ref* table = rlua_get_ref(self);
+  lua_State* state = rlua_get_state(rbLuaState);
 
+  int index;
   if(ref == Qnil) {
-    lua_State* state;
-    Data_Get_Struct(rbState, lua_State, state);
-
     lua_newtable(state);
-    ref = rlua_makeref(state);
+    index = rlua_makeref(state);
     lua_pop(state, 1);
-  } else if(TYPE(ref) != T_FIXNUM) {
+  } else if(TYPE(ref) == T_FIXNUM) {
+    index = rlua_copy_ref(state, ref, LUA_TTABLE);
+  } else {
     rb_raise(rb_eTypeError, "wrong argument type %s (expected nil)", rb_obj_classname(ref));
   }
 
-  rlua_add_ref_finalizer(rbState, ref, self);
-
-  rb_iv_set(self, "@ref", ref);
+  rlua_ref_attach(table, RLUA_STATE(state), index);
 
   return self;
 }
@@ -288,18 +1502,18 @@ static VALUE rbLuaTable_initialize(int argc, VALUE* argv, VALUE self)
  */
 static VALUE rbLuaTable_next(VALUE self, VALUE table, VALUE index)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(table, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(table);
 
   VALUE retval;
 
   rlua_push_var(state, table);                     // stack: |this|...
+  rlua_track_contents(state);
   rlua_push_var(state, index);                     //        |indx|this|...
   if(lua_next(state, -2) != 0) {                   //        |valu|key |this|...
     VALUE value, key;
     value = rlua_get_var(state);                   //        |valu|key |this|...
     lua_pop(state, 1);                             //        |key |this|...
-    key = rlua_get_var(state);                     //        |key |this|...
+    key = rlua_get_key(state, RLUA_STATE(state));  //        |key |this|...
     lua_pop(state, 2);                             //        ...
 
     retval = rb_ary_new();
@@ -321,8 +1535,7 @@ static VALUE rbLuaTable_next(VALUE self, VALUE table, VALUE index)
  */
 static VALUE rbLuaTable_get(VALUE self, VALUE index)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(self);
 
   VALUE value;
   rlua_push_var(state, self);                      // stack: |this|...
@@ -342,8 +1555,7 @@ static VALUE rbLuaTable_get(VALUE self, VALUE index)
  */
 static VALUE rbLuaTable_set(VALUE self, VALUE index, VALUE value)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(self);
 
   rlua_push_var(state, self);                      // stack: |this|...
   rlua_push_var(state, index);                     //        |indx|this|...
@@ -362,11 +1574,11 @@ static VALUE rbLuaTable_set(VALUE self, VALUE index, VALUE value)
  */
 static VALUE rbLuaTable_rawget(VALUE self, VALUE index)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(self);
 
   VALUE value;
   rlua_push_var(state, self);                      // stack: |this|...
+  rlua_track_contents(state);
   rlua_push_var(state, index);                     //        |indx|this|...
   lua_rawget(state, -2);                           //        |valu|this|...
   value = rlua_get_var(state);                     //        |valu|this|...
@@ -383,10 +1595,10 @@ static VALUE rbLuaTable_rawget(VALUE self, VALUE index)
  */
 static VALUE rbLuaTable_rawset(VALUE self, VALUE index, VALUE value)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(self);
 
   rlua_push_var(state, self);                      // stack: |this|...
+  rlua_track_contents(state);
   rlua_push_var(state, index);                     //        |indx|this|...
   rlua_push_var(state, value);                     //        |valu|indx|this|...
   lua_rawset(state, -3);                           //        |this|...
@@ -404,458 +1616,670 @@ static VALUE rbLuaTable_rawset(VALUE self, VALUE index, VALUE value)
  */
 static VALUE rbLuaTable_length(VALUE self)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(self);
 
   VALUE length;
   rlua_push_var(state, self);                      // stack: |this|...
+  rlua_track_contents(state);
   length = INT2FIX(lua_rawlen(state, -1));
   lua_pop(state, 1);                               //        ...
 
   return length;
 }
 
-static VALUE rbLuaFunction_call(VALUE self, VALUE args);
-
 /*
- * call-seq: table.method_missing(method, *args) -> *values
- *
- * This method allows accessing Lua tables much as if they were Ruby
- * objects.
+ * call-seq: Lua::Path.new("server.limits.rps") -> path
+ *           Lua::Path.new([:server, :limits, :rps]) -> path
  *
- * <b>Setting values</b> can be done with a standard <i>setter method</i>:
- * <tt>table.key = value</tt> is equivalent to <tt>table["key"] = value</tt>.
- *
- * <b>Getting values</b> is as easy as setting: if the value is not a function,
- * <tt>table.key</tt> is equivalent to <tt>table["key"]</tt>.
- *
- * If some table has a function as value, you can <b>invoke methods</b> on it.
- * <tt>table.method(arg1, ..., argN)</tt> is equivalent to
- * <tt>table["method"].call(arg1, ..., argN)</tt>, and
- * <tt>table.method!(arg1, ..., argN)</tt> is equivalent to
- * <tt>table["method"].call(table, arg1, ..., argN)</tt>.
- * To get a reference to function you should use the <tt>table["method"]</tt>
- * notation.
+ * Creates a path for Lua::Table#dig and Lua::State#dig. Segments of
+ * a string path which consist only of digits are integer keys.
  *
- * If the value is not present in table (which is equivalent to +nil+ value
- * in Lua) MethodNotFound exception will be raised; if you will attempt
- * to call something which is not a function as a method, TypeError exception
- * will be raised.
+ * Keys are stored as Symbols, so each state caches their Lua strings and
+ * a path can be reused without creating any objects.
  */
-static VALUE rbLuaTable_method_missing(int argc, VALUE* argv, VALUE self)
+static VALUE rbLuaPath_initialize(VALUE self, VALUE path)
 {
-  VALUE id, args;
-  rb_scan_args(argc, argv, "1*", &id, &args);
+  VALUE keys;
 
-  VALUE name = rb_str_new2(rb_id2name(rb_to_id(id)));
-
-  int is_method = 0;
-  int is_assign = 0;
-  if(RSTRING_PTR(name)[RSTRING_LEN(name) - 1] == '!')
-    is_method = 1;
-  if(RSTRING_PTR(name)[RSTRING_LEN(name) - 1] == '=')
-    is_assign = 1;
-
-  if(is_method || is_assign)
-    rb_str_resize(name, RSTRING_LEN(name) - 1);
-
-  if(is_assign) {
-    VALUE value;
-    rb_scan_args(argc, argv, "11", &id, &value);
-    return rbLuaTable_set(self, name, value);
+  if(RB_TYPE_P(path, T_ARRAY)) {
+    keys = rb_ary_new_capa(RARRAY_LEN(path));
+    for(long i = 0; i < RARRAY_LEN(path); i++) {
+      VALUE key = RARRAY_AREF(path, i);
+      rb_ary_push(keys, RB_TYPE_P(key, T_STRING) ? rb_str_intern(key) : key);
+    }
   } else {
-    VALUE value = rbLuaTable_get(self, name);
-    if(value == Qnil) {
-      return rb_call_super(argc, argv);
-    } else if(rb_obj_class(value) != cLuaFunction) {
-      if(is_method)
-        rb_raise(rb_eTypeError, "%s is not a Lua::Function", RSTRING_PTR(name));
-      return value;
-    } else {
-      if(is_method)
-        rb_ary_unshift(args, self);
-      return rbLuaFunction_call(value, args);
+    const char *p = StringValueCStr(path), *segment = p;
+    rb_encoding* encoding = rb_enc_get(path);
+
+    keys = rb_ary_new();
+    for(;; p++) {
+      if(*p != '.' && *p != 0)
+        continue;
+      if(p == segment)
+        rb_raise(rb_eArgError, "empty segment in Lua path %"PRIsVALUE, path);
+
+      const char* digit = segment;
+      while(digit < p && isdigit((unsigned char) *digit))
+        digit++;
+
+      if(digit == p)
+        rb_ary_push(keys, rb_str_to_inum(rb_str_new(segment, p - segment), 10, 0));
+      else
+        rb_ary_push(keys, ID2SYM(rb_intern3(segment, p - segment, encoding)));
+
+      if(*p == 0)
+        break;
+      segment = p + 1;
     }
   }
-}
 
-static int call_ruby_proc(lua_State* state)
-{
-  int i;
-  int argc = lua_gettop(state);
-  VALUE proc, args;
+  rb_ivar_set(self, id_keys, rb_ary_freeze(keys));
+  rb_obj_freeze(self);
 
-  proc = (VALUE) lua_touserdata(state, lua_upvalueindex(1));
-  args = rb_ary_new();
+  return self;
+}
 
-  for(i = 0; i < argc; i++) {
-    rb_ary_unshift(args, rlua_get_var(state));
-    lua_pop(state, 1);
-  }
+/*
+ * call-seq: path.keys -> array
+ *
+ * Returns keys of the path.
+ */
+static VALUE rbLuaPath_keys(VALUE self)
+{
+  return rb_ivar_get(self, id_keys);
+}
 
-  VALUE retval = rb_apply(proc, rb_intern("call"), args);
+/*
+ * Follows +keys+ starting from the value on top of the stack and replaces
+ * it with the result. Lua::Path arguments are expanded to their keys.
+ * Returns 0 if a nil was met halfway.
+ */
+static int rlua_dig(lua_State* state, int argc, VALUE* argv)
+{
+  for(int i = 0; i < argc; i++) {
+    if(rb_obj_is_kind_of(argv[i], cLuaPath)) {
+      VALUE keys = rb_ivar_get(argv[i], id_keys);
+      if(!rlua_dig(state, RARRAY_LENINT(keys), (VALUE*) RARRAY_CONST_PTR(keys)))
+        return 0;
+      continue;
+    }
 
-  if(rb_obj_class(retval) == cLuaMultret) {
-    VALUE array = rb_iv_get(retval, "@args");
-    int i;
+    switch(lua_type(state, -1)) {
+      case LUA_TNIL:
+        return 0;
 
-    for(i = 0; i < RARRAY_LEN(array); i++)
-      rlua_push_var(state, RARRAY_PTR(array)[i]);
+      case LUA_TTABLE:
+        break;
 
-    return RARRAY_LEN(array);
-  } else {
-    rlua_push_var(state, retval);
-    return 1;
+      default: {
+        const char* type = luaL_typename(state, -1);
+        lua_pop(state, 1);
+        rb_raise(rb_eTypeError, "cannot dig into Lua %s with %"PRIsVALUE, type, rb_inspect(argv[i]));
+      }
+    }
+
+    rlua_push_var(state, argv[i]);                 // stack: |key |tbl |...
+    lua_gettable(state, -2);                       //        |valu|tbl |...
+    lua_remove(state, -2);                         //        |valu|...
   }
+
+  return 1;
 }
 
 /*
- * call-seq: Lua::Function.new(state, proc)
+ * call-seq: table.dig(*keys) -> value
  *
- * Converts a Ruby closure +proc+ to a Lua function in Lua::State represented
- * by +state+. Note that you generally do not need to call this function
- * explicitly: any +proc+ or +lambda+ passed as a value for table assignment
- * will be automagically converted to Lua closure.
+ * Retrieves the value at path +keys+ like Hash#dig, returning nil if any
+ * intermediate value is nil. Keys may be Lua::Path objects. The whole path
+ * is resolved inside Lua and only the final value is converted, so no
+ * Lua::Table objects are created for intermediate tables.
+ *
+ *   config.dig(:server, :limits, :rps)
+ *   config.dig(Lua::Path.new("server.limits.rps"))
  */
-static VALUE rbLuaFunction_initialize(int argc, VALUE* argv, VALUE self)
+static VALUE rbLuaTable_dig(int argc, VALUE* argv, VALUE self)
 {
-  VALUE rbLuaState, ref = Qnil, func;
-  rb_scan_args(argc, argv, "11", &rbLuaState, &func);
+  lua_State* state = rlua_get_state(self);
 
-  if(rb_obj_class(rbLuaState) != cLuaState)
-    rb_raise(rb_eTypeError, "wrong argument type %s (expected Lua::State)", rb_obj_classname(rbLuaState));
+  rlua_push_var(state, self);                      // stack: |this|...
+  if(!lua_checkstack(state, 3))
+    rb_raise(rb_eNoMemError, "cannot grow Lua stack");
+
+  VALUE value = Qnil;
+  if(rlua_dig(state, argc, argv))                  //        |valu|...
+    value = rlua_get_var(state);
+  lua_pop(state, 1);                               //        ...
 
-  VALUE rbState = rb_iv_get(rbLuaState, "@state");
-  rb_iv_set(self, "@state", rbState);
+  return value;
+}
 
+/*
+ * Bulk writes into the table on top of the stack. Values are converted under
+ * rb_protect, so that the stack is restored if one cannot be converted.
+ * Raw writes go straight into the table; others may run __newindex, which
+ * can raise a Lua error, so they are staged as key/value pairs in a sequence
+ * and stored by rlua_bulk_store under lua_pcall.
+ */
+struct rlua_bulk {
   lua_State* state;
-  Data_Get_Struct(rbState, lua_State, state);
+  VALUE values;
+  int raw;
+  int table;                     // stack index of the table
+  lua_Integer staged;            // keys and values in the staging sequence on top
+};
 
-  VALUE proc = Qnil;
+static void rlua_bulk_set(struct rlua_bulk* bulk)
+{
+  // stack: |valu|key |...
+  if(bulk->raw) {
+    lua_rawset(bulk->state, bulk->table);          // stack: ...
+  } else {
+    lua_rawseti(bulk->state, -3, bulk->staged + 2);
+    lua_rawseti(bulk->state, -2, bulk->staged + 1);
+    bulk->staged += 2;
+  }
+}
 
-  if(TYPE(func) == T_FIXNUM)
-    ref = func;
-  else if(rb_respond_to(func, rb_intern("call")))
-    proc = func;
-  else
-    rb_raise(rb_eTypeError, "wrong argument type %s (expected Proc)", rb_obj_classname(func));
+static int rlua_bulk_pair(VALUE key, VALUE value, VALUE data)
+{
+  struct rlua_bulk* bulk = (struct rlua_bulk*) data;
 
-  if(ref == Qnil) {
-    lua_pushlightuserdata(state, (void*) proc);
-    lua_pushcclosure(state, call_ruby_proc, 1);
-    ref = rlua_makeref(state);
+  rlua_check_key(key);
+  rlua_push_var(bulk->state, key);                 // stack: |key |...
+  rlua_push_var(bulk->state, value);               //        |valu|key |...
+  rlua_bulk_set(bulk);
+
+  return ST_CONTINUE;
+}
+
+static VALUE rlua_bulk_merge(VALUE data)
+{
+  struct rlua_bulk* bulk = (struct rlua_bulk*) data;
+  rb_hash_foreach(bulk->values, rlua_bulk_pair, data);
+  return Qnil;
+}
+
+static VALUE rlua_bulk_concat(VALUE data)
+{
+  struct rlua_bulk* bulk = (struct rlua_bulk*) data;
+  lua_State* state = bulk->state;
+  lua_Integer length;
+
+  if(rlua_tracked(state, bulk->table)) {
+    rlua_track_field(state, bulk->table, "__index");
+    length = lua_rawlen(state, -1);
     lua_pop(state, 1);
+  } else {
+    length = lua_rawlen(state, bulk->table);
+  }
 
-    // don't allow GC to collect proc
-    rb_iv_set(self, "@proc", proc);
+  for(long i = 0; i < RARRAY_LEN(bulk->values); i++) {
+    lua_pushinteger(state, length + i + 1);
+    rlua_push_var(state, RARRAY_AREF(bulk->values, i));
+    rlua_bulk_set(bulk);
   }
 
-  rlua_add_ref_finalizer(rbState, ref, self);
+  return Qnil;
+}
 
-  rb_iv_set(self, "@ref", ref);
+// Stores +count+ staged keys and values into the table; see above.
+static int rlua_bulk_store(lua_State* state)
+{
+  // stack: |cnt |stg |tbl |
+  lua_Integer count = lua_tointeger(state, 3);
 
-  return self;
+  for(lua_Integer i = 1; i < count; i += 2) {
+    lua_rawgeti(state, 2, i);                      // stack: |key |cnt |stg |tbl |
+    lua_rawgeti(state, 2, i + 1);                  //        |valu|key |cnt |stg |tbl |
+    lua_settable(state, 1);                        //        |cnt |stg |tbl |
+  }
+
+  return 0;
 }
 
-/*
- * call-seq: func.call(*args) -> *values
- *
- * Invokes a Lua function in protected environment (like a Lua +xpcall+).
- *
- * One value returned in Lua is returned as one value in Ruby; multiple values
- * returned in Lua are returned as an array of them in Ruby. This convention
- * allows usage of identical code for calling methods with multiple return
- * values in both languages.
- *
- * While you can easily call Lua procedures and use their return values,
- * returning multiple values from Ruby is not that easy. RLua cannot
- * guess whether array returned by Ruby function is a 'real' array or
- * just several return values, so there is a Lua.multret proxy method for
- * that purpose. Ruby return values constructed with +multret+ method
- * are automatically unpacked to multiple return values. Example:
- *
- *   state = Lua::State.new
- *   state.p = lambda{ |*args| p *args }
- *   state.f1 = Lua::Function.new(state, lambda{ [ 1, 2, 3 ] })
- *   state.f2 = Lua::Function.new(state, lambda{ Lua.multret( 1, 2, 3 ) })
- *   state.__eval("p(f1())") # results in { 1.0, 2.0, 3.0 } Lua table
- *                           # shown as array
- *   state.__eval("p(f2())") # results in 1.0, 2.0, 3.0 Lua multiple return values
- *                           # shown as three separate values
- *
- * Any Lua error that has appeared during the call will be raised as Ruby
- * exception with message equal to Lua error message.
- * *Lua error messages are explicitly converted to strings with +lua_tostring+
- * function.*
- * Lua errors are mapped as follows:
- * LUA_ERRMEM:: NoMemError is raised.
- * LUA_ERRRUN:: RuntimeError is raised.
- *
- * Note that if any uncatched exception is raised in Ruby code inside
- * Lua::Function it will be propagated as Lua error. *In this case the
- * backtrace is lost!* Catch your exceptions in Ruby code if you want to
- * keep their backtraces.
- *
- * This 'drawback' is intentional: while it is technically possible to
- * re-raise the same Exception object, the backtrace will lead to re-raise
- * point anyway.
- */
-static VALUE rbLuaFunction_call(VALUE self, VALUE args)
+static void rlua_bulk_write(lua_State* state, VALUE (*write)(VALUE), VALUE values, int raw)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  struct rlua_bulk bulk = { state, values, raw, lua_gettop(state), 0 };
+  int top = bulk.table, error;
 
-  int i;
-  VALUE retval;
+  if(!lua_checkstack(state, 6))
+    rb_raise(rb_eNoMemError, "cannot grow Lua stack");
 
-  rlua_push_var(state, self);                      // stack: |this|...
-  for(i = 0; i < RARRAY_LEN(args); i++)
-    rlua_push_var(state, RARRAY_PTR(args)[i]);
-                                                   //        |argN-arg1|this|...
-  retval = rlua_pcall(state, RARRAY_LEN(args));    //        ...
+  if(!raw)
+    lua_newtable(state);                           // stack: |stg |tbl |...
 
-  return retval;
+  rb_protect(write, (VALUE) &bulk, &error);
+  if(error) {
+    lua_settop(state, top - 1);
+    rb_jump_tag(error);
+  }
+
+  if(raw) {
+    lua_settop(state, top - 1);
+    return;
+  }
+
+  lua_pushcfunction(state, rlua_bulk_store);       // stack: |func|stg |tbl |...
+  lua_insert(state, top);                          //        |stg |tbl |func|...
+  lua_pushinteger(state, bulk.staged);             //        |cnt |stg |tbl |func|...
+  int status = rlua_protected_call(state, 3, 0);   //        ...
+  rlua_check_pending(state, top - 1);
+  if(status != LUA_OK)
+    rlua_raise_error(state, status, 0);
+}
+
+static int rlua_raw_option(VALUE options)
+{
+  return options != Qnil && RTEST(rb_hash_aref(options, ID2SYM(rb_intern("raw"))));
 }
 
 /*
- * call-seq: Lua::State.new
+ * call-seq: table.merge!(hash, raw: false) -> table
  *
- * Creates a new Lua state.
+ * Stores all pairs of +hash+ into the table in a single call. With
+ * <tt>raw: true</tt>, writes bypass the __newindex metamethod.
  */
-static VALUE rbLua_initialize(VALUE self)
+static VALUE rbLuaTable_merge(int argc, VALUE* argv, VALUE self)
 {
-  lua_State* state = luaL_newstate();
+  VALUE hash, options;
+  rb_scan_args(argc, argv, "1:", &hash, &options);
+  Check_Type(hash, T_HASH);
 
-  VALUE rbState = Data_Wrap_Struct(rb_cObject, 0, lua_close, state);
-  rb_iv_set(self, "@state", rbState);
+  lua_State* state = rlua_get_state(self);
+  int raw = rlua_raw_option(options);
+  rlua_push_var(state, self);                      // stack: |this|...
+  if(raw)
+    rlua_track_contents(state);
+  rlua_bulk_write(state, rlua_bulk_merge, hash, raw);
 
-  lua_pushlightuserdata(state, (void*) self);
-  lua_setfield(state, LUA_REGISTRYINDEX, "rlua_state");
+  return self;
+}
 
-  lua_newtable(state);
-  lua_setfield(state, LUA_REGISTRYINDEX, "rlua");
+/*
+ * call-seq: table.concat(array, raw: false) -> table
+ *
+ * Appends all elements of +array+ after the last element of the table
+ * in a single call. With <tt>raw: true</tt>, writes bypass the __newindex
+ * metamethod.
+ */
+static VALUE rbLuaTable_concat(int argc, VALUE* argv, VALUE self)
+{
+  VALUE array, options;
+  rb_scan_args(argc, argv, "1:", &array, &options);
+  Check_Type(array, T_ARRAY);
 
-  rb_iv_set(rbState, "@refs", rb_hash_new());
-  rb_iv_set(rbState, "@procs", rb_ary_new());
+  lua_State* state = rlua_get_state(self);
+  int raw = rlua_raw_option(options);
+  rlua_push_var(state, self);                      // stack: |this|...
+  if(raw)
+    rlua_track_contents(state);
+  rlua_bulk_write(state, rlua_bulk_concat, array, raw);
 
   return self;
 }
 
 /*
- * call-seq: state.__eval(code[, chunkname='=&lt;eval&gt;']) -> *values
+ * call-seq: table.track_changes!(nested: false) -> table
  *
- * Runs +code+ in Lua interpreter. Optional argument +chunkname+
- * specifies a string that will be used in error messages and other
- * debug information as a file name.
+ * Starts journaling writes to the table, so that #changes can tell what
+ * Lua code modified without walking the whole table. The contents move to
+ * a shadow table and the table itself becomes an empty proxy, so it must
+ * not have a metatable already. Writes which store the value already
+ * present are not journaled.
  *
- * Start +chunkname+ with a @ to make Lua think the following is filename
- * (e.g. @test.lua); start it with a = to indicate a non-filename stream
- * (e.g. =stdin). Anything other is interpreted as a plaintext Lua code and
- * a few starting characters will be shown.
+ * With <tt>nested: true</tt>, tables stored in the table (now or later)
+ * are tracked too, unless they have a metatable, and their changes are
+ * reported under the key which holds them.
+ *
+ * Raw writes (+rawset+ in Lua, #__set and <tt>raw: true</tt> in Ruby)
+ * bypass the journal. Lua +next+ sees an empty table; +pairs+, +ipairs+
+ * and the length operator see the contents.
+ *
+ *   config.track_changes!(nested: true)
+ *   state.__eval "config.limits.rps = 200; config.name = 'edge'"
+ *   config.changes # => {"limits"=>{"rps"=>200}, "name"=>"edge"}
+ *   config.reset_changes
  */
-static VALUE rbLua_eval(int argc, VALUE* argv, VALUE self)
+static VALUE rbLuaTable_track_changes(int argc, VALUE* argv, VALUE self)
 {
-  VALUE code, chunkname;
-  rb_scan_args(argc, argv, "11", &code, &chunkname);
+  VALUE options;
+  rb_scan_args(argc, argv, "0:", &options);
+  int nested = options != Qnil && RTEST(rb_hash_aref(options, ID2SYM(rb_intern("nested"))));
 
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(self);
 
-  if(chunkname == Qnil)
-    chunkname = rb_str_new2("=<eval>");
+  rlua_push_var(state, self);                      // stack: |this|...
+  if(rlua_tracked(state, -1)) {
+    lua_pop(state, 1);                             //        ...
+    return self;
+  }
+  if(lua_getmetatable(state, -1)) {                //        |meta|this|...
+    lua_pop(state, 2);                             //        ...
+    rb_raise(rb_eArgError, "table already has a metatable");
+  }
 
-  rlua_load_string(state, code, chunkname);
+  lua_pushcfunction(state, rlua_track_install);    //        |func|this|...
+  lua_insert(state, -2);                           //        |this|func|...
+  lua_pushboolean(state, nested);                  //        |nstd|this|func|...
+  int status = lua_pcall(state, 2, 0, 0);          //        ...
+  if(status != LUA_OK)
+    rlua_raise_error(state, status, 0);
 
-  return rlua_pcall(state, 0);
+  return self;
 }
 
-/*
- * call-seq: state.__get_metatable(object) -> Lua::Table or nil
- *
- * Returns metatable of any valid Lua object or nil if it is not present.
- * If you want to get metatables of non-table objects (e.g. numbers)
- * just pass their Ruby equivalent.
- */
-static VALUE rbLua_get_metatable(VALUE self, VALUE object)
+static lua_State* rlua_get_tracked(VALUE self)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
-
-  rlua_push_var(state, object);                 // stack: |objt|...
-  if(lua_getmetatable(state, -1)) {             //        |meta|objt|...
-    VALUE ref = rlua_makeref(state);            //        |meta|objt|...
-    lua_pop(state, 2);                          //        ...
-
-    return rb_funcall(cLuaTable, rb_intern("new"), 2, self, ref);
-  } else {                                      //        |objt|...
-    lua_pop(state, 1);                          //        ...
+  lua_State* state = rlua_get_state(self);
 
-    return Qnil;
+  rlua_push_var(state, self);                      // stack: |this|...
+  if(!rlua_tracked(state, -1)) {
+    lua_pop(state, 1);                             //        ...
+    rb_raise(rb_eArgError, "table does not track changes (see Lua::Table#track_changes!)");
   }
+
+  return state;
 }
 
 /*
- * call-seq: state.__set_metatable=(object, metatable) -> metatable
- *
- * Sets metatable for any valid Lua object. +metatable+ can be Lua::Table or
- * Hash. If you want to set metatables for non-table objects (e.g. numbers)
- * just pass their Ruby equivalent.
+ * call-seq: table.changes -> hash
  *
- *   # Implement concatenation operator for Lua strnigs.
- *   state = Lua::State.new
- *   state.__set_metatable("", { '__add' => lambda{ |a, b| a + b } })
- *   p state.__eval('return "hello," + " world"') # => "hello, world"
+ * Returns the keys written since #track_changes! or the last
+ * #reset_changes, with their current values (+nil+ for deleted keys).
+ * Keys of nested tracked tables which were only modified inside map to
+ * a Hash of their own changes.
  */
-static VALUE rbLua_set_metatable(VALUE self, VALUE object, VALUE metatable)
+static VALUE rbLuaTable_changes(VALUE self)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
-
-  if(rb_obj_class(metatable) != cLuaTable && TYPE(metatable) != T_HASH)
-    rb_raise(rb_eTypeError, "wrong argument type %s (expected Lua::Table or Hash)", rb_obj_classname(metatable));
+  lua_State* state = rlua_get_tracked(self);       // stack: |this|...
 
-  rlua_push_var(state, object);                    // stack: |objt|...
-  rlua_push_var(state, metatable);                 //        |meta|objt|...
-  lua_setmetatable(state, -2);                     //        |objt|...
+  VALUE changes = rlua_track_changes(state);
   lua_pop(state, 1);                               //        ...
 
-  return metatable;
+  return changes;
 }
 
 /*
- * call-seq: table.__metatable() -> Lua::Table or nil
+ * call-seq: table.reset_changes -> table
  *
- * Returns metatable of this table or nil if it is not present.
+ * Clears the journal of the table and of nested tracked tables.
  */
-static VALUE rbLuaTable_get_metatable(VALUE self)
+static VALUE rbLuaTable_reset_changes(VALUE self)
 {
-  return rbLua_get_metatable(self, self);
+  lua_State* state = rlua_get_tracked(self);       // stack: |this|...
+
+  rlua_track_reset(state);
+  lua_pop(state, 1);                               //        ...
+
+  return self;
 }
 
-/*
- * call-seq: table.__metatable=(metatable) -> metatable
- *
- * Sets metatable for this table. +metatable+ can be Lua::Table or Hash.
- */
-static VALUE rbLuaTable_set_metatable(VALUE self, VALUE metatable)
+enum rlua_packed_kind { RLUA_PACKED_F64, RLUA_PACKED_I64, RLUA_PACKED_I32 };
+
+static enum rlua_packed_kind rlua_packed_type(VALUE type, size_t* size)
 {
-  return rbLua_set_metatable(self, self, metatable);
+  Check_Type(type, T_SYMBOL);
+  ID id = SYM2ID(type);
+
+  if(id == rb_intern("f64")) {
+    *size = sizeof(double);
+    return RLUA_PACKED_F64;
+  } else if(id == rb_intern("i64")) {
+    *size = sizeof(int64_t);
+    return RLUA_PACKED_I64;
+  } else if(id == rb_intern("i32")) {
+    *size = sizeof(int32_t);
+    return RLUA_PACKED_I32;
+  } else {
+    rb_raise(rb_eArgError, "unknown packed type %s (expected :f64, :i64 or :i32)", rb_id2name(id));
+  }
 }
 
 /*
- * call-seq: state[key] -> value
+ * call-seq: Lua::Table.from_packed(state, string, type) -> Lua::Table
  *
- * Returns value of a global variable. Equivalent to __env[key].
+ * Creates a Lua sequence from a packed binary +string+ of numbers in native
+ * byte order, as produced by <tt>Array#pack</tt> with <tt>d*</tt>
+ * (<tt>:f64</tt>), <tt>q*</tt> (<tt>:i64</tt>) or <tt>l*</tt>
+ * (<tt>:i32</tt>) directive. The table is preallocated and filled without
+ * creating any intermediate Ruby objects, which is much faster than
+ * converting an Array of numbers.
+ *
+ *   state = Lua::State.new
+ *   series = Lua::Table.from_packed(state, [1.5, 2.5].pack('d*'), :f64)
+ *   series.to_a # => [1.5, 2.5]
  */
-static VALUE rbLua_get_global(VALUE self, VALUE index)
+static VALUE rbLuaTable_from_packed(VALUE self, VALUE rbLuaState, VALUE string, VALUE type)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(rbLuaState);
 
-  if (TYPE(index) != T_STRING) {
-    rb_raise(rb_eTypeError, "wrong argument type %s", rb_obj_classname(index));
-    return Qnil;
+  size_t size;
+  enum rlua_packed_kind kind = rlua_packed_type(type, &size);
+
+  StringValue(string);
+  if(RSTRING_LEN(string) % size != 0)
+    rb_raise(rb_eArgError, "packed string length %ld is not a multiple of %zu", RSTRING_LEN(string), size);
+
+  long i, n = RSTRING_LEN(string) / size;
+  if(n > INT_MAX)
+    rb_raise(rb_eArgError, "packed string is too long");
+
+  const char* data = RSTRING_PTR(string);
+
+  lua_createtable(state, (int) n, 0);              // stack: |tabl|...
+  switch(kind) {
+    case RLUA_PACKED_F64:
+      for(i = 0; i < n; i++) {
+        double value;
+        memcpy(&value, data + i * size, size);
+        lua_pushnumber(state, value);
+        lua_rawseti(state, -2, i + 1);
+      }
+      break;
+
+    case RLUA_PACKED_I64:
+      for(i = 0; i < n; i++) {
+        int64_t value;
+        memcpy(&value, data + i * size, size);
+        lua_pushinteger(state, value);
+        lua_rawseti(state, -2, i + 1);
+      }
+      break;
+
+    case RLUA_PACKED_I32:
+      for(i = 0; i < n; i++) {
+        int32_t value;
+        memcpy(&value, data + i * size, size);
+        lua_pushinteger(state, value);
+        lua_rawseti(state, -2, i + 1);
+      }
+      break;
   }
 
-  lua_getglobal(state, StringValueCStr(index));
-  VALUE value = rlua_get_var(state);
-  lua_pop(state, 1);
+  VALUE table = rlua_wrap_ref(cLuaTable, state);   //        |tabl|...
+  lua_pop(state, 1);                               //        ...
 
-  return value;
+  return table;
 }
 
 /*
- * call-seq: state[key] = value -> value
+ * call-seq: table.to_struct(klass) -> struct
  *
- * Sets value for a global variable. Equivalent to __env[key] = value.
+ * Creates an instance of Struct or Data class +klass+ from values of the
+ * table stored at member names, which are read without invoking
+ * metamethods. Missing members are nil; other keys are ignored. Values
+ * are converted as usual, so nested tables stay Lua::Table objects.
+ *
+ *   Point = Struct.new(:x, :y)
+ *   state.__eval('return { x = 1, y = 2 }').to_struct(Point) # => #<struct Point x=1, y=2>
  */
-static VALUE rbLua_set_global(VALUE self, VALUE index, VALUE value)
+static VALUE rbLuaTable_to_struct(VALUE self, VALUE klass)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(self);
 
-  if (TYPE(index) != T_STRING) {
-    rb_raise(rb_eTypeError, "wrong argument type %s", rb_obj_classname(index));
-    return Qnil;
+  if(!RB_TYPE_P(klass, T_CLASS))
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Class)", rb_obj_classname(klass));
+  VALUE members = rb_struct_s_members(klass);      // raises unless +klass+ is a Struct or Data
+  int n = RARRAY_LENINT(members);
+
+  VALUE buffer;
+  VALUE* argv = ALLOCV_N(VALUE, buffer, n);
+
+  rlua_push_var(state, self);                      // stack: |this|...
+  rlua_track_contents(state);
+  rlua_push_shape(state, RLUA_STATE(state), klass);
+                                                   //        |keys|this|...
+  for(int i = 0; i < n; i++) {
+    lua_rawgeti(state, -1, i + 1);                 //        |key |keys|this|...
+    lua_rawget(state, -3);                         //        |valu|keys|this|...
+    argv[i] = rlua_get_var(state);
+    lua_pop(state, 1);                             //        |keys|this|...
   }
+  lua_pop(state, 2);                               //        ...
 
-  rlua_push_var(state, value);
-  lua_setglobal(state, StringValueCStr(index));
+  VALUE result;
+  if(rb_respond_to(klass, id_keyword_init) && RTEST(rb_funcall(klass, id_keyword_init, 0))) {
+    VALUE hash = rb_hash_new();
+    for(int i = 0; i < n; i++)
+      rb_hash_aset(hash, RARRAY_AREF(members, i), argv[i]);
+    result = rb_class_new_instance_kw(1, &hash, klass, RB_PASS_KEYWORDS);
+  } else {
+    result = rb_class_new_instance(n, argv, klass);
+  }
+  ALLOCV_END(buffer);
 
-  return value;
+  return result;
 }
 
 /*
- * call-seq: this == other -> true or false
+ * call-seq: table.to_packed(type) -> String
  *
- * Compares +this+ with +other+. May call +__eq+ metamethod.
+ * Converts the sequence part of the table (as determined by Lua length
+ * operator, without invoking metamethods) to a packed binary String.
+ * See Lua::Table.from_packed for the list of types. Raises TypeError if
+ * an element is not a number, and RangeError if it does not fit +type+.
  */
-static VALUE rbLua_equal(VALUE self, VALUE other)
+static VALUE rbLuaTable_to_packed(VALUE self, VALUE type)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  lua_State* state = rlua_get_state(self);
 
-  int equal;
-  rlua_push_var(state, self);                       // stack: |this|...
-  rlua_push_var(state, other);                      //        |othr|this|...
-  equal = lua_compare(state, -1, -2, LUA_OPEQ);     //        |othr|this|...
-  lua_pop(state, 2);                                //        ...
+  size_t size;
+  enum rlua_packed_kind kind = rlua_packed_type(type, &size);
 
-  return equal ? Qtrue : Qfalse;
+  rlua_push_var(state, self);                      // stack: |this|...
+  rlua_track_contents(state);
+  lua_Unsigned i, n = lua_rawlen(state, -1);
+
+  VALUE string = rb_str_new(NULL, n * size);
+  char* data = RSTRING_PTR(string);
+
+  for(i = 0; i < n; i++) {
+    lua_rawgeti(state, -1, i + 1);                 //        |elem|this|...
+
+    int isnum = lua_type(state, -1) == LUA_TNUMBER;
+    if(kind == RLUA_PACKED_F64) {
+      double value = lua_tonumber(state, -1);
+      memcpy(data + i * size, &value, size);
+    } else {
+      int isint;
+      lua_Integer value = lua_tointegerx(state, -1, &isint);
+      isnum = isnum && isint;
+      if(isnum && kind == RLUA_PACKED_I32) {
+        if(value < INT32_MIN || value > INT32_MAX) {
+          lua_pop(state, 2);
+          rb_raise(rb_eRangeError, "element %lld does not fit into :i32", (long long) i + 1);
+        }
+
+        int32_t narrow = (int32_t) value;
+        memcpy(data + i * size, &narrow, size);
+      } else {
+        int64_t wide = value;
+        memcpy(data + i * size, &wide, size);
+      }
+    }
+
+    if(!isnum) {
+      lua_pop(state, 2);
+      rb_raise(rb_eTypeError, "element %lld is not %s", (long long) i + 1,
+               kind == RLUA_PACKED_F64 ? "a number" : "an integer");
+    }
+
+    lua_pop(state, 1);                             //        |this|...
+  }
+
+  lua_pop(state, 1);                               //        ...
+
+  return string;
 }
 
+static VALUE rbLuaFunction_call(VALUE self, VALUE args);
+
 /*
- * call-seq: this.__equal(other) -> true or false
- *
- * Compares +this+ with +other+ without calling any metamethods.
+ * Returns the Symbol of Lua key accessed by method +id+ without trailing
+ * '!' or '=', which is stored into +suffix+. Keys are kept as Symbols so
+ * that their Lua strings are cached.
  */
-static VALUE rbLua_rawequal(VALUE self, VALUE other)
+static VALUE rlua_method_key(VALUE id, char* suffix)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  VALUE name = rb_id2str(rb_to_id(id));
+  long length = RSTRING_LEN(name);
 
-  int equal;
-  rlua_push_var(state, self);           // stack: |this|...
-  rlua_push_var(state, other);          //        |othr|this|...
-  equal = lua_rawequal(state, -1, -2);  //        |othr|this|...
-  lua_pop(state, 2);                    //        ...
+  *suffix = length > 1 ? RSTRING_PTR(name)[length - 1] : 0;
+  if(*suffix != '!' && *suffix != '=') {
+    *suffix = 0;
+    return rb_to_symbol(id);
+  }
 
-  return equal ? Qtrue : Qfalse;
+  return ID2SYM(rb_intern3(RSTRING_PTR(name), length - 1, rb_enc_get(name)));
 }
 
 /*
- * call-seq: state.method_missing(method, *args) -> *values
+ * call-seq: table.method_missing(method, *args) -> *values
  *
- * See Lua::Table#method_missing. Equivalent to __env.method_missing(method, *args).
+ * This method allows accessing Lua tables much as if they were Ruby
+ * objects.
+ *
+ * <b>Setting values</b> can be done with a standard <i>setter method</i>:
+ * <tt>table.key = value</tt> is equivalent to <tt>table["key"] = value</tt>.
+ *
+ * <b>Getting values</b> is as easy as setting: if the value is not a function,
+ * <tt>table.key</tt> is equivalent to <tt>table["key"]</tt>.
+ *
+ * If some table has a function as value, you can <b>invoke methods</b> on it.
+ * <tt>table.method(arg1, ..., argN)</tt> is equivalent to
+ * <tt>table["method"].call(arg1, ..., argN)</tt>, and
+ * <tt>table.method!(arg1, ..., argN)</tt> is equivalent to
+ * <tt>table["method"].call(table, arg1, ..., argN)</tt>.
+ * To get a reference to function you should use the <tt>table["method"]</tt>
+ * notation.
+ *
+ * If the value is not present in table (which is equivalent to +nil+ value
+ * in Lua) MethodNotFound exception will be raised; if you will attempt
+ * to call something which is not a function as a method, TypeError exception
+ * will be raised.
  */
-static VALUE rbLua_method_missing(int argc, VALUE* argv, VALUE self)
+static VALUE rbLuaTable_method_missing(int argc, VALUE* argv, VALUE self)
 {
   VALUE id, args;
   rb_scan_args(argc, argv, "1*", &id, &args);
 
-  VALUE name = rb_str_new2(rb_id2name(rb_to_id(id)));
-
-  int is_method = 0;
-  int is_assign = 0;
-  if(RSTRING_PTR(name)[RSTRING_LEN(name) - 1] == '!')
-    is_method = 1;
-  if(RSTRING_PTR(name)[RSTRING_LEN(name) - 1] == '=')
-    is_assign = 1;
+  char suffix;
+  VALUE name = rlua_method_key(id, &suffix);
 
-  if(is_method || is_assign)
-    rb_str_resize(name, RSTRING_LEN(name) - 1);
+  int is_method = suffix == '!';
+  int is_assign = suffix == '=';
 
   if(is_assign) {
     VALUE value;
     rb_scan_args(argc, argv, "11", &id, &value);
-    return rbLua_set_global(self, name, value);
+    return rbLuaTable_set(self, name, value);
   } else {
-    VALUE value = rbLua_get_global(self, name);
+    VALUE value = rbLuaTable_get(self, name);
     if(value == Qnil) {
       return rb_call_super(argc, argv);
     } else if(rb_obj_class(value) != cLuaFunction) {
       if(is_method)
-        rb_raise(rb_eTypeError, "%s is not a Lua::Function", RSTRING_PTR(name));
+        rb_raise(rb_eTypeError, "%"PRIsVALUE" is not a Lua::Function", rb_sym2str(name));
       return value;
     } else {
       if(is_method)
@@ -865,348 +2289,4934 @@ static VALUE rbLua_method_missing(int argc, VALUE* argv, VALUE self)
   }
 }
 
-/*
- * call-seq: Lua::Multret.new(*values)
- *
- * Creates a new Multret object with +values+ inside. Example:
- *
- *   Lua::Multret.new(1, 2, 3) # three return values
- */
-static VALUE rbLuaMultret_initialize(VALUE self, VALUE args)
+struct rlua_callback {
+  lua_State* state;
+  VALUE proc;
+  int argc;
+  VALUE* argv;
+  int nret;
+};
+
+static VALUE rlua_callback_invoke(VALUE data)
 {
-  rb_iv_set(self, "@args", args);
-  return self;
+  struct rlua_callback* cb = (struct rlua_callback*) data;
+  lua_State* state = cb->state;
+  int i;
+
+  // stack: |argN-arg1|
+  for(i = cb->argc - 1; i >= 0; i--) {
+    cb->argv[i] = rlua_get_var(state);
+    lua_pop(state, 1);
+  }
+
+  VALUE retval;
+  if(rb_obj_is_proc(cb->proc))
+    retval = rb_proc_call_with_block(cb->proc, cb->argc, cb->argv, Qnil);
+  else
+    retval = rb_funcallv(cb->proc, id_call, cb->argc, cb->argv);
+
+  if(rb_obj_class(retval) == cLuaMultret) {
+    VALUE array = rb_ivar_get(retval, id_args);
+    long n = RARRAY_LEN(array);
+
+    if(n > INT_MAX || !lua_checkstack(state, (int) n))
+      rb_raise(rb_eArgError, "too many return values (%ld)", n);
+
+    for(i = 0; i < n; i++)
+      rlua_push_var(state, RARRAY_AREF(array, i));
+
+    cb->nret = (int) n;
+  } else {
+    rlua_push_var(state, retval);
+    cb->nret = 1;
+  }
+
+  return Qnil;
 }
 
-/*
- * call-seq: Lua.multret(*values)
- *
- * Shorthand for Lua::Multret.new.
- */
-static VALUE rbLua_multret(VALUE self, VALUE args)
+static inline uint64_t rlua_clock_ns(void)
 {
-  return rb_funcall(cLuaMultret, rb_intern("new"), 1, args);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-// bootstrap* are from Lua5.3 source
-#define SPACECHARS	" \f\n\r\t\v"
+static void rlua_profile_record(rlua_Profile* profile, uint64_t elapsed)
+{
+  // Bucket is the bit length of +elapsed+: calls in [2**(i-1), 2**i) go to i.
+  int bucket = 0;
+#ifdef __GNUC__
+  if(elapsed)
+    bucket = 64 - __builtin_clzll(elapsed);
+#else
+  while(bucket < RLUA_PROFILE_BUCKETS && (elapsed >> bucket))
+    bucket++;
+#endif
+  if(bucket >= RLUA_PROFILE_BUCKETS)
+    bucket = RLUA_PROFILE_BUCKETS - 1;
+
+  profile->calls++;
+  profile->total_ns += elapsed;
+  profile->histogram[bucket]++;
+}
 
-static const char *b_str2int (const char *s, int base, lua_Integer *pn) {
-  lua_Unsigned n = 0;
-  int neg = 0;
-  s += strspn(s, SPACECHARS);  /* skip initial spaces */
-  if (*s == '-') { s++; neg = 1; }  /* handle sign */
-  else if (*s == '+') s++;
-  if (!isalnum((unsigned char)*s))  /* no digit? */
-    return NULL;
-  do {
-    int digit = (isdigit((unsigned char)*s)) ? *s - '0'
-                   : (toupper((unsigned char)*s) - 'A') + 10;
-    if (digit >= base) return NULL;  /* invalid numeral */
-    n = n * base + digit;
-    s++;
-  } while (isalnum((unsigned char)*s));
-  s += strspn(s, SPACECHARS);  /* skip trailing spaces */
-  *pn = (lua_Integer)((neg) ? (0u - n) : n);
-  return s;
+// Runs the proc of +callback+ with arguments on top of +cb->state+, timing it if profiled.
+static void rlua_callback_run(rlua_Callback* callback, struct rlua_callback* cb, int* error)
+{
+  VALUE buffer;
+
+  cb->proc = callback->anchor.value;
+  cb->argv = ALLOCV_N(VALUE, buffer, cb->argc);
+  cb->nret = 0;
+
+  if(callback->profile) {
+    uint64_t start = rlua_clock_ns();
+    rb_protect(rlua_callback_invoke, (VALUE) cb, error);
+    rlua_profile_record(callback->profile, rlua_clock_ns() - start);
+  } else {
+    rb_protect(rlua_callback_invoke, (VALUE) cb, error);
+  }
+  ALLOCV_END(buffer);
 }
 
-static int bootstrap_tonumber (lua_State *L) {
-  if (lua_isnoneornil(L, 2)) {  /* standard conversion? */
-    if (lua_type(L, 1) == LUA_TNUMBER) {  /* already a number? */
-      lua_settop(L, 1);  /* yes; return it */
-      return 1;
-    }
-    else {
-      size_t l;
-      const char *s = lua_tolstring(L, 1, &l);
-      if (s != NULL && lua_stringtonumber(L, s) == l + 1)
-        return 1;  /* successful conversion to number */
-      /* else not a number */
-      luaL_checkany(L, 1);  /* (but there must be some parameter) */
+// Pushes the message of the Ruby exception which rb_protect caught.
+/*
+ * Pushes the Lua error for a callback which failed with Ruby jump +tag+.
+ * StandardErrors become catchable Lua errors; should one reach Ruby
+ * unhandled, rlua_raise_error re-raises the original exception. Anything
+ * else (Interrupt, Timeout, throw, break) is kept pending like an
+ * interrupt, so that rlua_check_pending re-raises it even if Lua code
+ * catches the error.
+ */
+static void rlua_callback_failed(lua_State* state, rlua_State* rstate, int tag)
+{
+  VALUE exception = rb_errinfo(), message;
+  int error;
+
+  if(!rb_obj_is_kind_of(exception, rb_eStandardError)) {
+    if(!rstate->pending_tag) {
+      rstate->pending_tag = tag;
+      rstate->pending = exception;
     }
+    lua_pushliteral(state, "interrupted by Ruby");
+    return;
   }
-  else {
-    size_t l;
-    const char *s;
-    lua_Integer n = 0;  /* to avoid warnings */
-    lua_Integer base = luaL_checkinteger(L, 2);
-    luaL_checktype(L, 1, LUA_TSTRING);  /* no numbers as strings */
-    s = lua_tolstring(L, 1, &l);
-    luaL_argcheck(L, 2 <= base && base <= 36, 2, "base out of range");
-    if (b_str2int(s, (int)base, &n) == s + l) {
-      lua_pushinteger(L, n);
-      return 1;
-    }  /* else not a number */
-  }  /* else not a number */
-  lua_pushnil(L);  /* not a number */
-  return 1;
+
+  rb_set_errinfo(Qnil);
+  message = rb_protect(rb_obj_as_string, exception, &error);
+  if(error) {
+    rb_set_errinfo(Qnil);
+    message = rb_class_name(rb_obj_class(exception));
+  }
+
+  rstate->callback_error = exception;
+  rstate->callback_message = message;
+  lua_pushlstring(state, RSTRING_PTR(message), RSTRING_LEN(message));
 }
 
-static int bootstrap_tostring (lua_State *L) {
-  luaL_checkany(L, 1);
-  luaL_tolstring(L, 1, NULL);
-  return 1;
+// Returns nonzero if +state+ is a coroutine run by rlua_async_run which can yield now.
+static int rlua_async_thread(lua_State* state, rlua_State* rstate)
+{
+  if(!lua_isyieldable(state))
+    return 0;
+
+  lua_rawgeti(state, LUA_REGISTRYINDEX, rstate->async_threads);
+  lua_pushthread(state);
+  int found = lua_rawget(state, -2) != LUA_TNIL;
+  lua_pop(state, 2);
+
+  return found;
 }
 
-static int bootstrap_error (lua_State *L) {
-  int level = (int)luaL_optinteger(L, 2, 1);
-  lua_settop(L, 1);
-  if (lua_type(L, 1) == LUA_TSTRING && level > 0) {
-    luaL_where(L, level);   /* add extra information */
-    lua_pushvalue(L, 1);
-    lua_concat(L, 2);
+// Resumed by rlua_async_run with results of the callback and a success flag on top.
+static int rlua_async_continue(lua_State* state, int status, lua_KContext ctx)
+{
+  int ok = lua_toboolean(state, -1);
+  lua_pop(state, 1);
+
+  if(!ok)
+    return lua_error(state);
+  return lua_gettop(state);
+}
+
+static int call_ruby_proc(lua_State* state)
+{
+  struct rlua_callback cb;
+  int error;
+
+  rlua_Callback* callback = lua_touserdata(state, lua_upvalueindex(1));
+  rlua_State* rstate = callback->owner;
+
+  if(rstate->self == Qnil)
+    return luaL_error(state, "cannot call Ruby code while Lua::State is being closed");
+  if(rstate->pending_tag) {
+    lua_pushliteral(state, "interrupted by Ruby");
+    return lua_error(state);
   }
-  return lua_error(L);
+
+  if(callback->async && rlua_async_thread(state, rstate)) {
+    // stack: |argN-arg1|  ->  |argN-arg1|cbck|
+    lua_pushvalue(state, lua_upvalueindex(1));
+    lua_insert(state, 1);
+    return lua_yieldk(state, lua_gettop(state), 0, rlua_async_continue);
+  }
+
+  cb.state = state;
+  cb.argc  = lua_gettop(state);
+
+  int in_pcall = rstate->in_pcall;
+  rstate->in_pcall = 0;
+
+  rlua_callback_run(callback, &cb, &error);
+  rstate->in_pcall = in_pcall;
+
+  if(error) {
+    // Ruby exceptions must not unwind through Lua VM; turn them into Lua errors.
+    rlua_callback_failed(state, rstate, error);
+    return lua_error(state);
+  }
+
+  return cb.nret;
 }
 
-static int bootstrap_type (lua_State *L) {
-  int t = lua_type(L, 1);
-  luaL_argcheck(L, t != LUA_TNONE, 1, "value expected");
-  lua_pushstring(L, lua_typename(L, t));
-  return 1;
+/*
+ * Async calls run a function in a fresh coroutine. Async callbacks called
+ * by it yield the coroutine instead of calling Ruby from inside Lua; the
+ * proc is then called here, with no Lua frames active, and the coroutine is
+ * resumed with its results. The proc may therefore block on a
+ * Fiber.scheduler (or switch fibers otherwise), and other fibers may
+ * meanwhile run Lua code of the same state. Coroutines are registered in
+ * the async_threads table, so that coroutines created by Lua code, which
+ * are resumed by Lua, call the proc directly instead.
+ */
+struct rlua_async {
+  lua_State* state;
+  lua_State* thread;
+  int argc;
+};
+
+static VALUE rlua_async_resume(VALUE data)
+{
+  struct rlua_async* async = (struct rlua_async*) data;
+  lua_State* thread = async->thread;
+  rlua_State* rstate = RLUA_STATE(thread);
+  int nargs = async->argc, nres, status;
+
+  if(!rstate->in_pcall)
+    rstate->callback_error = rstate->callback_message = Qnil;
+
+  for(;;) {
+    rstate->in_pcall++;
+    status = lua_resume(thread, async->state, nargs, &nres);
+    rstate->in_pcall--;
+    rlua_check_pending(thread, 0);
+
+    if(status != LUA_YIELD)
+      break;
+
+    // stack: |resN-res1|...
+    int base = lua_gettop(thread) - nres;
+    rlua_Callback* callback = nres > 0 ? luaL_testudata(thread, base + 1, "rlua.callback") : NULL;
+    if(callback == NULL)
+      rb_raise(cLuaError, "attempt to yield from outside a coroutine");
+    lua_remove(thread, base + 1);                    // stack: |argN-arg1|...
+
+    struct rlua_callback cb;
+    int error;
+
+    cb.state = thread;
+    cb.argc  = nres - 1;
+    rlua_callback_run(callback, &cb, &error);
+
+    if(error) {
+      rlua_callback_failed(thread, rstate, error);   // stack: |mesg|...
+      lua_pushboolean(thread, 0);
+      nargs = 2;
+    } else {
+      lua_pushboolean(thread, 1);                    // stack: |true|retN-ret1|...
+      nargs = cb.nret + 1;
+    }
+  }
+
+  if(status != LUA_OK)
+    rlua_raise_error(thread, status, 0);
+
+  return rlua_results(thread, 0);
 }
 
-static int bootstrap_next (lua_State *L) {
-  luaL_checktype(L, 1, LUA_TTABLE);
-  lua_settop(L, 2);  /* create a 2nd argument if there isn't one */
-  if (lua_next(L, 1))
-    return 2;
-  else {
-    lua_pushnil(L);
-    return 1;
+static VALUE rlua_async_finish(VALUE data)
+{
+  struct rlua_async* async = (struct rlua_async*) data;
+  lua_State* state = async->state;
+
+  lua_resetthread(async->thread);
+
+  lua_rawgeti(state, LUA_REGISTRYINDEX, RLUA_STATE(state)->async_threads);
+  lua_pushthread(async->thread);
+  lua_xmove(async->thread, state, 1);
+  lua_pushnil(state);
+  lua_rawset(state, -3);
+  lua_pop(state, 1);
+
+  return Qnil;
+}
+
+// Calls the function below +argc+ arguments in a new coroutine; see above.
+static VALUE rlua_async_run(lua_State* state, int argc)
+{
+  // stack: |argN-arg1|func|...
+  lua_rawgeti(state, LUA_REGISTRYINDEX, RLUA_STATE(state)->async_threads);
+  lua_State* thread = lua_newthread(state);        //        |thrd|thds|argN-arg1|func|...
+  lua_pushboolean(state, 1);
+  lua_rawset(state, -3);                           //        |thds|argN-arg1|func|...
+  lua_pop(state, 1);
+
+  // Other fibers may use the stack of +state+ while this one waits.
+  lua_xmove(state, thread, argc + 1);
+
+  struct rlua_async async = { state, thread, argc };
+  return rb_ensure(rlua_async_resume, (VALUE) &async, rlua_async_finish, (VALUE) &async);
+}
+
+/*
+ * call-seq: Lua::Function.new(state, proc, name = nil, async: false)
+ *
+ * Converts a Ruby closure +proc+ to a Lua function in Lua::State represented
+ * by +state+. Note that you generally do not need to call this function
+ * explicitly: any +proc+ or +lambda+ passed as a value for table assignment
+ * will be automagically converted to Lua closure.
+ *
+ * If +name+ is given, calls of the function from Lua are timed and
+ * reported by Lua::State#callback_profile under that name.
+ *
+ * An +async+ function called from code run by #call_async or
+ * Lua::State#__eval_async suspends that code while +proc+ runs, so +proc+
+ * may wait on a Fiber.scheduler. Elsewhere it is called as usual.
+ */
+static VALUE rbLuaFunction_initialize(int argc, VALUE* argv, VALUE self)
+{
+  VALUE rbLuaState, func, name, options;
+  rb_scan_args(argc, argv, "12:", &rbLuaState, &func, &name, &options);
+  int async = options != Qnil && RTEST(rb_hash_aref(options, ID2SYM(rb_intern("async"))));
+
+  if(!rb_typeddata_is_kind_of(rbLuaState, &rlua_state_type))
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Lua::State)", rb_obj_classname(rbLuaState));
+
+  rlua_Ref* function = rlua_get_ref(self);
+  lua_State* state = rlua_get_state(rbLuaState);
+  int ref;
+
+  if(TYPE(func) == T_FIXNUM) {
+    ref = rlua_copy_ref(state, func, LUA_TFUNCTION);
+  } else if(rb_respond_to(func, id_call)) {
+    // the proc is kept alive by the state for as long as Lua can call it
+    rlua_push_callback(state, func, name, async);
+    ref = rlua_makeref(state);
+    lua_pop(state, 1);
+  } else {
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Proc)", rb_obj_classname(func));
+  }
+
+  rlua_ref_attach(function, RLUA_STATE(state), ref);
+
+  return self;
+}
+
+/*
+ * call-seq: func.call(*args) -> *values
+ *
+ * Invokes a Lua function in protected environment (like a Lua +xpcall+).
+ *
+ * One value returned in Lua is returned as one value in Ruby; multiple values
+ * returned in Lua are returned as an array of them in Ruby. This convention
+ * allows usage of identical code for calling methods with multiple return
+ * values in both languages.
+ *
+ * While you can easily call Lua procedures and use their return values,
+ * returning multiple values from Ruby is not that easy. RLua cannot
+ * guess whether array returned by Ruby function is a 'real' array or
+ * just several return values, so there is a Lua.multret proxy method for
+ * that purpose. Ruby return values constructed with +multret+ method
+ * are automatically unpacked to multiple return values. Example:
+ *
+ *   state = Lua::State.new
+ *   state.p = lambda{ |*args| p *args }
+ *   state.f1 = Lua::Function.new(state, lambda{ [ 1, 2, 3 ] })
+ *   state.f2 = Lua::Function.new(state, lambda{ Lua.multret( 1, 2, 3 ) })
+ *   state.__eval("p(f1())") # results in { 1.0, 2.0, 3.0 } Lua table
+ *                           # shown as array
+ *   state.__eval("p(f2())") # results in 1.0, 2.0, 3.0 Lua multiple return values
+ *                           # shown as three separate values
+ *
+ * Any Lua error that has appeared during the call will be raised as Ruby
+ * exception with message equal to Lua error message.
+ * *Lua error messages are explicitly converted to strings with +lua_tostring+
+ * function.*
+ * Lua errors are mapped as follows:
+ * LUA_ERRMEM:: NoMemError is raised.
+ * LUA_ERRRUN:: RuntimeError is raised.
+ *
+ * Note that if any uncatched exception is raised in Ruby code inside
+ * Lua::Function it will be propagated as Lua error. *In this case the
+ * backtrace is lost!* Catch your exceptions in Ruby code if you want to
+ * keep their backtraces.
+ *
+ * This 'drawback' is intentional: while it is technically possible to
+ * re-raise the same Exception object, the backtrace will lead to re-raise
+ * point anyway.
+ */
+static VALUE rbLuaFunction_call(VALUE self, VALUE args)
+{
+  lua_State* state = rlua_get_state(self);
+
+  int i;
+  VALUE retval;
+
+  rlua_push_var(state, self);                      // stack: |this|...
+  for(i = 0; i < RARRAY_LEN(args); i++)
+    rlua_push_var(state, RARRAY_PTR(args)[i]);
+                                                   //        |argN-arg1|this|...
+  retval = rlua_pcall(state, RARRAY_LEN(args));    //        ...
+
+  return retval;
+}
+
+/*
+ * call-seq: func.try_call(*args) -> [true, *results] or [false, message, error]
+ *
+ * Calls the function like #call, but instead of raising an exception,
+ * returns status of the call like Lua +pcall+ function does. +error+ is
+ * the original Lua error value.
+ */
+static VALUE rbLuaFunction_try_call(VALUE self, VALUE args)
+{
+  lua_State* state = rlua_get_state(self);
+  int base = lua_gettop(state);
+
+  rlua_push_var(state, self);                      // stack: |this|...
+  for(long i = 0; i < RARRAY_LEN(args); i++)
+    rlua_push_var(state, RARRAY_AREF(args, i));
+                                                   //        |argN-arg1|this|...
+  int retval = rlua_protected_call(state, RARRAY_LENINT(args), 0);
+  rlua_check_pending(state, base);
+
+  return rlua_try_results(state, base, retval);    //        ...
+}
+
+/*
+ * call-seq: func.call_async(*args) -> *values
+ *
+ * Calls the function like #call, but in a new Lua coroutine, so that async
+ * Ruby callbacks (see Lua::Function.new) run outside of Lua. When they
+ * block on the Fiber.scheduler, other fibers can run Lua code of the same
+ * state meanwhile:
+ *
+ *   state.fetch = Lua::Function.new(state, ->(key) { cache.get(key) }, async: true)
+ *   state.__eval 'function handle(id) return fetch("user:" .. id) end'
+ *   ids.each { |id| Fiber.schedule { results[id] = state.handle.call_async(id) } }
+ *
+ * Callbacks which are not async must not switch fibers.
+ */
+static VALUE rbLuaFunction_call_async(VALUE self, VALUE args)
+{
+  lua_State* state = rlua_get_state(self);
+
+  rlua_push_var(state, self);                      // stack: |this|...
+  for(long i = 0; i < RARRAY_LEN(args); i++)
+    rlua_push_var(state, RARRAY_AREF(args, i));
+                                                   //        |argN-arg1|this|...
+  return rlua_async_run(state, RARRAY_LENINT(args));
+}
+
+// Creates the interpreter of +rstate+, which belongs to Lua::State +self+.
+static void rlua_state_open(rlua_State* rstate, VALUE self, int pooled)
+{
+  lua_State* state;
+  if(!pooled) {
+    state = luaL_newstate();
+  } else {
+    rstate->arena = calloc(1, sizeof(rlua_Arena));
+    if(rstate->arena == NULL)
+      rb_raise(rb_eNoMemError, "cannot create Lua state");
+
+    state = lua_newstate(rlua_arena_alloc, rstate->arena);
+    if(state == NULL) {
+      rlua_arena_free(rstate->arena);
+      rstate->arena = NULL;
+    } else {
+      lua_atpanic(state, rlua_panic);
+    }
+  }
+
+  if(state == NULL)
+    rb_raise(rb_eNoMemError, "cannot create Lua state");
+
+  rstate->state = state;
+  rstate->self  = self;
+  RLUA_STATE(state) = rstate;
+
+  lua_newtable(state);
+  rstate->symbols = luaL_ref(state, LUA_REGISTRYINDEX);
+  lua_newtable(state);
+  rstate->async_threads = luaL_ref(state, LUA_REGISTRYINDEX);
+  lua_newtable(state);
+  rstate->shapes = luaL_ref(state, LUA_REGISTRYINDEX);
+
+  luaL_newmetatable(state, "rlua.callback");
+  lua_pushcfunction(state, rlua_callback_gc);
+  lua_setfield(state, -2, "__gc");
+  lua_pop(state, 1);
+
+  luaL_newmetatable(state, "rlua.shape");
+  lua_pushcfunction(state, rlua_shape_gc);
+  lua_setfield(state, -2, "__gc");
+  lua_pop(state, 1);
+
+  luaL_newmetatable(state, "rlua.bundle");
+  lua_pushcfunction(state, rlua_bundle_gc);
+  lua_setfield(state, -2, "__gc");
+  lua_pop(state, 1);
+
+  rlua_shared_register(state);
+  rlua_buffer_register(state);
+  rlua_channel_register(state);
+}
+
+/*
+ * call-seq: Lua::State.new(allocator: :system) -> state
+ *
+ * Creates a new Lua interpreter without any libraries loaded.
+ *
+ * With <tt>allocator: :pool</tt>, small Lua objects are allocated from
+ * size-class free lists in large per-state chunks, which are returned to
+ * the system all at once when the state is discarded or #reset. This is
+ * meant to keep short-lived states from fragmenting the process heap;
+ * bench/allocator.rb measures whether it does on a given system. Closing
+ * the interpreter still visits all of its objects.
+ */
+static VALUE rbLua_initialize(int argc, VALUE* argv, VALUE self)
+{
+  VALUE options;
+  rb_scan_args(argc, argv, ":", &options);
+
+  rlua_State* rstate = DATA_PTR(self);
+  if(rstate->state != NULL)
+    rb_raise(rb_eArgError, "Lua::State is already initialized");
+
+  VALUE allocator = options == Qnil ? Qnil : rb_hash_aref(options, ID2SYM(rb_intern("allocator")));
+  if(allocator != Qnil && allocator != ID2SYM(rb_intern("system")) && allocator != ID2SYM(rb_intern("pool")))
+    rb_raise(rb_eArgError, "unknown allocator %"PRIsVALUE, rb_inspect(allocator));
+
+  rlua_state_open(rstate, self, allocator == ID2SYM(rb_intern("pool")));
+
+  return self;
+}
+
+/*
+ * call-seq: state.reset -> state
+ *
+ * Discards the Lua interpreter, with all its globals and loaded libraries,
+ * and replaces it with a new one, as if the state was just created. The
+ * allocator and the settings of the state (conversion limits,
+ * #symbolize_keys, #interrupt_check_interval, #profile_callbacks) are
+ * kept. A state using the pool allocator drops all chunks of the old
+ * interpreter at once and starts over on a fresh arena. The old interpreter
+ * is still closed normally, so the cost of a reset grows with the number of
+ * objects it holds, like that of discarding a state.
+ *
+ * Lua::Table and Lua::Function objects of the old interpreter can no
+ * longer be used. Raises RuntimeError if Lua code of the state is running,
+ * e.g. when called from a Ruby callback.
+ */
+static VALUE rbLua_reset(VALUE self)
+{
+  rlua_State* old = rlua_get_rstate(self);
+  lua_State* state = old->state;
+  lua_Debug ar;
+
+  lua_rawgeti(state, LUA_REGISTRYINDEX, old->async_threads);  // stack: |thds|...
+  lua_pushnil(state);                                         //        |nil |thds|...
+  int async = lua_next(state, -2);
+  lua_pop(state, async ? 3 : 1);                              //        ...
+  if(async || lua_getstack(state, 0, &ar))
+    rb_raise(rb_eRuntimeError, "cannot reset Lua::State while it runs Lua code");
+
+  rlua_State* rstate = ZALLOC(rlua_State);
+  rlua_state_init(rstate);
+  rstate->max_depth          = old->max_depth;
+  rstate->max_elements       = old->max_elements;
+  rstate->symbolize_keys     = old->symbolize_keys;
+  rstate->interrupt_interval = old->interrupt_interval;
+  rstate->profile_callbacks  = old->profile_callbacks;
+  int pooled = old->arena != NULL;
+
+  // Objects of the old interpreter keep the old rlua_State, which now
+  // reports itself as closed, until the last of them is collected.
+  DATA_PTR(self) = rstate;
+  rlua_state_close(old);
+  rlua_state_release(old);
+
+  rlua_state_open(rstate, self, pooled);
+  if(rstate->interrupt_interval > 0)
+    lua_sethook(rstate->state, rlua_interrupt_hook, LUA_MASKCOUNT, rstate->interrupt_interval);
+
+  return self;
+}
+
+/*
+ * call-seq: state.__eval(code[, chunkname='=&lt;eval&gt;']) -> *values
+ *
+ * Runs +code+ in Lua interpreter. Optional argument +chunkname+
+ * specifies a string that will be used in error messages and other
+ * debug information as a file name.
+ *
+ * Start +chunkname+ with a @ to make Lua think the following is filename
+ * (e.g. @test.lua); start it with a = to indicate a non-filename stream
+ * (e.g. =stdin). Anything other is interpreted as a plaintext Lua code and
+ * a few starting characters will be shown.
+ */
+static VALUE rbLua_eval(int argc, VALUE* argv, VALUE self)
+{
+  VALUE code, chunkname;
+  rb_scan_args(argc, argv, "11", &code, &chunkname);
+
+  lua_State* state = rlua_get_state(self);
+
+  if(chunkname == Qnil)
+    chunkname = rb_str_new2("=<eval>");
+
+  rlua_load_string(state, code, chunkname);
+
+  return rlua_pcall(state, 0);
+}
+
+/*
+ * call-seq: state.__eval_async(code[, chunkname]) -> *values
+ *
+ * Runs +code+ like #__eval, but in a new Lua coroutine; see
+ * Lua::Function#call_async.
+ */
+static VALUE rbLua_eval_async(int argc, VALUE* argv, VALUE self)
+{
+  VALUE code, chunkname;
+  rb_scan_args(argc, argv, "11", &code, &chunkname);
+
+  lua_State* state = rlua_get_state(self);
+
+  if(chunkname == Qnil)
+    chunkname = rb_str_new2("=<eval>");
+
+  rlua_load_string(state, code, chunkname);
+
+  return rlua_async_run(state, 0);
+}
+
+/*
+ * call-seq: state.try_eval(code[, chunkname]) -> [true, *results] or [false, message, error]
+ *
+ * Runs +code+ like #__eval, but instead of raising an exception, returns
+ * status of the call like Lua +pcall+ function does. +error+ is the
+ * original Lua error value. This is considerably cheaper than rescuing
+ * an exception when errors are expected.
+ */
+static VALUE rbLua_try_eval(int argc, VALUE* argv, VALUE self)
+{
+  VALUE code, chunkname;
+  rb_scan_args(argc, argv, "11", &code, &chunkname);
+
+  lua_State* state = rlua_get_state(self);
+
+  if(chunkname == Qnil)
+    chunkname = rb_str_new2("=<eval>");
+
+  int base = lua_gettop(state);
+  int retval = rlua_load_status(state, code, chunkname);
+  if(retval == LUA_OK)
+    retval = rlua_protected_call(state, 0, 0);
+  rlua_check_pending(state, base);
+
+  return rlua_try_results(state, base, retval);
+}
+
+/*
+ * call-seq: state.__get_metatable(object) -> Lua::Table or nil
+ *
+ * Returns metatable of any valid Lua object or nil if it is not present.
+ * If you want to get metatables of non-table objects (e.g. numbers)
+ * just pass their Ruby equivalent.
+ */
+static VALUE rbLua_get_metatable(VALUE self, VALUE object)
+{
+  lua_State* state = rlua_get_state(self);
+
+  rlua_push_var(state, object);                 // stack: |objt|...
+  if(lua_getmetatable(state, -1)) {             //        |meta|objt|...
+    VALUE table = rlua_wrap_ref(cLuaTable, state); //     |meta|objt|...
+    lua_pop(state, 2);                          //        ...
+
+    return table;
+  } else {                                      //        |objt|...
+    lua_pop(state, 1);                          //        ...
+
+    return Qnil;
+  }
+}
+
+/*
+ * call-seq: state.__set_metatable=(object, metatable) -> metatable
+ *
+ * Sets metatable for any valid Lua object. +metatable+ can be Lua::Table or
+ * Hash. If you want to set metatables for non-table objects (e.g. numbers)
+ * just pass their Ruby equivalent.
+ *
+ *   # Implement concatenation operator for Lua strnigs.
+ *   state = Lua::State.new
+ *   state.__set_metatable("", { '__add' => lambda{ |a, b| a + b } })
+ *   p state.__eval('return "hello," + " world"') # => "hello, world"
+ */
+static VALUE rbLua_set_metatable(VALUE self, VALUE object, VALUE metatable)
+{
+  lua_State* state = rlua_get_state(self);
+
+  if(rb_obj_class(metatable) != cLuaTable && TYPE(metatable) != T_HASH)
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Lua::Table or Hash)", rb_obj_classname(metatable));
+
+  rlua_push_var(state, object);                    // stack: |objt|...
+  rlua_push_var(state, metatable);                 //        |meta|objt|...
+  lua_setmetatable(state, -2);                     //        |objt|...
+  lua_pop(state, 1);                               //        ...
+
+  return metatable;
+}
+
+/*
+ * call-seq: table.__metatable() -> Lua::Table or nil
+ *
+ * Returns metatable of this table or nil if it is not present.
+ */
+static VALUE rbLuaTable_get_metatable(VALUE self)
+{
+  return rbLua_get_metatable(self, self);
+}
+
+/*
+ * call-seq: table.__metatable=(metatable) -> metatable
+ *
+ * Sets metatable for this table. +metatable+ can be Lua::Table or Hash.
+ */
+static VALUE rbLuaTable_set_metatable(VALUE self, VALUE metatable)
+{
+  return rbLua_set_metatable(self, self, metatable);
+}
+
+/*
+ * call-seq: state[key] -> value
+ *
+ * Returns value of a global variable. Equivalent to __env[key].
+ */
+static VALUE rbLua_get_global(VALUE self, VALUE index)
+{
+  lua_State* state = rlua_get_state(self);
+
+  if(SYMBOL_P(index)) {
+    lua_pushglobaltable(state);                    // stack: |_G  |...
+    rlua_push_symbol(state, DATA_PTR(self), index);
+                                                   //        |name|_G  |...
+    lua_gettable(state, -2);                       //        |valu|_G  |...
+    lua_remove(state, -2);                         //        |valu|...
+  } else if(TYPE(index) == T_STRING) {
+    lua_getglobal(state, StringValueCStr(index));
+  } else {
+    rb_raise(rb_eTypeError, "wrong argument type %s", rb_obj_classname(index));
+    return Qnil;
+  }
+
+  VALUE value = rlua_get_var(state);
+  lua_pop(state, 1);
+
+  return value;
+}
+
+/*
+ * call-seq: state[key] = value -> value
+ *
+ * Sets value for a global variable. Equivalent to __env[key] = value.
+ */
+static VALUE rbLua_set_global(VALUE self, VALUE index, VALUE value)
+{
+  lua_State* state = rlua_get_state(self);
+
+  if(SYMBOL_P(index)) {
+    lua_pushglobaltable(state);                    // stack: |_G  |...
+    rlua_push_symbol(state, DATA_PTR(self), index);
+                                                   //        |name|_G  |...
+    rlua_push_var(state, value);                   //        |valu|name|_G  |...
+    lua_settable(state, -3);                       //        |_G  |...
+    lua_pop(state, 1);                             //        ...
+  } else if(TYPE(index) == T_STRING) {
+    rlua_push_var(state, value);
+    lua_setglobal(state, StringValueCStr(index));
+  } else {
+    rb_raise(rb_eTypeError, "wrong argument type %s", rb_obj_classname(index));
+    return Qnil;
+  }
+
+  return value;
+}
+
+/*
+ * call-seq: this == other -> true or false
+ *
+ * Compares +this+ with +other+. May call +__eq+ metamethod.
+ */
+static VALUE rbLua_equal(VALUE self, VALUE other)
+{
+  lua_State* state = rlua_get_state(self);
+
+  int equal;
+  rlua_push_var(state, self);                       // stack: |this|...
+  rlua_push_var(state, other);                      //        |othr|this|...
+  equal = lua_compare(state, -1, -2, LUA_OPEQ);     //        |othr|this|...
+  lua_pop(state, 2);                                //        ...
+
+  return equal ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: this.__equal(other) -> true or false
+ *
+ * Compares +this+ with +other+ without calling any metamethods.
+ */
+static VALUE rbLua_rawequal(VALUE self, VALUE other)
+{
+  lua_State* state = rlua_get_state(self);
+
+  int equal;
+  rlua_push_var(state, self);           // stack: |this|...
+  rlua_push_var(state, other);          //        |othr|this|...
+  equal = lua_rawequal(state, -1, -2);  //        |othr|this|...
+  lua_pop(state, 2);                    //        ...
+
+  return equal ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: state.method_missing(method, *args) -> *values
+ *
+ * See Lua::Table#method_missing. Equivalent to __env.method_missing(method, *args).
+ */
+static VALUE rbLua_method_missing(int argc, VALUE* argv, VALUE self)
+{
+  VALUE id, args;
+  rb_scan_args(argc, argv, "1*", &id, &args);
+
+  char suffix;
+  VALUE name = rlua_method_key(id, &suffix);
+
+  int is_method = suffix == '!';
+  int is_assign = suffix == '=';
+
+  if(is_assign) {
+    VALUE value;
+    rb_scan_args(argc, argv, "11", &id, &value);
+    return rbLua_set_global(self, name, value);
+  } else {
+    VALUE value = rbLua_get_global(self, name);
+    if(value == Qnil) {
+      return rb_call_super(argc, argv);
+    } else if(rb_obj_class(value) != cLuaFunction) {
+      if(is_method)
+        rb_raise(rb_eTypeError, "%"PRIsVALUE" is not a Lua::Function", rb_sym2str(name));
+      return value;
+    } else {
+      if(is_method)
+        rb_ary_unshift(args, self);
+      return rbLuaFunction_call(value, args);
+    }
+  }
+}
+
+/*
+ * call-seq: Lua::Multret.new(*values)
+ *
+ * Creates a new Multret object with +values+ inside. Example:
+ *
+ *   Lua::Multret.new(1, 2, 3) # three return values
+ */
+static VALUE rbLuaMultret_initialize(VALUE self, VALUE args)
+{
+  rb_ivar_set(self, id_args, args);
+  return self;
+}
+
+/*
+ * call-seq: Lua.multret(*values)
+ *
+ * Shorthand for Lua::Multret.new.
+ */
+static VALUE rbLua_multret(VALUE self, VALUE args)
+{
+  return rb_funcall(cLuaMultret, rb_intern("new"), 1, args);
+}
+
+// bootstrap* are from Lua5.3 source
+#define SPACECHARS	" \f\n\r\t\v"
+
+static const char *b_str2int (const char *s, int base, lua_Integer *pn) {
+  lua_Unsigned n = 0;
+  int neg = 0;
+  s += strspn(s, SPACECHARS);  /* skip initial spaces */
+  if (*s == '-') { s++; neg = 1; }  /* handle sign */
+  else if (*s == '+') s++;
+  if (!isalnum((unsigned char)*s))  /* no digit? */
+    return NULL;
+  do {
+    int digit = (isdigit((unsigned char)*s)) ? *s - '0'
+                   : (toupper((unsigned char)*s) - 'A') + 10;
+    if (digit >= base) return NULL;  /* invalid numeral */
+    n = n * base + digit;
+    s++;
+  } while (isalnum((unsigned char)*s));
+  s += strspn(s, SPACECHARS);  /* skip trailing spaces */
+  *pn = (lua_Integer)((neg) ? (0u - n) : n);
+  return s;
+}
+
+static int bootstrap_tonumber (lua_State *L) {
+  if (lua_isnoneornil(L, 2)) {  /* standard conversion? */
+    if (lua_type(L, 1) == LUA_TNUMBER) {  /* already a number? */
+      lua_settop(L, 1);  /* yes; return it */
+      return 1;
+    }
+    else {
+      size_t l;
+      const char *s = lua_tolstring(L, 1, &l);
+      if (s != NULL && lua_stringtonumber(L, s) == l + 1)
+        return 1;  /* successful conversion to number */
+      /* else not a number */
+      luaL_checkany(L, 1);  /* (but there must be some parameter) */
+    }
+  }
+  else {
+    size_t l;
+    const char *s;
+    lua_Integer n = 0;  /* to avoid warnings */
+    lua_Integer base = luaL_checkinteger(L, 2);
+    luaL_checktype(L, 1, LUA_TSTRING);  /* no numbers as strings */
+    s = lua_tolstring(L, 1, &l);
+    luaL_argcheck(L, 2 <= base && base <= 36, 2, "base out of range");
+    if (b_str2int(s, (int)base, &n) == s + l) {
+      lua_pushinteger(L, n);
+      return 1;
+    }  /* else not a number */
+  }  /* else not a number */
+  lua_pushnil(L);  /* not a number */
+  return 1;
+}
+
+static int bootstrap_tostring (lua_State *L) {
+  luaL_checkany(L, 1);
+  luaL_tolstring(L, 1, NULL);
+  return 1;
+}
+
+static int bootstrap_error (lua_State *L) {
+  int level = (int)luaL_optinteger(L, 2, 1);
+  lua_settop(L, 1);
+  if (lua_type(L, 1) == LUA_TSTRING && level > 0) {
+    luaL_where(L, level);   /* add extra information */
+    lua_pushvalue(L, 1);
+    lua_concat(L, 2);
+  }
+  return lua_error(L);
+}
+
+static int bootstrap_type (lua_State *L) {
+  int t = lua_type(L, 1);
+  luaL_argcheck(L, t != LUA_TNONE, 1, "value expected");
+  lua_pushstring(L, lua_typename(L, t));
+  return 1;
+}
+
+static int bootstrap_next (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 2);  /* create a 2nd argument if there isn't one */
+  if (lua_next(L, 1))
+    return 2;
+  else {
+    lua_pushnil(L);
+    return 1;
+  }
+}
+
+static int bootstrap_pairs (lua_State *L) {
+  luaL_checkany(L, 1);
+  if (luaL_getmetafield(L, 1, "__pairs") == LUA_TNIL) {  /* no metamethod? */
+    lua_pushcfunction(L, bootstrap_next);  /* will return generator, */
+    lua_pushvalue(L, 1);  /* state, */
+    lua_pushnil(L);  /* and initial value */
+  }
+  else {
+    lua_pushvalue(L, 1);  /* argument 'self' to metamethod */
+    lua_call(L, 1, 3);  /* get 3 values from metamethod */
+  }
+  return 3;
+}
+
+static int bootstrap_inext (lua_State *L) {
+  lua_Integer i = luaL_checkinteger(L, 2);
+  luaL_checktype(L, 1, LUA_TTABLE);
+  i++;  /* next value */
+  lua_pushinteger(L, i);
+  lua_rawgeti(L, 1, i);
+  return (lua_isnil(L, -1)) ? 0 : 2;
+}
+
+static int ipairsaux (lua_State *L) {
+  lua_Integer i = luaL_checkinteger(L, 2) + 1;
+  lua_pushinteger(L, i);
+  return (lua_geti(L, 1, i) == LUA_TNIL) ? 1 : 2;
+}
+
+static int bootstrap_ipairs (lua_State *L) {
+  luaL_checkany(L, 1);
+  lua_pushcfunction(L, ipairsaux);  /* iteration function */
+  lua_pushvalue(L, 1);  /* state */
+  lua_pushinteger(L, 0);  /* initial value */
+  return 3;
+}
+
+static int bootstrap_select (lua_State *L) {
+  int n = lua_gettop(L);
+  if (lua_type(L, 1) == LUA_TSTRING && *lua_tostring(L, 1) == '#') {
+    lua_pushinteger(L, n-1);
+    return 1;
+  }
+  else {
+    lua_Integer i = luaL_checkinteger(L, 1);
+    if (i < 0) i = n + i;
+    else if (i > n) i = n;
+    luaL_argcheck(L, 1 <= i, 1, "index out of range");
+    return n - (int)i;
+  }
+}
+
+static int bootstrap_assert (lua_State *L) {
+  if (lua_toboolean(L, 1))  /* condition is true? */
+    return lua_gettop(L);  /* return all arguments */
+  else {  /* error */
+    luaL_checkany(L, 1);  /* there must be a condition */
+    lua_remove(L, 1);  /* remove it */
+    lua_pushliteral(L, "assertion failed!");  /* default message */
+    lua_settop(L, 1);  /* leave only message (default if no other one) */
+    return bootstrap_error(L);  /* call 'error' */
+  }
+}
+
+static int finishpcall (lua_State *L, int status, lua_KContext extra) {
+  if (status != LUA_OK && status != LUA_YIELD) {  /* error? */
+    lua_pushboolean(L, 0);  /* first result (false) */
+    lua_pushvalue(L, -2);  /* error message */
+    return 2;  /* return false, msg */
+  }
+  else
+    return lua_gettop(L) - (int)extra;  /* return all results */
+}
+
+static int bootstrap_pcall (lua_State *L) {
+  int status;
+  luaL_checkany(L, 1);
+  lua_pushboolean(L, 1);  /* first result if no errors */
+  lua_insert(L, 1);  /* put it in place */
+  status = lua_pcallk(L, lua_gettop(L) - 2, LUA_MULTRET, 0, 0, finishpcall);
+  return finishpcall(L, status, 0);
+}
+
+static int bootstrap_xpcall (lua_State *L) {
+  int status;
+  int n = lua_gettop(L);
+  luaL_checktype(L, 2, LUA_TFUNCTION);  /* check error function */
+  lua_pushboolean(L, 1);  /* first result */
+  lua_pushvalue(L, 1);  /* function */
+  lua_rotate(L, 3, 2);  /* move them below function's arguments */
+  status = lua_pcallk(L, n - 2, LUA_MULTRET, 2, 2, finishpcall);
+  return finishpcall(L, status, 2);
+}
+
+static const
+  struct { const char* name; lua_CFunction func; }
+  stdlib[] = {
+    { "type",     bootstrap_type     },
+    { "next",     bootstrap_next     },
+    { "tonumber", bootstrap_tonumber },
+    { "tostring", bootstrap_tostring },
+    { "select",   bootstrap_select   },
+    { "error",    bootstrap_error    },
+    { "assert",   bootstrap_assert   },
+    { "pcall",    bootstrap_pcall    },
+    { "xpcall",   bootstrap_xpcall   },
+  };
+
+/*
+ * call-seq: state.__bootstrap() -> true
+ *
+ * Deploys an absolute minimum of functions required to write minimally
+ * useful Lua programs. This is really a subset of Lua _base_ library
+ * (copied from Lua 5.3 sources) that may be handy if you don't like standard
+ * function layout. All of these functions can be implemented in pure Ruby,
+ * but that will slow down Lua code incredibly.
+ *
+ * <b>If you want to get familiar layout described in Lua documentation, check
+ * #__load_stdlib function.</b>
+ *
+ * Exact list of functions defined: type, next, tonumber, tostring, select,
+ * error, assert, pcall, xpcall.
+ */
+static VALUE rbLua_bootstrap(VALUE self)
+{
+  lua_State* state = rlua_get_state(self);
+
+  for(size_t nf = 0; nf < sizeof(stdlib) / sizeof(stdlib[0]); nf++) {
+    lua_pushcclosure(state, stdlib[nf].func, 0);
+    lua_setglobal(state, stdlib[nf].name);
+  }
+
+  lua_pushcfunction(state, bootstrap_next);
+  lua_pushcclosure(state, bootstrap_pairs, 1);
+  lua_setglobal(state, "pairs");
+
+  lua_pushcfunction(state, bootstrap_inext);
+  lua_pushcclosure(state, bootstrap_ipairs, 1);
+  lua_setglobal(state, "ipairs");
+
+  return Qtrue;
+}
+
+// from lua5.3/linit.c
+static void rlua_openlib(lua_State* state, const char* name, lua_CFunction func)
+{
+  luaL_requiref(state, name, func, 1);
+  lua_pop(state, 1);  /* remove lib */
+}
+
+static const
+  struct { const char* alias; const char* name; lua_CFunction func; }
+  libs[] = {
+  {"base", "_G", luaopen_base},
+  {NULL, LUA_LOADLIBNAME, luaopen_package},
+#if LUA_VERSION_NUM >= 502
+  {NULL, LUA_COLIBNAME, luaopen_coroutine},
+#endif
+  {NULL, LUA_TABLIBNAME, luaopen_table},
+  {NULL, LUA_IOLIBNAME, luaopen_io},
+  {NULL, LUA_OSLIBNAME, luaopen_os},
+  {NULL, LUA_STRLIBNAME, luaopen_string},
+  {NULL, LUA_MATHLIBNAME, luaopen_math},
+#ifdef LUA_UTF8LIBNAME
+  {NULL, LUA_UTF8LIBNAME, luaopen_utf8},
+#endif
+  {NULL, LUA_DBLIBNAME, luaopen_debug},
+#ifdef LUA_BITLIBNAME
+  {NULL, LUA_BITLIBNAME, luaopen_bit},
+#endif
+#ifdef LUA_JITLIBNAME
+  {NULL, LUA_JITLIBNAME, luaopen_jit},
+#endif
+};
+
+/*
+ * Lazy standard library, see __load_stdlib(:lazy). The globals table gets a
+ * metatable whose __index opens a library the first time its global name is
+ * read. Upvalue 1 of the loader closure maps pending global names to their
+ * libs[] entry; once it is empty, the metatable is removed again. Once the
+ * package library is open, package.preload has a loader for every pending
+ * library as well, so that +require+ finds them.
+ */
+static void rlua_lazy_preload(lua_State* state, int pending);
+
+static void rlua_lazy_open(lua_State* state, int nl)
+{
+  lua_pushnil(state);                                // stack: |key |...
+  while(lua_next(state, lua_upvalueindex(1))) {      //        |indx|key |...
+    if(lua_tointeger(state, -1) == nl) {
+      lua_pushvalue(state, -2);                      //        |key |indx|key |...
+      lua_pushnil(state);                            //        |nil |key |indx|key |...
+      lua_rawset(state, lua_upvalueindex(1));        //        |indx|key |...
+    }
+    lua_pop(state, 1);                               //        |key |...
+  }
+
+  rlua_openlib(state, libs[nl].name, libs[nl].func);
+  if(!strcmp(libs[nl].name, LUA_LOADLIBNAME))
+    rlua_lazy_preload(state, lua_upvalueindex(1));
+
+  lua_pushnil(state);                                //        |nil |...
+  if(lua_next(state, lua_upvalueindex(1))) {         //        |indx|key |...
+    lua_pop(state, 2);                               //        |...
+  } else {
+    lua_pushglobaltable(state);                      //        |_G  |...
+    lua_pushnil(state);                              //        |nil |_G  |...
+    lua_setmetatable(state, -2);                     //        |_G  |...
+    lua_pop(state, 1);                               //        |...
+  }
+}
+
+// __index of the globals table.
+static int rlua_lazy_index(lua_State* state)
+{
+  lua_settop(state, 2);                              // stack: |key |_G  |
+  lua_pushvalue(state, 2);                           //        |key |key |_G  |
+  if(lua_rawget(state, lua_upvalueindex(1)) != LUA_TNUMBER) {
+    lua_pushnil(state);                              //        |nil |nil |key |_G  |
+    return 1;
+  }
+
+  rlua_lazy_open(state, (int) lua_tointeger(state, -1));
+  lua_pop(state, 1);                                 //        |key |_G  |
+  lua_rawget(state, 1);                              //        |valu|_G  |
+  return 1;
+}
+
+// package.preload loader of a pending library; upvalue 2 is its libs[] entry.
+static int rlua_lazy_require(lua_State* state)
+{
+  int nl = (int) lua_tointeger(state, lua_upvalueindex(2));
+
+  lua_getfield(state, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);  // stack: |LOAD|...
+  if(lua_getfield(state, -1, libs[nl].name) == LUA_TNIL) {   //        |lib |LOAD|...
+    lua_pop(state, 1);                               //        |LOAD|...
+    rlua_lazy_open(state, nl);
+    lua_getfield(state, -1, libs[nl].name);          //        |lib |LOAD|...
+  }
+  return 1;
+}
+
+// Adds loaders of the libraries pending in table +pending+ to package.preload,
+// if the package library is open.
+static void rlua_lazy_preload(lua_State* state, int pending)
+{
+  lua_getfield(state, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);  // stack: |LOAD|...
+  lua_getfield(state, -1, LUA_LOADLIBNAME);          //        |pkg |LOAD|...
+  if(!lua_istable(state, -1)) {
+    lua_pop(state, 2);
+    return;
+  }
+  lua_getfield(state, -1, "preload");                //        |prld|pkg |LOAD|...
+  if(!lua_istable(state, -1)) {
+    lua_pop(state, 3);
+    return;
+  }
+
+  lua_pushnil(state);                                //        |key |prld|pkg |LOAD|...
+  while(lua_next(state, pending)) {                  //        |indx|key |prld|pkg |LOAD|...
+    int nl = (int) lua_tointeger(state, -1);
+    if(strcmp(lua_tostring(state, -2), libs[nl].name)) {
+      lua_pop(state, 1);                             //        |key |prld|pkg |LOAD|...
+      continue;
+    }
+    lua_pushvalue(state, pending);                   //        |pend|indx|key |prld|pkg |LOAD|...
+    lua_insert(state, -2);                           //        |indx|pend|key |prld|pkg |LOAD|...
+    lua_pushcclosure(state, rlua_lazy_require, 2);   //        |ldr |key |prld|pkg |LOAD|...
+    lua_setfield(state, -3, libs[nl].name);          //        |key |prld|pkg |LOAD|...
+  }
+  lua_pop(state, 3);                                 //        ...
+}
+
+static void rlua_load_lazy(lua_State* state)
+{
+  lua_pushglobaltable(state);                        // stack: |_G  |...
+  if(lua_getmetatable(state, -1)) {                  //        |meta|_G  |...
+    lua_pop(state, 2);
+    rb_raise(rb_eArgError, "globals table already has a metatable");
+  }
+
+  // The string library is needed by method calls on strings and, in Lua
+  // 5.4, by string arithmetic ("10" + 1) through the string metatable.
+  rlua_openlib(state, "_G", luaopen_base);
+  rlua_openlib(state, LUA_STRLIBNAME, luaopen_string);
+
+  lua_newtable(state);                               //        |pend|_G  |...
+  lua_getfield(state, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);  // |LOAD|pend|_G  |...
+  for(size_t nl = 0; nl < sizeof(libs) / sizeof(libs[0]); nl++) {
+    if(libs[nl].alias != NULL)
+      continue;
+
+    int loaded = lua_getfield(state, -1, libs[nl].name) != LUA_TNIL;
+    lua_pop(state, 1);
+    if(loaded)
+      continue;
+
+    lua_pushinteger(state, nl);
+    lua_setfield(state, -3, libs[nl].name);
+    if(!strcmp(libs[nl].name, LUA_LOADLIBNAME)) {
+      lua_pushinteger(state, nl);
+      lua_setfield(state, -3, "require");
+    }
+  }
+  lua_pop(state, 1);                                 //        |pend|_G  |...
+
+  lua_pushnil(state);
+  if(!lua_next(state, -2)) {                         //        |pend|_G  |...
+    lua_pop(state, 2);
+    return;
+  }
+  lua_pop(state, 2);
+  rlua_lazy_preload(state, lua_gettop(state));
+
+  lua_createtable(state, 0, 1);                      //        |meta|pend|_G  |...
+  lua_insert(state, -2);                             //        |pend|meta|_G  |...
+  lua_pushcclosure(state, rlua_lazy_index, 1);       //        |indx|meta|_G  |...
+  lua_setfield(state, -2, "__index");                //        |meta|_G  |...
+  lua_setmetatable(state, -2);                       //        |_G  |...
+  lua_pop(state, 1);                                 //        |...
+}
+
+/*
+ * call-seq: state.__load_stdlib(*libs) -> true
+ *
+ * Loads Lua standard libraries. There are two ways of calling this function:
+ *
+ * If you will call it as __load_stdlib(:all), it is equivalent to calling
+ * C +luaL_openlibs+ function.
+ *
+ * If you will pass it symbolized names of separate libraries (like :base),
+ * it is equivalent to calling corresponding +luaopen_*+ functions.
+ *
+ * If you will call it as __load_stdlib(:lazy), the base and _string_
+ * libraries are loaded right away (strings need the latter for their
+ * methods and arithmetic) and every other library only when its global
+ * name (or +require+, for _package_) is first read, or when +require+ asks
+ * for it. This keeps states which only use a couple of libraries small and
+ * quick to create. The loader is a
+ * metatable on the globals table, so the latter must not have one already;
+ * it removes itself once every library is loaded.
+ *
+ * Examples:
+ *
+ *   # Load all standard libraries
+ *   state = Lua::State.new
+ *   state.__load_stdlib :all
+ *
+ *   # Load only math, string and table libraries
+ *   state = Lua::State.new
+ *   state.__load_stdlib :math, :string, :table
+ *
+ *   # Load libraries as they are used
+ *   state = Lua::State.new
+ *   state.__load_stdlib :lazy
+ *
+ * Exact list of libraries recognized: <tt>:base</tt>, <tt>:table</tt>,
+ * <tt>:math</tt>, <tt>:string</tt>, <tt>:debug</tt>, <tt>:io</tt>,
+ * <tt>:os</tt>, <tt>:package</tt>, <tt>:coroutine</tt> and <tt>:utf8</tt>
+ * (Lua 5.4), <tt>:bit</tt> and <tt>:jit</tt> (LuaJIT), plus <tt>:all</tt>
+ * and <tt>:lazy</tt> described above.
+ * <b>Anything not included in this list will be silently ignored.</b>
+ */
+static VALUE rbLua_load_stdlib(VALUE self, VALUE args)
+{
+  lua_State* state = rlua_get_state(self);
+
+  if(rb_ary_includes(args, ID2SYM(rb_intern("all")))) {
+    luaL_openlibs(state);
+  } else if(rb_ary_includes(args, ID2SYM(rb_intern("lazy")))) {
+    rlua_load_lazy(state);
+  } else {
+    for(size_t nl = 0; nl < sizeof(libs) / sizeof(libs[0]); nl++) {
+      const char* name = libs[nl].alias != NULL ? libs[nl].alias : libs[nl].name;
+      if (rb_ary_includes(args, ID2SYM(rb_intern(name)))) {
+        rlua_openlib(state, libs[nl].name, libs[nl].func);
+      }
+    }
+  }
+
+  return Qtrue;
+}
+
+#ifdef LUA_GCGEN
+static int rlua_gc_option(VALUE options, const char* name)
+{
+  if(options == Qnil)
+    return 0;
+
+  VALUE value = rb_hash_aref(options, ID2SYM(rb_intern(name)));
+  return value == Qnil ? 0 : NUM2INT(value);
+}
+
+static VALUE rlua_gc_mode(int mode)
+{
+  return ID2SYM(rb_intern(mode == LUA_GCGEN ? "generational" : "incremental"));
+}
+#endif
+
+/*
+ * call-seq: state.gc(operation, *args) -> value
+ *
+ * Controls Lua garbage collector, much like +collectgarbage+ Lua function
+ * (which is not available unless base library is loaded). Recognized
+ * operations are:
+ *
+ * <tt>:collect</tt>:: performs a full garbage-collection cycle.
+ * <tt>:step</tt>:: performs a collection step; optional argument is the
+ *                  amount of kilobytes to collect, 0 means one basic step.
+ *                  Returns true if the step finished a cycle.
+ * <tt>:stop</tt>:: stops automatic collection until <tt>:restart</tt> is
+ *                  called. Explicit <tt>:step</tt> and <tt>:collect</tt>
+ *                  calls still work.
+ * <tt>:restart</tt>:: restarts automatic collection.
+ * <tt>:running</tt>:: returns true if the collector is not stopped.
+ * <tt>:count</tt>:: returns the amount of memory in use by Lua, in kilobytes.
+ * <tt>:incremental</tt>:: switches to incremental mode. Accepts +pause+,
+ *                         +stepmul+ and +stepsize+ options; omitted ones are
+ *                         left unchanged. Returns the previous mode.
+ * <tt>:generational</tt>:: switches to generational mode. Accepts +minor+
+ *                          and +major+ options. Returns the previous mode.
+ *
+ * Collector modes raise NotImplementedError when built against LuaJIT.
+ *
+ * Examples:
+ *
+ *   state = Lua::State.new
+ *   state.gc(:generational, minor: 20, major: 100) # => :incremental
+ *   state.gc(:count)                               # => 22.4951171875
+ *
+ * See also #gc_idle for running the collector between requests.
+ */
+static VALUE rbLua_gc(int argc, VALUE* argv, VALUE self)
+{
+  VALUE operation, arg;
+  rb_scan_args(argc, argv, "11", &operation, &arg);
+
+  lua_State* state = rlua_get_state(self);
+
+  Check_Type(operation, T_SYMBOL);
+  ID id = SYM2ID(operation);
+
+  if(id == rb_intern("collect")) {
+    lua_gc(state, LUA_GCCOLLECT);
+    return Qnil;
+  } else if(id == rb_intern("step")) {
+    int kb = arg == Qnil ? 0 : NUM2INT(arg);
+    return lua_gc(state, LUA_GCSTEP, kb) ? Qtrue : Qfalse;
+  } else if(id == rb_intern("stop")) {
+    lua_gc(state, LUA_GCSTOP);
+    return Qnil;
+  } else if(id == rb_intern("restart")) {
+    lua_gc(state, LUA_GCRESTART);
+    return Qnil;
+  } else if(id == rb_intern("running")) {
+    return lua_gc(state, LUA_GCISRUNNING) ? Qtrue : Qfalse;
+  } else if(id == rb_intern("count")) {
+    int kb = lua_gc(state, LUA_GCCOUNT);
+    int b  = lua_gc(state, LUA_GCCOUNTB);
+    return rb_float_new(kb + b / 1024.0);
+  } else if(id == rb_intern("incremental") || id == rb_intern("generational")) {
+#ifdef LUA_GCGEN
+    if(arg != Qnil)
+      Check_Type(arg, T_HASH);
+    if(id == rb_intern("incremental"))
+      return rlua_gc_mode(lua_gc(state, LUA_GCINC, rlua_gc_option(arg, "pause"),
+                                    rlua_gc_option(arg, "stepmul"), rlua_gc_option(arg, "stepsize")));
+    else
+      return rlua_gc_mode(lua_gc(state, LUA_GCGEN, rlua_gc_option(arg, "minor"),
+                                    rlua_gc_option(arg, "major")));
+#else
+    rb_raise(rb_eNotImpError, "garbage collector modes are not supported by %s", RLUA_BACKEND);
+#endif
+  } else {
+    rb_raise(rb_eArgError, "unknown garbage collector operation %s", rb_id2name(id));
+  }
+}
+
+/*
+ * call-seq: state.stats -> hash
+ *
+ * Returns counters of resources the state holds on behalf of Ruby, for
+ * watching long-running processes for leaks:
+ *
+ * <tt>:refs</tt>:: live Lua::Table and Lua::Function objects.
+ * <tt>:anchors</tt>:: Ruby objects reachable from Lua (callbacks, bundles,
+ *                     Struct shapes, ...).
+ * <tt>:registry</tt>:: length of the Lua registry array, which grows with
+ *                      the largest number of references ever held at once.
+ * <tt>:memory</tt>:: memory in use by Lua, in kilobytes (like
+ *                    <tt>gc(:count)</tt>).
+ *
+ * References of Ruby objects which were garbage collected are released
+ * before counting.
+ */
+static VALUE rbLua_stats(VALUE self)
+{
+  lua_State* state = rlua_get_state(self);
+  rlua_State* rstate = RLUA_STATE(state);
+
+  long anchors = 0;
+  for(rlua_Anchor* anchor = rstate->anchors.next; anchor != &rstate->anchors; anchor = anchor->next)
+    anchors++;
+
+  rb_nativethread_lock_lock(&rstate->lock);
+  long refs = rstate->holders - 1;
+  rb_nativethread_lock_unlock(&rstate->lock);
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("refs")), LONG2NUM(refs));
+  rb_hash_aset(stats, ID2SYM(rb_intern("anchors")), LONG2NUM(anchors));
+  rb_hash_aset(stats, ID2SYM(rb_intern("registry")), SIZET2NUM(lua_rawlen(state, LUA_REGISTRYINDEX)));
+  rb_hash_aset(stats, ID2SYM(rb_intern("memory")),
+               rb_float_new(lua_gc(state, LUA_GCCOUNT) + lua_gc(state, LUA_GCCOUNTB) / 1024.0));
+  return stats;
+}
+
+/*
+ * call-seq: state.set_globals(hash) -> hash
+ *
+ * Sets a global variable for every pair of +hash+ in a single call.
+ */
+static VALUE rbLua_set_globals(VALUE self, VALUE hash)
+{
+  Check_Type(hash, T_HASH);
+
+  lua_State* state = rlua_get_state(self);
+  lua_pushglobaltable(state);                      // stack: |_G  |...
+  rlua_bulk_write(state, rlua_bulk_merge, hash, 0);
+
+  return hash;
+}
+
+/*
+ * call-seq: state.dig(*keys) -> value
+ *
+ * Retrieves the value at path +keys+ starting from global table. See
+ * Lua::Table#dig.
+ */
+static VALUE rbLua_dig(int argc, VALUE* argv, VALUE self)
+{
+  lua_State* state = rlua_get_state(self);
+
+  if(!lua_checkstack(state, 3))
+    rb_raise(rb_eNoMemError, "cannot grow Lua stack");
+  lua_pushglobaltable(state);                      // stack: |_G  |...
+
+  VALUE value = Qnil;
+  if(rlua_dig(state, argc, argv))                  //        |valu|...
+    value = rlua_get_var(state);
+  lua_pop(state, 1);                               //        ...
+
+  return value;
+}
+
+/*
+ * call-seq: state.interrupt_check_interval -> int or nil
+ *
+ * Returns the number of Lua instructions between checks for Ruby
+ * interrupts, or nil if they are disabled (the default).
+ */
+static VALUE rbLua_get_interrupt_interval(VALUE self)
+{
+  int interval = rlua_get_rstate(self)->interrupt_interval;
+  return interval > 0 ? INT2NUM(interval) : Qnil;
+}
+
+/*
+ * call-seq: state.interrupt_check_interval = int or nil
+ *
+ * Makes Lua code check for pending Ruby interrupts every +int+ virtual
+ * machine instructions, so that other Ruby threads get scheduled, signal
+ * handlers run, and Thread#raise or Timeout stop long-running scripts.
+ * An exception raised by an interrupt unwinds the Lua call and is
+ * re-raised as is. Pass nil to disable the checks.
+ *
+ *   state.interrupt_check_interval = 10_000
+ *   Timeout.timeout(1) { state.__eval 'while true do end' }
+ */
+static VALUE rbLua_set_interrupt_interval(VALUE self, VALUE interval)
+{
+  lua_State* state = rlua_get_state(self);
+  int value = NIL_P(interval) ? 0 : NUM2INT(interval);
+
+  if(value < 0)
+    rb_raise(rb_eArgError, "interval must not be negative");
+
+  RLUA_STATE(state)->interrupt_interval = value;
+  if(value > 0)
+    lua_sethook(state, rlua_interrupt_hook, LUA_MASKCOUNT, value);
+  else
+    lua_sethook(state, NULL, 0, 0);
+
+  return interval;
+}
+
+/*
+ * call-seq: state.symbolize_keys -> true or false
+ *
+ * Returns true if string keys of Lua tables are returned as Symbols when
+ * traversing them with Lua::Table#each or Lua::Table#to_hash.
+ */
+static VALUE rbLua_get_symbolize_keys(VALUE self)
+{
+  return rlua_get_rstate(self)->symbolize_keys ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: state.symbolize_keys = true or false
+ *
+ * Makes traversal of Lua tables return string keys as Symbols. Off by
+ * default.
+ */
+static VALUE rbLua_set_symbolize_keys(VALUE self, VALUE flag)
+{
+  rlua_get_rstate(self)->symbolize_keys = RTEST(flag);
+  return flag;
+}
+
+/*
+ * call-seq: state.profile_callbacks -> true or false
+ *
+ * Returns true if every Ruby callback converted to a Lua function is
+ * profiled, not only those given a name in Lua::Function.new.
+ */
+static VALUE rbLua_get_profile_callbacks(VALUE self)
+{
+  return rlua_get_rstate(self)->profile_callbacks ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: state.profile_callbacks = true or false
+ *
+ * Makes Ruby callbacks converted to Lua functions from now on record their
+ * timings under the source location of the proc (or the class name of other
+ * callables). Off by default. Profiling costs two reads of the monotonic
+ * clock per call.
+ */
+static VALUE rbLua_set_profile_callbacks(VALUE self, VALUE flag)
+{
+  rlua_get_rstate(self)->profile_callbacks = RTEST(flag);
+  return flag;
+}
+
+/*
+ * call-seq: state.callback_profile -> hash
+ *
+ * Returns timings of profiled Ruby callbacks as a Hash of name to
+ * <tt>{ calls: int, total: seconds, histogram: { upper_ns => calls } }</tt>.
+ * Every histogram key is a power of two; a call taking +t+ nanoseconds is
+ * counted under the smallest key greater than +t+, and calls slower than
+ * 2**31 ns under the largest key. Empty buckets are omitted.
+ *
+ *   state.profile_callbacks = true
+ *   state.log = lambda { |msg| ... }
+ *   state.__eval "for i = 1, 100 do log(i) end"
+ *   state.callback_profile
+ *   # => {"app.rb:2"=>{:calls=>100, :total=>0.00012, :histogram=>{1024=>97, 2048=>3}}}
+ */
+static VALUE rbLua_callback_profile(VALUE self)
+{
+  rlua_State* rstate = rlua_get_rstate(self);
+  VALUE result = rb_hash_new();
+  rlua_Profile* profile;
+  int i;
+
+  for(profile = rstate->profiles; profile; profile = profile->next) {
+    VALUE histogram = rb_hash_new();
+    for(i = 0; i < RLUA_PROFILE_BUCKETS; i++) {
+      if(profile->histogram[i])
+        rb_hash_aset(histogram, ULL2NUM(1ULL << i), ULL2NUM(profile->histogram[i]));
+    }
+
+    VALUE entry = rb_hash_new();
+    rb_hash_aset(entry, ID2SYM(rb_intern("calls")), ULL2NUM(profile->calls));
+    rb_hash_aset(entry, ID2SYM(rb_intern("total")), DBL2NUM(profile->total_ns / 1e9));
+    rb_hash_aset(entry, ID2SYM(rb_intern("histogram")), histogram);
+
+    rb_hash_aset(result, rb_utf8_str_new(profile->name, profile->name_len), entry);
+  }
+
+  return result;
+}
+
+/*
+ * call-seq: state.reset_callback_profile -> nil
+ *
+ * Zeroes all timings reported by #callback_profile.
+ */
+static VALUE rbLua_reset_callback_profile(VALUE self)
+{
+  rlua_Profile* profile;
+
+  for(profile = rlua_get_rstate(self)->profiles; profile; profile = profile->next) {
+    profile->calls = profile->total_ns = 0;
+    memset(profile->histogram, 0, sizeof(profile->histogram));
+  }
+
+  return Qnil;
+}
+
+/*
+ * call-seq: state.max_conversion_depth -> int
+ *
+ * Returns the deepest nesting of Arrays and Hashes which will be converted
+ * to Lua tables. Deeper structures raise ArgumentError. Defaults to 100.
+ */
+static VALUE rbLua_get_max_depth(VALUE self)
+{
+  return INT2NUM(rlua_get_rstate(self)->max_depth);
+}
+
+/*
+ * call-seq: state.max_conversion_depth = int
+ *
+ * Sets the deepest nesting of Arrays and Hashes which will be converted
+ * to Lua tables.
+ */
+static VALUE rbLua_set_max_depth(VALUE self, VALUE depth)
+{
+  int value = NUM2INT(depth);
+  if(value < 1)
+    rb_raise(rb_eArgError, "conversion depth must be positive");
+
+  rlua_get_rstate(self)->max_depth = value;
+  return depth;
+}
+
+/*
+ * call-seq: state.max_conversion_elements -> int or nil
+ *
+ * Returns the total number of Array elements and Hash pairs which may be
+ * converted to Lua in a single value, or nil if there is no limit (the
+ * default).
+ */
+static VALUE rbLua_get_max_elements(VALUE self)
+{
+  long value = rlua_get_rstate(self)->max_elements;
+  return value > 0 ? LONG2NUM(value) : Qnil;
+}
+
+/*
+ * call-seq: state.max_conversion_elements = int or nil
+ *
+ * Limits the total number of Array elements and Hash pairs which may be
+ * converted to Lua in a single value. Larger values raise ArgumentError.
+ * Pass nil to remove the limit.
+ */
+static VALUE rbLua_set_max_elements(VALUE self, VALUE elements)
+{
+  long value = NIL_P(elements) ? 0 : NUM2LONG(elements);
+  if(!NIL_P(elements) && value < 1)
+    rb_raise(rb_eArgError, "element limit must be positive");
+
+  rlua_get_rstate(self)->max_elements = value;
+  return elements;
+}
+
+/*
+ * Serialized values ("packets") carry numbers, strings, booleans and nested
+ * tables between interpreters which may live on different threads. Packets
+ * are plain malloc'd memory and can be read and written without the GVL.
+ */
+#define RLUA_PACKET_NIL    'n'
+#define RLUA_PACKET_TRUE   't'
+#define RLUA_PACKET_FALSE  'f'
+#define RLUA_PACKET_INT    'i'
+#define RLUA_PACKET_FLOAT  'd'
+#define RLUA_PACKET_STRING 's'
+#define RLUA_PACKET_ARRAY  'a'
+#define RLUA_PACKET_MAP    'm'
+
+#define RLUA_PACKET_DEPTH  64
+
+static int rlua_packet_write(rlua_Packet* packet, const void* data, size_t size)
+{
+  if(packet->size + size > packet->capa) {
+    size_t capa = packet->capa ? packet->capa : 64;
+    while(capa < packet->size + size)
+      capa *= 2;
+
+    char* grown = realloc(packet->data, capa);
+    if(grown == NULL)
+      return 0;
+
+    packet->data = grown;
+    packet->capa = capa;
+  }
+
+  memcpy(packet->data + packet->size, data, size);
+  packet->size += size;
+
+  return 1;
+}
+
+static int rlua_packet_write_tag(rlua_Packet* packet, char tag, const void* data, size_t size)
+{
+  return rlua_packet_write(packet, &tag, 1) && rlua_packet_write(packet, data, size);
+}
+
+static void rlua_packet_free(rlua_Packet* packet)
+{
+  free(packet->data);
+  packet->data = NULL;
+  packet->size = packet->capa = 0;
+}
+
+static const char* rlua_packet_from_lua(rlua_Packet* packet, lua_State* state, int index, int depth)
+{
+  switch(lua_type(state, index)) {
+    case LUA_TNIL:
+      return rlua_packet_write_tag(packet, RLUA_PACKET_NIL, NULL, 0) ? NULL : "not enough memory";
+
+    case LUA_TBOOLEAN:
+      return rlua_packet_write_tag(packet, lua_toboolean(state, index) ? RLUA_PACKET_TRUE : RLUA_PACKET_FALSE,
+                                   NULL, 0) ? NULL : "not enough memory";
+
+    case LUA_TNUMBER:
+      if(lua_isinteger(state, index)) {
+        int64_t value = lua_tointeger(state, index);
+        return rlua_packet_write_tag(packet, RLUA_PACKET_INT, &value, sizeof(value)) ? NULL : "not enough memory";
+      } else {
+        double value = lua_tonumber(state, index);
+        return rlua_packet_write_tag(packet, RLUA_PACKET_FLOAT, &value, sizeof(value)) ? NULL : "not enough memory";
+      }
+
+    case LUA_TSTRING: {
+      size_t length;
+      const char* string = lua_tolstring(state, index, &length);
+      uint64_t size = length;
+      if(!rlua_packet_write_tag(packet, RLUA_PACKET_STRING, &size, sizeof(size)) ||
+         !rlua_packet_write(packet, string, length))
+        return "not enough memory";
+      return NULL;
+    }
+
+    case LUA_TTABLE: {
+      if(depth >= RLUA_PACKET_DEPTH)
+        return "table is nested too deeply (or contains a cycle)";
+      if(!lua_checkstack(state, 3))
+        return "stack overflow";
+
+      index = lua_absindex(state, index);
+      if(rlua_tracked(state, index)) {
+        rlua_track_field(state, index, "__index");
+        const char* error = rlua_packet_from_lua(packet, state, -1, depth);
+        lua_pop(state, 1);
+        return error;
+      }
+
+      uint32_t count = 0, length = lua_rawlen(state, index);
+      lua_pushnil(state);
+      while(lua_next(state, index)) {
+        count++;
+        lua_pop(state, 1);
+      }
+
+      const char* error = NULL;
+      if(count == length && length > 0) {
+        if(!rlua_packet_write_tag(packet, RLUA_PACKET_ARRAY, &count, sizeof(count)))
+          return "not enough memory";
+
+        for(uint32_t i = 1; i <= length && error == NULL; i++) {
+          lua_rawgeti(state, index, i);
+          error = rlua_packet_from_lua(packet, state, -1, depth + 1);
+          lua_pop(state, 1);
+        }
+      } else {
+        if(!rlua_packet_write_tag(packet, RLUA_PACKET_MAP, &count, sizeof(count)))
+          return "not enough memory";
+
+        lua_pushnil(state);
+        while(error == NULL && lua_next(state, index)) {
+          error = rlua_packet_from_lua(packet, state, -2, depth + 1);
+          if(error == NULL)
+            error = rlua_packet_from_lua(packet, state, -1, depth + 1);
+          lua_pop(state, error ? 2 : 1);
+        }
+      }
+
+      return error;
+    }
+
+    default:
+      return "cannot serialize function, userdata or thread values";
+  }
+}
+
+static int rlua_packet_read(const char** cursor, const char* end, void* data, size_t size)
+{
+  if((size_t)(end - *cursor) < size)
+    return 0;
+
+  memcpy(data, *cursor, size);
+  *cursor += size;
+
+  return 1;
+}
+
+// Pushes one serialized value. Must be called in protected mode.
+static void rlua_packet_to_lua(lua_State* state, const char** cursor, const char* end)
+{
+  char tag;
+  if(!rlua_packet_read(cursor, end, &tag, 1))
+    luaL_error(state, "truncated packet");
+
+  luaL_checkstack(state, 3, "packet is nested too deeply");
+
+  switch(tag) {
+    case RLUA_PACKET_NIL:
+      lua_pushnil(state);
+      break;
+
+    case RLUA_PACKET_TRUE:
+    case RLUA_PACKET_FALSE:
+      lua_pushboolean(state, tag == RLUA_PACKET_TRUE);
+      break;
+
+    case RLUA_PACKET_INT: {
+      int64_t value;
+      if(!rlua_packet_read(cursor, end, &value, sizeof(value)))
+        luaL_error(state, "truncated packet");
+      lua_pushinteger(state, value);
+      break;
+    }
+
+    case RLUA_PACKET_FLOAT: {
+      double value;
+      if(!rlua_packet_read(cursor, end, &value, sizeof(value)))
+        luaL_error(state, "truncated packet");
+      lua_pushnumber(state, value);
+      break;
+    }
+
+    case RLUA_PACKET_STRING: {
+      uint64_t size;
+      if(!rlua_packet_read(cursor, end, &size, sizeof(size)) || (uint64_t)(end - *cursor) < size)
+        luaL_error(state, "truncated packet");
+      lua_pushlstring(state, *cursor, size);
+      *cursor += size;
+      break;
+    }
+
+    case RLUA_PACKET_ARRAY: {
+      uint32_t i, count;
+      if(!rlua_packet_read(cursor, end, &count, sizeof(count)))
+        luaL_error(state, "truncated packet");
+
+      lua_createtable(state, count, 0);
+      for(i = 1; i <= count; i++) {
+        rlua_packet_to_lua(state, cursor, end);
+        lua_rawseti(state, -2, i);
+      }
+      break;
+    }
+
+    case RLUA_PACKET_MAP: {
+      uint32_t i, count;
+      if(!rlua_packet_read(cursor, end, &count, sizeof(count)))
+        luaL_error(state, "truncated packet");
+
+      lua_createtable(state, 0, count);
+      for(i = 0; i < count; i++) {
+        rlua_packet_to_lua(state, cursor, end);
+        rlua_packet_to_lua(state, cursor, end);
+        if(lua_isnil(state, -2))
+          lua_pop(state, 2);
+        else
+          lua_rawset(state, -3);
+      }
+      break;
+    }
+
+    default:
+      luaL_error(state, "malformed packet");
+  }
+}
+
+struct rlua_packet_ruby {
+  rlua_Packet* packet;
+  VALUE value;
+  int depth;
+};
+
+static void rlua_packet_from_ruby_value(rlua_Packet* packet, VALUE value, int depth);
+
+static int rlua_packet_from_ruby_pair(VALUE key, VALUE value, VALUE data)
+{
+  struct rlua_packet_ruby* pair = (struct rlua_packet_ruby*) data;
+
+  rlua_packet_from_ruby_value(pair->packet, key, pair->depth);
+  rlua_packet_from_ruby_value(pair->packet, value, pair->depth);
+
+  return ST_CONTINUE;
+}
+
+static void rlua_packet_from_ruby_value(rlua_Packet* packet, VALUE value, int depth)
+{
+  int ok;
+
+  if(depth >= RLUA_PACKET_DEPTH)
+    rb_raise(rb_eArgError, "value is nested too deeply (or contains a cycle)");
+
+  switch(TYPE(value)) {
+    case T_NIL:
+      ok = rlua_packet_write_tag(packet, RLUA_PACKET_NIL, NULL, 0);
+      break;
+
+    case T_TRUE:
+    case T_FALSE:
+      ok = rlua_packet_write_tag(packet, value == Qtrue ? RLUA_PACKET_TRUE : RLUA_PACKET_FALSE, NULL, 0);
+      break;
+
+    case T_FIXNUM: {
+      int64_t number = FIX2LONG(value);
+      ok = rlua_packet_write_tag(packet, RLUA_PACKET_INT, &number, sizeof(number));
+      break;
+    }
+
+    case T_BIGNUM:
+    case T_FLOAT: {
+      double number = NUM2DBL(value);
+      ok = rlua_packet_write_tag(packet, RLUA_PACKET_FLOAT, &number, sizeof(number));
+      break;
+    }
+
+    case T_SYMBOL:
+      value = rb_sym2str(value);
+      /* fallthrough */
+
+    case T_STRING: {
+      VALUE string = rb_str_export_to_enc(value, rb_default_external_encoding());
+      uint64_t size = RSTRING_LEN(string);
+      ok = rlua_packet_write_tag(packet, RLUA_PACKET_STRING, &size, sizeof(size)) &&
+           rlua_packet_write(packet, RSTRING_PTR(string), size);
+      break;
+    }
+
+    case T_ARRAY: {
+      uint32_t count = RARRAY_LEN(value);
+      ok = rlua_packet_write_tag(packet, RLUA_PACKET_ARRAY, &count, sizeof(count));
+      for(long i = 0; ok && i < RARRAY_LEN(value); i++)
+        rlua_packet_from_ruby_value(packet, RARRAY_AREF(value, i), depth + 1);
+      break;
+    }
+
+    case T_HASH: {
+      uint32_t count = RHASH_SIZE(value);
+      struct rlua_packet_ruby pair = { packet, Qnil, depth + 1 };
+      ok = rlua_packet_write_tag(packet, RLUA_PACKET_MAP, &count, sizeof(count));
+      if(ok)
+        rb_hash_foreach(value, rlua_packet_from_ruby_pair, (VALUE) &pair);
+      break;
+    }
+
+    default:
+      rb_raise(rb_eTypeError, "cannot serialize %s", rb_obj_classname(value));
+  }
+
+  if(!ok)
+    rb_raise(rb_eNoMemError, "cannot serialize value: not enough memory");
+}
+
+static VALUE rlua_packet_from_ruby_protected(VALUE data)
+{
+  struct rlua_packet_ruby* args = (struct rlua_packet_ruby*) data;
+  rlua_packet_from_ruby_value(args->packet, args->value, 0);
+  return Qnil;
+}
+
+// Serializes +value+; the packet is freed if an exception is raised.
+static void rlua_packet_from_ruby(rlua_Packet* packet, VALUE value)
+{
+  struct rlua_packet_ruby args = { packet, value, 0 };
+  int error;
+
+  rb_protect(rlua_packet_from_ruby_protected, (VALUE) &args, &error);
+  if(error) {
+    rlua_packet_free(packet);
+    rb_jump_tag(error);
+  }
+}
+
+static VALUE rlua_packet_to_ruby(const char** cursor, const char* end);
+
+struct rlua_packet_reader {
+  const char* cursor;
+  const char* end;
+};
+
+static VALUE rlua_packet_to_ruby_protected(VALUE data)
+{
+  struct rlua_packet_reader* reader = (struct rlua_packet_reader*) data;
+  return rlua_packet_to_ruby(&reader->cursor, reader->end);
+}
+
+static VALUE rlua_packet_to_ruby(const char** cursor, const char* end)
+{
+  char tag;
+  if(!rlua_packet_read(cursor, end, &tag, 1))
+    rb_raise(rb_eArgError, "truncated packet");
+
+  switch(tag) {
+    case RLUA_PACKET_NIL:
+      return Qnil;
+
+    case RLUA_PACKET_TRUE:
+      return Qtrue;
+
+    case RLUA_PACKET_FALSE:
+      return Qfalse;
+
+    case RLUA_PACKET_INT: {
+      int64_t value;
+      if(!rlua_packet_read(cursor, end, &value, sizeof(value)))
+        rb_raise(rb_eArgError, "truncated packet");
+      return LL2NUM(value);
+    }
+
+    case RLUA_PACKET_FLOAT: {
+      double value;
+      if(!rlua_packet_read(cursor, end, &value, sizeof(value)))
+        rb_raise(rb_eArgError, "truncated packet");
+      return rb_float_new(value);
+    }
+
+    case RLUA_PACKET_STRING: {
+      uint64_t size;
+      if(!rlua_packet_read(cursor, end, &size, sizeof(size)) || (uint64_t)(end - *cursor) < size)
+        rb_raise(rb_eArgError, "truncated packet");
+      VALUE string = rb_enc_str_new(*cursor, size, rb_default_external_encoding());
+      *cursor += size;
+      return string;
+    }
+
+    case RLUA_PACKET_ARRAY: {
+      uint32_t i, count;
+      if(!rlua_packet_read(cursor, end, &count, sizeof(count)))
+        rb_raise(rb_eArgError, "truncated packet");
+
+      VALUE array = rb_ary_new_capa(count);
+      for(i = 0; i < count; i++)
+        rb_ary_push(array, rlua_packet_to_ruby(cursor, end));
+      return array;
+    }
+
+    case RLUA_PACKET_MAP: {
+      uint32_t i, count;
+      if(!rlua_packet_read(cursor, end, &count, sizeof(count)))
+        rb_raise(rb_eArgError, "truncated packet");
+
+      VALUE hash = rb_hash_new();
+      for(i = 0; i < count; i++) {
+        VALUE key = rlua_packet_to_ruby(cursor, end);
+        rb_hash_aset(hash, key, rlua_packet_to_ruby(cursor, end));
+      }
+      return hash;
+    }
+
+    default:
+      rb_raise(rb_eArgError, "malformed packet");
+  }
+}
+
+/*
+ * Bundles are archives of precompiled modules:
+ *
+ *   "RLUB" count:u32 (name_size:u32 name code_size:u32 code)*
+ *
+ * with all integers little-endian. See also Lua::Bundle in lib/rlua.rb.
+ */
+typedef struct {
+  rlua_Anchor anchor;   // frozen archive String
+  const char* data;
+  size_t size;
+} rlua_Bundle;
+
+static int rlua_bundle_u32(const char* data, size_t size, size_t offset, uint32_t* value)
+{
+  if(offset > size || size - offset < 4)
+    return 0;
+
+  const unsigned char* p = (const unsigned char*) data + offset;
+  *value = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+
+  return 1;
+}
+
+static int rlua_bundle_writer(lua_State* state, const void* data, size_t size, void* packet)
+{
+  return !rlua_packet_write(packet, data, size);
+}
+
+/*
+ * call-seq: Lua::Bundle.compile(code, chunkname) -> String
+ *
+ * Compiles +code+ to Lua bytecode without debug information. Raises
+ * SyntaxError if code cannot be compiled. See Lua::Bundle.build.
+ */
+static VALUE rbLuaBundle_compile(VALUE self, VALUE code, VALUE chunkname)
+{
+  StringValue(code);
+
+  lua_State* state = luaL_newstate();
+  if(state == NULL)
+    rb_raise(rb_eNoMemError, "cannot create Lua state");
+
+  rlua_Packet packet = { NULL, 0, 0 };
+  int retval = luaL_loadbufferx(state, RSTRING_PTR(code), RSTRING_LEN(code), StringValueCStr(chunkname), "t");
+  if(retval == LUA_OK)
+    retval = lua_dump(state, rlua_bundle_writer, &packet, 1) ? LUA_ERRMEM : LUA_OK;
+
+  VALUE result;
+  if(retval == LUA_OK)
+    result = rb_str_new(packet.data, packet.size);
+  else if(retval == LUA_ERRMEM)
+    result = rb_exc_new_cstr(rb_eNoMemError, "not enough memory");
+  else
+    result = rb_exc_new_cstr(rb_eSyntaxError, lua_tostring(state, -1));
+
+  rlua_packet_free(&packet);
+  lua_close(state);
+
+  if(retval != LUA_OK)
+    rb_exc_raise(result);
+
+  return result;
+}
+
+static int rlua_bundle_gc(lua_State* state)
+{
+  rlua_Bundle* bundle = lua_touserdata(state, 1);
+  rlua_anchor_unlink(&bundle->anchor);
+  return 0;
+}
+
+static int rlua_bundle_searcher(lua_State* state)
+{
+  const char* name = luaL_checkstring(state, 1);
+
+  lua_settop(state, 1);
+  lua_pushvalue(state, 1);
+  if(lua_rawget(state, lua_upvalueindex(2)) != LUA_TNUMBER) {
+    lua_pushfstring(state, "no module '%s' in bundle", name);
+    return 1;
+  }
+
+  rlua_Bundle* bundle = lua_touserdata(state, lua_upvalueindex(1));
+  size_t offset = lua_tointeger(state, -1);
+  uint32_t size;
+  rlua_bundle_u32(bundle->data, bundle->size, offset, &size);
+
+  if(luaL_loadbufferx(state, bundle->data + offset + 4, size, name, "b") != LUA_OK)
+    return luaL_error(state, "error loading module '%s' from bundle:\n\t%s", name, lua_tostring(state, -1));
+
+  lua_pushliteral(state, ":bundle:");
+  return 2;
+}
+
+/*
+ * call-seq: state.mount_bundle(bundle) -> true
+ *
+ * Makes +require+ load modules from +bundle+ (a Lua::Bundle or its String
+ * representation) before looking anywhere else. Modules are served
+ * directly from bundle memory: there is no filesystem access, no parsing
+ * and no copying, so any number of states can mount the same bundle.
+ *
+ * Modules are loaded as bytecode, which Lua does not verify: malformed
+ * bytecode can crash the process or corrupt memory. Only mount bundles
+ * produced by a trusted build.
+ *
+ * The _package_ library must be loaded.
+ */
+static VALUE rbLua_mount_bundle(VALUE self, VALUE archive)
+{
+  lua_State* state = rlua_get_state(self);
+
+  if(rb_obj_is_kind_of(archive, cLuaBundle))
+    archive = rb_funcall(archive, rb_intern("data"), 0);
+  archive = rb_str_new_frozen(StringValue(archive));
+
+  const char* data = RSTRING_PTR(archive);
+  size_t size = RSTRING_LEN(archive);
+  uint32_t i, count;
+
+  if(size < 8 || memcmp(data, "RLUB", 4) != 0 || !rlua_bundle_u32(data, size, 4, &count))
+    rb_raise(rb_eArgError, "not a Lua bundle");
+
+  luaL_getsubtable(state, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);   // stack: |LOAD|...
+  lua_getfield(state, -1, LUA_LOADLIBNAME);                       //        |pack|LOAD|...
+  if(lua_type(state, -1) != LUA_TTABLE ||
+     lua_getfield(state, -1, RLUA_SEARCHERS) != LUA_TTABLE) {      //        |srch|pack|LOAD|...
+    lua_pop(state, 3);
+    rb_raise(rb_eArgError, "package library is not loaded");
+  }
+
+  rlua_Bundle* bundle = lua_newuserdatauv(state, sizeof(rlua_Bundle), 0);
+  bundle->anchor.value = archive;                                 //        |bndl|srch|pack|LOAD|...
+  bundle->data = data;
+  bundle->size = size;
+  rlua_anchor_link(RLUA_STATE(state), &bundle->anchor);
+  luaL_setmetatable(state, "rlua.bundle");
+
+  lua_createtable(state, 0, count);                               //        |indx|bndl|srch|pack|LOAD|...
+  size_t offset = 8;
+  for(i = 0; i < count; i++) {
+    uint32_t name_size, code_size;
+
+    if(!rlua_bundle_u32(data, size, offset, &name_size) || size - offset - 4 < name_size ||
+       !rlua_bundle_u32(data, size, offset + 4 + name_size, &code_size) ||
+       size - offset - 8 - name_size < code_size) {
+      lua_pop(state, 5);
+      rb_raise(rb_eArgError, "truncated Lua bundle");
+    }
+
+    lua_pushlstring(state, data + offset + 4, name_size);
+    lua_pushinteger(state, offset + 4 + name_size);
+    lua_rawset(state, -3);
+
+    offset += 8 + name_size + code_size;
+  }
+
+  lua_pushcclosure(state, rlua_bundle_searcher, 2);               //        |func|srch|pack|LOAD|...
+
+  // insert right after package.preload searcher
+  lua_Integer n = lua_rawlen(state, -2);
+  for(lua_Integer k = n; k >= 2; k--) {
+    lua_rawgeti(state, -2, k);
+    lua_rawseti(state, -3, k + 1);
+  }
+  lua_rawseti(state, -2, n >= 1 ? 2 : 1);                         //        |srch|pack|LOAD|...
+  lua_pop(state, 3);                                              //        ...
+
+  return Qtrue;
+}
+
+/*
+ * Shared tables are immutable trees of values stored in one block of memory
+ * ("image"), which any number of states on any threads read in place. Images
+ * refer to their parts only by offsets from the start, so they can be saved
+ * to a file and mapped back. An image is a rlua_SharedHeader followed by
+ * strings and tables; a table is a rlua_SharedTableHeader followed by its
+ * array part, hash entries and buckets (indexes of first entries plus one).
+ * Everything is in native byte order and aligned to 8 bytes.
+ */
+#define RLUA_SHARED_MAGIC   "RLUS"
+#define RLUA_SHARED_VERSION 1
+
+enum rlua_shared_kind {
+  RLUA_SHARED_NIL, RLUA_SHARED_FALSE, RLUA_SHARED_TRUE,
+  RLUA_SHARED_INT, RLUA_SHARED_FLOAT, RLUA_SHARED_STRING, RLUA_SHARED_TABLE
+};
+
+typedef struct {
+  uint32_t kind;
+  uint32_t size;                 // length of a string
+  union {
+    int64_t integer;
+    double number;
+    uint64_t offset;             // of string bytes or of a table
+  } as;
+} rlua_SharedValue;
+
+typedef struct {
+  rlua_SharedValue key, value;
+  uint32_t hash;
+  uint32_t next;                 // index of next entry in the bucket plus one
+} rlua_SharedEntry;
+
+typedef struct {
+  uint32_t narray, nhash, nbuckets, reserved;
+} rlua_SharedTable;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t size;
+  rlua_SharedValue root;
+} rlua_SharedHeader;
+
+typedef struct {
+  rb_atomic_t refs;              // Lua::SharedTable object plus every Lua view
+  const char* data;
+  size_t size;
+  int mapped;
+} rlua_Shared;
+
+// Userdata through which Lua sees one table of an image.
+typedef struct {
+  rlua_Shared* shared;
+  uint64_t table;
+} rlua_SharedView;
+
+// Looked up key, normalized the way Lua normalizes table keys.
+typedef struct {
+  uint32_t kind;
+  int64_t integer;
+  double number;
+  const char* string;
+  size_t size;
+  uint32_t hash;
+} rlua_SharedKey;
+
+static uint32_t rlua_shared_hash(uint32_t kind, const void* data, size_t size)
+{
+  const unsigned char* p = data;
+  uint32_t hash = 2166136261u ^ kind;
+
+  for(size_t i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 16777619u;
+
+  return hash;
+}
+
+static void rlua_shared_key_hash(rlua_SharedKey* key)
+{
+  switch(key->kind) {
+    case RLUA_SHARED_INT:
+      key->hash = rlua_shared_hash(key->kind, &key->integer, sizeof(key->integer));
+      break;
+    case RLUA_SHARED_FLOAT:
+      key->hash = rlua_shared_hash(key->kind, &key->number, sizeof(key->number));
+      break;
+    case RLUA_SHARED_STRING:
+      key->hash = rlua_shared_hash(key->kind, key->string, key->size);
+      break;
+    default:
+      key->hash = rlua_shared_hash(key->kind, NULL, 0);
+  }
+}
+
+static void rlua_shared_release(rlua_Shared* shared)
+{
+  if(RUBY_ATOMIC_FETCH_SUB(shared->refs, 1) != 1)
+    return;
+
+#ifdef HAVE_SYS_MMAN_H
+  if(shared->mapped)
+    munmap((void*) shared->data, shared->size);
+  else
+#endif
+    free((void*) shared->data);
+  free(shared);
+}
+
+// Returns table at +offset+, or NULL if it does not fit into the image.
+static const rlua_SharedTable* rlua_shared_table(rlua_Shared* shared, uint64_t offset)
+{
+  if(offset % 8 || offset > shared->size || shared->size - offset < sizeof(rlua_SharedTable))
+    return NULL;
+
+  const rlua_SharedTable* table = (const rlua_SharedTable*) (shared->data + offset);
+  uint64_t size = sizeof(rlua_SharedTable) + (uint64_t) table->narray * sizeof(rlua_SharedValue) +
+                  (uint64_t) table->nhash * sizeof(rlua_SharedEntry) + (uint64_t) table->nbuckets * sizeof(uint32_t);
+  if(shared->size - offset < size || (table->nhash && !table->nbuckets) ||
+     (table->nbuckets & (table->nbuckets - 1)))
+    return NULL;
+
+  return table;
+}
+
+#define RLUA_SHARED_ARRAY(table)   ((const rlua_SharedValue*) ((table) + 1))
+#define RLUA_SHARED_ENTRIES(table) ((const rlua_SharedEntry*) (RLUA_SHARED_ARRAY(table) + (table)->narray))
+#define RLUA_SHARED_BUCKETS(table) ((const uint32_t*) (RLUA_SHARED_ENTRIES(table) + (table)->nhash))
+
+static int rlua_shared_key_equal(rlua_Shared* shared, const rlua_SharedValue* stored, const rlua_SharedKey* key)
+{
+  if(stored->kind != key->kind)
+    return 0;
+
+  switch(key->kind) {
+    case RLUA_SHARED_INT:
+      return stored->as.integer == key->integer;
+    case RLUA_SHARED_FLOAT:
+      return stored->as.number == key->number;
+    case RLUA_SHARED_STRING:
+      return stored->size == key->size && stored->as.offset <= shared->size &&
+             shared->size - stored->as.offset >= key->size &&
+             memcmp(shared->data + stored->as.offset, key->string, key->size) == 0;
+    default:
+      return 1;
+  }
+}
+
+// Returns index of the hash entry with +key+ plus one, or 0.
+static uint32_t rlua_shared_find(rlua_Shared* shared, const rlua_SharedTable* table, const rlua_SharedKey* key)
+{
+  if(table->nhash == 0)
+    return 0;
+
+  const rlua_SharedEntry* entries = RLUA_SHARED_ENTRIES(table);
+  uint32_t index = RLUA_SHARED_BUCKETS(table)[key->hash & (table->nbuckets - 1)];
+  for(uint32_t steps = 0; index != 0 && index <= table->nhash && steps < table->nhash; steps++) {
+    const rlua_SharedEntry* entry = &entries[index - 1];
+    if(entry->hash == key->hash && rlua_shared_key_equal(shared, &entry->key, key))
+      return index;
+    index = entry->next;
+  }
+
+  return 0;
+}
+
+static void rlua_shared_push_view(lua_State* state, rlua_Shared* shared, uint64_t table)
+{
+  rlua_SharedView* view = lua_newuserdatauv(state, sizeof(rlua_SharedView), 0);
+  view->shared = shared;
+  view->table = table;
+  RUBY_ATOMIC_INC(shared->refs);
+  luaL_setmetatable(state, "rlua.shared");
+}
+
+static void rlua_shared_push(lua_State* state, rlua_Shared* shared, const rlua_SharedValue* value)
+{
+  switch(value->kind) {
+    case RLUA_SHARED_FALSE:
+    case RLUA_SHARED_TRUE:
+      lua_pushboolean(state, value->kind == RLUA_SHARED_TRUE);
+      break;
+
+    case RLUA_SHARED_INT:
+      lua_pushinteger(state, value->as.integer);
+      break;
+
+    case RLUA_SHARED_FLOAT:
+      lua_pushnumber(state, value->as.number);
+      break;
+
+    case RLUA_SHARED_STRING:
+      if(value->as.offset > shared->size || shared->size - value->as.offset < value->size)
+        luaL_error(state, "corrupt shared table");
+      lua_pushlstring(state, shared->data + value->as.offset, value->size);
+      break;
+
+    case RLUA_SHARED_TABLE:
+      rlua_shared_push_view(state, shared, value->as.offset);
+      break;
+
+    default:
+      lua_pushnil(state);
+  }
+}
+
+static rlua_SharedView* rlua_shared_check(lua_State* state, const rlua_SharedTable** table)
+{
+  rlua_SharedView* view = luaL_checkudata(state, 1, "rlua.shared");
+  *table = rlua_shared_table(view->shared, view->table);
+  if(*table == NULL)
+    luaL_error(state, "corrupt shared table");
+  return view;
+}
+
+// Returns 0 if value at +index+ cannot be a key of a shared table.
+static int rlua_shared_lua_key(lua_State* state, int index, rlua_SharedKey* key)
+{
+  lua_Integer integer;
+  int isint;
+
+  switch(lua_type(state, index)) {
+    case LUA_TSTRING:
+      key->kind = RLUA_SHARED_STRING;
+      key->string = lua_tolstring(state, index, &key->size);
+      break;
+
+    case LUA_TNUMBER:
+      integer = lua_tointegerx(state, index, &isint);
+      if(isint) {
+        key->kind = RLUA_SHARED_INT;
+        key->integer = integer;
+      } else {
+        key->kind = RLUA_SHARED_FLOAT;
+        key->number = lua_tonumber(state, index);
+      }
+      break;
+
+    case LUA_TBOOLEAN:
+      key->kind = lua_toboolean(state, index) ? RLUA_SHARED_TRUE : RLUA_SHARED_FALSE;
+      break;
+
+    default:
+      return 0;
+  }
+
+  rlua_shared_key_hash(key);
+  return 1;
+}
+
+static int rlua_shared_index(lua_State* state)
+{
+  const rlua_SharedTable* table;
+  rlua_SharedView* view = rlua_shared_check(state, &table);
+  rlua_SharedKey key;
+  uint32_t index;
+
+  if(!rlua_shared_lua_key(state, 2, &key)) {
+    lua_pushnil(state);
+  } else if(key.kind == RLUA_SHARED_INT && key.integer >= 1 && key.integer <= table->narray) {
+    rlua_shared_push(state, view->shared, &RLUA_SHARED_ARRAY(table)[key.integer - 1]);
+  } else if((index = rlua_shared_find(view->shared, table, &key))) {
+    rlua_shared_push(state, view->shared, &RLUA_SHARED_ENTRIES(table)[index - 1].value);
+  } else {
+    lua_pushnil(state);
+  }
+
+  return 1;
+}
+
+static int rlua_shared_len(lua_State* state)
+{
+  const rlua_SharedTable* table;
+  rlua_shared_check(state, &table);
+
+  lua_pushinteger(state, table->narray);
+  return 1;
+}
+
+static int rlua_shared_next(lua_State* state)
+{
+  const rlua_SharedTable* table;
+  rlua_SharedView* view = rlua_shared_check(state, &table);
+  rlua_SharedKey key;
+  uint64_t position = 0;   // array slots, then hash entries
+
+  lua_settop(state, 2);
+  if(!lua_isnil(state, 2)) {
+    if(!rlua_shared_lua_key(state, 2, &key))
+      return luaL_error(state, "invalid key to 'next'");
+
+    if(key.kind == RLUA_SHARED_INT && key.integer >= 1 && key.integer <= table->narray) {
+      position = key.integer;
+    } else {
+      uint32_t index = rlua_shared_find(view->shared, table, &key);
+      if(index == 0)
+        return luaL_error(state, "invalid key to 'next'");
+      position = (uint64_t) table->narray + index;
+    }
+  }
+
+  for(; position < table->narray; position++) {
+    const rlua_SharedValue* value = &RLUA_SHARED_ARRAY(table)[position];
+    if(value->kind != RLUA_SHARED_NIL) {
+      lua_pushinteger(state, position + 1);
+      rlua_shared_push(state, view->shared, value);
+      return 2;
+    }
+  }
+
+  position -= table->narray;
+  if(position < table->nhash) {
+    const rlua_SharedEntry* entry = &RLUA_SHARED_ENTRIES(table)[position];
+    rlua_shared_push(state, view->shared, &entry->key);
+    rlua_shared_push(state, view->shared, &entry->value);
+    return 2;
+  }
+
+  lua_pushnil(state);
+  return 1;
+}
+
+static int rlua_shared_pairs(lua_State* state)
+{
+  luaL_checkudata(state, 1, "rlua.shared");
+
+  lua_pushcfunction(state, rlua_shared_next);
+  lua_pushvalue(state, 1);
+  lua_pushnil(state);
+  return 3;
+}
+
+static int rlua_shared_newindex(lua_State* state)
+{
+  return luaL_error(state, "attempt to modify a shared table");
+}
+
+static int rlua_shared_eq(lua_State* state)
+{
+  rlua_SharedView* a = luaL_testudata(state, 1, "rlua.shared");
+  rlua_SharedView* b = luaL_testudata(state, 2, "rlua.shared");
+
+  lua_pushboolean(state, a && b && a->shared == b->shared && a->table == b->table);
+  return 1;
+}
+
+static int rlua_shared_tostring(lua_State* state)
+{
+  rlua_SharedView* view = luaL_checkudata(state, 1, "rlua.shared");
+
+  lua_pushfstring(state, "shared table: %p", view->shared->data + view->table);
+  return 1;
+}
+
+static int rlua_shared_gc(lua_State* state)
+{
+  rlua_SharedView* view = lua_touserdata(state, 1);
+  rlua_shared_release(view->shared);
+  return 0;
+}
+
+static const luaL_Reg rlua_shared_meta[] = {
+  {"__index", rlua_shared_index},
+  {"__newindex", rlua_shared_newindex},
+  {"__len", rlua_shared_len},
+  {"__pairs", rlua_shared_pairs},
+  {"__eq", rlua_shared_eq},
+  {"__tostring", rlua_shared_tostring},
+  {"__gc", rlua_shared_gc},
+  {NULL, NULL}
+};
+
+static void rlua_shared_register(lua_State* state)
+{
+  luaL_newmetatable(state, "rlua.shared");
+  luaL_setfuncs(state, rlua_shared_meta, 0);
+  lua_pop(state, 1);
+}
+
+static void rlua_shared_free(void* ptr)
+{
+  rlua_shared_release(ptr);
+}
+
+static size_t rlua_shared_memsize(const void* ptr)
+{
+  const rlua_Shared* shared = ptr;
+  return sizeof(rlua_Shared) + (shared->mapped ? 0 : shared->size);
+}
+
+static const rb_data_type_t rlua_shared_type = {
+  .wrap_struct_name = "rlua_shared",
+  .function = {
+    .dfree = rlua_shared_free,
+    .dsize = rlua_shared_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+};
+
+static int rlua_push_shared(lua_State* state, VALUE value)
+{
+  if(!rb_typeddata_is_kind_of(value, &rlua_shared_type))
+    return 0;
+
+  rlua_Shared* shared = DATA_PTR(value);
+  rlua_shared_push_view(state, shared, ((const rlua_SharedHeader*) shared->data)->root.as.offset);
+  return 1;
+}
+
+/*
+ * Images are built in Ruby Strings, so that nothing leaks if a value
+ * cannot be converted; the finished image is copied to malloc'd memory.
+ */
+static void rlua_shared_align(VALUE buffer)
+{
+  static const char zeros[8];
+  long size = RSTRING_LEN(buffer);
+  if(size % 8)
+    rb_str_cat(buffer, zeros, 8 - size % 8);
+}
+
+static rlua_SharedValue rlua_shared_build(VALUE image, VALUE value, int depth);
+
+struct rlua_shared_builder {
+  VALUE image, entries;
+  int depth;
+};
+
+static int rlua_shared_build_pair(VALUE key, VALUE value, VALUE data)
+{
+  struct rlua_shared_builder* builder = (struct rlua_shared_builder*) data;
+  rlua_SharedEntry entry;
+
+  rlua_check_key(key);
+  if(RB_FLOAT_TYPE_P(key) && RFLOAT_VALUE(key) == floor(RFLOAT_VALUE(key)) &&
+     fabs(RFLOAT_VALUE(key)) < 9.2e18)
+    key = LL2NUM((long long) RFLOAT_VALUE(key));
+
+  memset(&entry, 0, sizeof(entry));
+  entry.key = rlua_shared_build(builder->image, key, builder->depth);
+  if(entry.key.kind == RLUA_SHARED_TABLE)
+    rb_raise(rb_eArgError, "cannot use %"PRIsVALUE" as a shared table key", rb_inspect(key));
+  entry.value = rlua_shared_build(builder->image, value, builder->depth);
+
+  rb_str_cat(builder->entries, (const char*) &entry, sizeof(entry));
+  return ST_CONTINUE;
+}
+
+static uint64_t rlua_shared_build_table(VALUE image, VALUE value, int depth)
+{
+  rlua_SharedTable table = { 0, 0, 0, 0 };
+  VALUE entries = rb_str_buf_new(0), buckets = Qnil;
+  long i;
+
+  if(depth >= RLUA_PACKET_DEPTH)
+    rb_raise(rb_eArgError, "nesting of %d is too deep", depth + 1);
+
+  if(RB_TYPE_P(value, T_ARRAY)) {
+    for(i = 0; i < RARRAY_LEN(value); i++) {
+      rlua_SharedValue element = rlua_shared_build(image, RARRAY_AREF(value, i), depth + 1);
+      rb_str_cat(entries, (const char*) &element, sizeof(element));
+    }
+    table.narray = (uint32_t) (RSTRING_LEN(entries) / sizeof(rlua_SharedValue));
+  } else {
+    struct rlua_shared_builder builder = { image, entries, depth + 1 };
+    rb_hash_foreach(value, rlua_shared_build_pair, (VALUE) &builder);
+
+    rlua_SharedEntry* list = (rlua_SharedEntry*) RSTRING_PTR(entries);
+    table.nhash = (uint32_t) (RSTRING_LEN(entries) / sizeof(rlua_SharedEntry));
+    for(table.nbuckets = table.nhash ? 1 : 0; table.nbuckets < table.nhash; table.nbuckets *= 2);
+
+    buckets = rb_str_new(NULL, table.nbuckets * sizeof(uint32_t));
+    uint32_t* heads = (uint32_t*) RSTRING_PTR(buckets);
+    memset(heads, 0, RSTRING_LEN(buckets));
+
+    rlua_Shared built = { 0, RSTRING_PTR(image), RSTRING_LEN(image), 0 };
+
+    for(i = 0; i < table.nhash; i++) {
+      rlua_SharedKey key;
+      key.kind = list[i].key.kind;
+      key.integer = list[i].key.as.integer;
+      key.number = list[i].key.as.number;
+      key.string = RSTRING_PTR(image) + list[i].key.as.offset;
+      key.size = list[i].key.size;
+      rlua_shared_key_hash(&key);
+
+      uint32_t* head = &heads[key.hash & (table.nbuckets - 1)];
+      // e.g. "a" and :a, or 1 and 1.0
+      for(uint32_t other = *head; other; other = list[other - 1].next) {
+        if(list[other - 1].hash == key.hash && rlua_shared_key_equal(&built, &list[other - 1].key, &key))
+          rb_raise(rb_eArgError, "duplicate key in shared table");
+      }
+
+      list[i].hash = key.hash;
+      list[i].next = *head;
+      *head = (uint32_t) i + 1;
+    }
+  }
+
+  rlua_shared_align(image);
+  uint64_t offset = RSTRING_LEN(image);
+  rb_str_cat(image, (const char*) &table, sizeof(table));
+  rb_str_buf_append(image, entries);
+  if(buckets != Qnil)
+    rb_str_buf_append(image, buckets);
+  rlua_shared_align(image);
+
+  return offset;
+}
+
+static rlua_SharedValue rlua_shared_build(VALUE image, VALUE value, int depth)
+{
+  rlua_SharedValue result;
+  memset(&result, 0, sizeof(result));
+
+  switch(TYPE(value)) {
+    case T_NIL:
+      result.kind = RLUA_SHARED_NIL;
+      break;
+
+    case T_TRUE:
+    case T_FALSE:
+      result.kind = value == Qtrue ? RLUA_SHARED_TRUE : RLUA_SHARED_FALSE;
+      break;
+
+    case T_FIXNUM:
+      result.kind = RLUA_SHARED_INT;
+      result.as.integer = FIX2LONG(value);
+      break;
+
+    case T_BIGNUM:
+    case T_FLOAT:
+      result.kind = RLUA_SHARED_FLOAT;
+      result.as.number = NUM2DBL(value);
+      break;
+
+    case T_SYMBOL:
+      value = rb_sym2str(value);
+      /* fallthrough */
+
+    case T_STRING: {
+      VALUE string = rb_str_export_to_enc(value, rb_default_external_encoding());
+      if(RSTRING_LEN(string) > UINT32_MAX)
+        rb_raise(rb_eArgError, "string is too long for a shared table");
+
+      result.kind = RLUA_SHARED_STRING;
+      result.size = (uint32_t) RSTRING_LEN(string);
+      result.as.offset = RSTRING_LEN(image);
+      rb_str_buf_append(image, string);
+      rb_str_cat(image, "", 1);
+      rlua_shared_align(image);
+      break;
+    }
+
+    case T_ARRAY:
+    case T_HASH:
+      result.kind = RLUA_SHARED_TABLE;
+      result.as.offset = rlua_shared_build_table(image, value, depth);
+      break;
+
+    default:
+      rb_raise(rb_eTypeError, "cannot store %s in a shared table", rb_obj_classname(value));
+  }
+
+  return result;
+}
+
+static VALUE rlua_shared_wrap(VALUE klass, const char* data, size_t size, int mapped)
+{
+  rlua_Shared* shared = malloc(sizeof(rlua_Shared));
+  if(shared == NULL) {
+#ifdef HAVE_SYS_MMAN_H
+    if(mapped)
+      munmap((void*) data, size);
+    else
+#endif
+      free((void*) data);
+    rb_raise(rb_eNoMemError, "cannot allocate shared table");
+  }
+
+  shared->refs = 1;
+  shared->data = data;
+  shared->size = size;
+  shared->mapped = mapped;
+
+  return rb_obj_freeze(TypedData_Wrap_Struct(klass, &rlua_shared_type, shared));
+}
+
+/*
+ * call-seq: Lua::SharedTable.build(hash_or_array) -> shared_table
+ *
+ * Freezes a tree of Hashes and Arrays of nil, booleans, numbers, Strings
+ * and Symbols into an immutable image with precomputed hash indexes. The
+ * result can be assigned to variables of any Lua::State (on any thread or
+ * Ractor), which then reads it in place without copying. In Lua, a shared
+ * table is a userdata which supports indexing, # and pairs.
+ */
+static VALUE rbLuaSharedTable_build(VALUE self, VALUE value)
+{
+  if(!RB_TYPE_P(value, T_HASH) && !RB_TYPE_P(value, T_ARRAY))
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Hash or Array)", rb_obj_classname(value));
+
+  rlua_SharedHeader header;
+  memset(&header, 0, sizeof(header));
+
+  VALUE image = rb_str_buf_new(4096);
+  rb_str_cat(image, (const char*) &header, sizeof(header));
+
+  memcpy(header.magic, RLUA_SHARED_MAGIC, 4);
+  header.version = RLUA_SHARED_VERSION;
+  header.root = rlua_shared_build(image, value, 0);
+  header.size = RSTRING_LEN(image);
+  memcpy(RSTRING_PTR(image), &header, sizeof(header));
+
+  char* data = malloc(header.size);
+  if(data == NULL)
+    rb_raise(rb_eNoMemError, "cannot allocate shared table");
+  memcpy(data, RSTRING_PTR(image), header.size);
+  RB_GC_GUARD(image);
+
+  return rlua_shared_wrap(self, data, header.size, 0);
+}
+
+/*
+ * call-seq: Lua::SharedTable.load(path) -> shared_table
+ *
+ * Maps an image written by #save into memory. Pages are shared with every
+ * other process which maps the same file.
+ */
+static VALUE rbLuaSharedTable_load(VALUE self, VALUE path)
+{
+  FilePathValue(path);
+
+  int fd = open(StringValueCStr(path), O_RDONLY);
+  if(fd < 0)
+    rb_sys_fail_str(path);
+
+  // close() may clobber errno, so it is saved first.
+  struct stat st;
+  if(fstat(fd, &st) < 0) {
+    int error = errno;
+    close(fd);
+    rb_syserr_fail_str(error, path);
+  }
+
+  size_t size = st.st_size;
+  if(size < sizeof(rlua_SharedHeader)) {
+    close(fd);
+    rb_raise(rb_eArgError, "not a Lua shared table");
+  }
+
+#ifdef HAVE_SYS_MMAN_H
+  void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  int mapped = 1;
+  if(data == MAP_FAILED) {
+    int error = errno;
+    close(fd);
+    rb_syserr_fail_str(error, path);
+  }
+#else
+  void* data = malloc(size);
+  int mapped = 0;
+  ssize_t length = data ? read(fd, data, size) : -1;
+  if(length != (ssize_t) size) {
+    int error = data == NULL ? ENOMEM : length < 0 ? errno : EIO;
+    free(data);
+    close(fd);
+    rb_syserr_fail_str(error, path);
+  }
+#endif
+  close(fd);
+
+  VALUE shared = rlua_shared_wrap(self, data, size, mapped);
+
+  const rlua_SharedHeader* header = data;
+  if(memcmp(header->magic, RLUA_SHARED_MAGIC, 4) != 0 || header->version != RLUA_SHARED_VERSION ||
+     header->size != size || header->root.kind != RLUA_SHARED_TABLE ||
+     rlua_shared_table(DATA_PTR(shared), header->root.as.offset) == NULL)
+    rb_raise(rb_eArgError, "not a Lua shared table");
+
+  return shared;
+}
+
+/*
+ * call-seq: shared_table.save(path) -> true
+ *
+ * Writes the image to +path+, to be mapped later with
+ * Lua::SharedTable.load.
+ */
+static VALUE rbLuaSharedTable_save(VALUE self, VALUE path)
+{
+  rlua_Shared* shared = rb_check_typeddata(self, &rlua_shared_type);
+  FilePathValue(path);
+
+  FILE* file = fopen(StringValueCStr(path), "wb");
+  if(file == NULL)
+    rb_sys_fail_str(path);
+
+  int error = 0;
+  if(fwrite(shared->data, 1, shared->size, file) != shared->size)
+    error = errno ? errno : EIO;
+  if(fclose(file) != 0 && !error)
+    error = errno;
+  if(error)
+    rb_syserr_fail_str(error, path);
+
+  return Qtrue;
+}
+
+/*
+ * call-seq: shared_table.bytesize -> int
+ *
+ * Returns size of the image in bytes.
+ */
+static VALUE rbLuaSharedTable_bytesize(VALUE self)
+{
+  rlua_Shared* shared = rb_check_typeddata(self, &rlua_shared_type);
+  return SIZET2NUM(shared->size);
+}
+
+/*
+ * JSON is parsed straight into Lua tables and serialized straight from them,
+ * without building Ruby objects in between.
+ */
+struct rlua_json_parser {
+  const char *start, *p, *end;
+  int integers;                  // integral numbers become Lua integers
+  int depth, max_depth;
+};
+
+static void rlua_json_parse_value(lua_State* state, struct rlua_json_parser* parser);
+
+static int rlua_json_fail(lua_State* state, struct rlua_json_parser* parser, const char* what)
+{
+  if(parser->p >= parser->end)
+    return luaL_error(state, "unexpected end of JSON input, %s", what);
+  return luaL_error(state, "unexpected character '%c' at offset %d of JSON input, %s",
+                    *parser->p, (int) (parser->p - parser->start), what);
+}
+
+static void rlua_json_skip_space(struct rlua_json_parser* parser)
+{
+  while(parser->p < parser->end &&
+        (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n' || *parser->p == '\r'))
+    parser->p++;
+}
+
+static int rlua_json_hex(lua_State* state, struct rlua_json_parser* parser)
+{
+  int code = 0;
+
+  if(parser->end - parser->p < 4)
+    return rlua_json_fail(state, parser, "expected \\u escape");
+
+  for(int i = 0; i < 4; i++) {
+    char c = *parser->p++;
+    code <<= 4;
+    if(c >= '0' && c <= '9')      code |= c - '0';
+    else if(c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+    else if(c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+    else {
+      parser->p--;
+      return rlua_json_fail(state, parser, "expected hex digit");
+    }
+  }
+
+  return code;
+}
+
+static void rlua_json_parse_string(lua_State* state, struct rlua_json_parser* parser)
+{
+  const char* chunk = ++parser->p;
+
+  // fast path: no escapes
+  while(parser->p < parser->end && *parser->p != '"' && *parser->p != '\\' &&
+        (unsigned char) *parser->p >= 0x20)
+    parser->p++;
+  if(parser->p < parser->end && *parser->p == '"') {
+    lua_pushlstring(state, chunk, parser->p++ - chunk);
+    return;
+  }
+
+  luaL_Buffer buffer;
+  luaL_buffinit(state, &buffer);
+  luaL_addlstring(&buffer, chunk, parser->p - chunk);
+
+  while(1) {
+    if(parser->p >= parser->end || (unsigned char) *parser->p < 0x20)
+      rlua_json_fail(state, parser, "expected end of string");
+
+    char c = *parser->p++;
+    if(c == '"')
+      break;
+    if(c != '\\') {
+      luaL_addchar(&buffer, c);
+      continue;
+    }
+
+    if(parser->p >= parser->end)
+      rlua_json_fail(state, parser, "expected escape");
+
+    switch(c = *parser->p++) {
+      case '"': case '\\': case '/': luaL_addchar(&buffer, c); break;
+      case 'b': luaL_addchar(&buffer, '\b'); break;
+      case 'f': luaL_addchar(&buffer, '\f'); break;
+      case 'n': luaL_addchar(&buffer, '\n'); break;
+      case 'r': luaL_addchar(&buffer, '\r'); break;
+      case 't': luaL_addchar(&buffer, '\t'); break;
+      case 'u': {
+        unsigned long code = rlua_json_hex(state, parser);
+        if(code >= 0xD800 && code <= 0xDBFF && parser->end - parser->p >= 2 &&
+           parser->p[0] == '\\' && parser->p[1] == 'u') {
+          parser->p += 2;
+          unsigned long low = rlua_json_hex(state, parser);
+          if(low >= 0xDC00 && low <= 0xDFFF)
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          else
+            parser->p -= 6;   // unpaired; encode both separately
+        }
+
+        char utf8[4];
+        int size;
+        if(code < 0x80) {
+          utf8[0] = code; size = 1;
+        } else if(code < 0x800) {
+          utf8[0] = 0xC0 | (code >> 6); utf8[1] = 0x80 | (code & 0x3F); size = 2;
+        } else if(code < 0x10000) {
+          utf8[0] = 0xE0 | (code >> 12); utf8[1] = 0x80 | ((code >> 6) & 0x3F);
+          utf8[2] = 0x80 | (code & 0x3F); size = 3;
+        } else {
+          utf8[0] = 0xF0 | (code >> 18); utf8[1] = 0x80 | ((code >> 12) & 0x3F);
+          utf8[2] = 0x80 | ((code >> 6) & 0x3F); utf8[3] = 0x80 | (code & 0x3F); size = 4;
+        }
+        luaL_addlstring(&buffer, utf8, size);
+        break;
+      }
+      default:
+        parser->p--;
+        rlua_json_fail(state, parser, "expected escape");
+    }
+  }
+
+  luaL_pushresult(&buffer);
+}
+
+static void rlua_json_parse_number(lua_State* state, struct rlua_json_parser* parser)
+{
+  const char *start = parser->p, *p = parser->p;
+  int integral = 1;
+
+  if(p < parser->end && *p == '-')
+    p++;
+  if(p >= parser->end || !isdigit((unsigned char) *p))
+    rlua_json_fail(state, parser, "expected value");
+  if(*p == '0')
+    p++;
+  else
+    while(p < parser->end && isdigit((unsigned char) *p)) p++;
+
+  if(p < parser->end && *p == '.') {
+    integral = 0;
+    if(++p >= parser->end || !isdigit((unsigned char) *p)) {
+      parser->p = p;
+      rlua_json_fail(state, parser, "expected digit");
+    }
+    while(p < parser->end && isdigit((unsigned char) *p)) p++;
+  }
+  if(p < parser->end && (*p == 'e' || *p == 'E')) {
+    integral = 0;
+    if(++p < parser->end && (*p == '+' || *p == '-'))
+      p++;
+    if(p >= parser->end || !isdigit((unsigned char) *p)) {
+      parser->p = p;
+      rlua_json_fail(state, parser, "expected digit");
+    }
+    while(p < parser->end && isdigit((unsigned char) *p)) p++;
+  }
+  parser->p = p;
+
+  // The input is not necessarily NUL-terminated (shared substrings are not),
+  // so strto* get a copy of the validated span in a Lua string, which is.
+  lua_pushlstring(state, start, p - start);
+  const char* text = lua_tostring(state, -1);
+  lua_Number number;
+  if(integral && parser->integers) {
+    errno = 0;
+    long long value = strtoll(text, NULL, 10);
+    if(errno != ERANGE) {
+      lua_pop(state, 1);
+      lua_pushinteger(state, value);
+      return;
+    }
+  }
+  number = strtod(text, NULL);
+  lua_pop(state, 1);
+  lua_pushnumber(state, number);
+}
+
+static void rlua_json_parse_literal(lua_State* state, struct rlua_json_parser* parser, const char* literal)
+{
+  size_t size = strlen(literal);
+  if((size_t) (parser->end - parser->p) < size || memcmp(parser->p, literal, size) != 0)
+    rlua_json_fail(state, parser, "expected value");
+  parser->p += size;
+}
+
+static void rlua_json_parse_value(lua_State* state, struct rlua_json_parser* parser)
+{
+  rlua_json_skip_space(parser);
+  if(parser->p >= parser->end)
+    rlua_json_fail(state, parser, "expected value");
+
+  switch(*parser->p) {
+    case '{':
+    case '[': {
+      int object = *parser->p++ == '{';
+      lua_Integer length = 0;
+
+      if(++parser->depth > parser->max_depth)
+        luaL_error(state, "nesting of %d is too deep", parser->depth);
+      luaL_checkstack(state, 3, "JSON nesting is too deep");
+
+      lua_newtable(state);
+      rlua_json_skip_space(parser);
+      if(parser->p < parser->end && *parser->p == (object ? '}' : ']')) {
+        parser->p++;
+      } else while(1) {
+        if(object) {
+          rlua_json_skip_space(parser);
+          if(parser->p >= parser->end || *parser->p != '"')
+            rlua_json_fail(state, parser, "expected object key");
+          rlua_json_parse_string(state, parser);
+          rlua_json_skip_space(parser);
+          if(parser->p >= parser->end || *parser->p++ != ':') {
+            parser->p--;
+            rlua_json_fail(state, parser, "expected ':'");
+          }
+          rlua_json_parse_value(state, parser);
+          lua_rawset(state, -3);
+        } else {
+          rlua_json_parse_value(state, parser);
+          lua_rawseti(state, -2, ++length);
+        }
+
+        rlua_json_skip_space(parser);
+        if(parser->p < parser->end && *parser->p == ',') {
+          parser->p++;
+        } else if(parser->p < parser->end && *parser->p == (object ? '}' : ']')) {
+          parser->p++;
+          break;
+        } else {
+          rlua_json_fail(state, parser, object ? "expected ',' or '}'" : "expected ',' or ']'");
+        }
+      }
+
+      parser->depth--;
+      break;
+    }
+
+    case '"':
+      rlua_json_parse_string(state, parser);
+      break;
+
+    case 't':
+      rlua_json_parse_literal(state, parser, "true");
+      lua_pushboolean(state, 1);
+      break;
+
+    case 'f':
+      rlua_json_parse_literal(state, parser, "false");
+      lua_pushboolean(state, 0);
+      break;
+
+    case 'n':
+      rlua_json_parse_literal(state, parser, "null");
+      lua_pushnil(state);
+      break;
+
+    default:
+      rlua_json_parse_number(state, parser);
+  }
+}
+
+static int rlua_json_decode(lua_State* state)
+{
+  struct rlua_json_parser* parser = lua_touserdata(state, 1);
+
+  lua_settop(state, 0);
+  rlua_json_parse_value(state, parser);
+  rlua_json_skip_space(parser);
+  if(parser->p < parser->end)
+    rlua_json_fail(state, parser, "expected end of input");
+
+  return 1;
+}
+
+// Parses JSON in +json+ and pushes the result, or raises ArgumentError.
+static void rlua_json_push(lua_State* state, VALUE json, VALUE options)
+{
+  StringValue(json);
+
+  struct rlua_json_parser parser;
+  parser.start = parser.p = RSTRING_PTR(json);
+  parser.end = parser.p + RSTRING_LEN(json);
+  parser.integers = options == Qnil || rb_hash_lookup2(options, ID2SYM(rb_intern("integers")), Qtrue) != Qfalse;
+  parser.depth = 0;
+  parser.max_depth = RLUA_STATE(state)->max_depth;
+
+  lua_pushcfunction(state, rlua_json_decode);
+  lua_pushlightuserdata(state, &parser);
+  int retval = lua_pcall(state, 1, 1, 0);
+  RB_GC_GUARD(json);
+
+  if(retval != LUA_OK) {
+    VALUE error = rlua_error_message(state);
+    lua_pop(state, 1);
+    rb_exc_raise(rb_exc_new3(retval == LUA_ERRMEM ? rb_eNoMemError : rb_eArgError, error));
+  }
+}
+
+struct rlua_json_writer {
+  rlua_Packet buffer;
+  int empty_array;               // empty tables become [] rather than {}
+  int integral_floats;           // floats like 2.0 are written as 2
+  int depth, max_depth;
+};
+
+static int rlua_json_write(struct rlua_json_writer* writer, const char* data, size_t size)
+{
+  return rlua_packet_write(&writer->buffer, data, size);
+}
+
+static const char* rlua_json_write_string(struct rlua_json_writer* writer, lua_State* state, int index)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t size;
+  const char* string = lua_tolstring(state, index, &size);
+  const char* chunk = string;
+
+  if(!rlua_json_write(writer, "\"", 1))
+    return "not enough memory";
+
+  for(size_t i = 0; i < size; i++) {
+    unsigned char c = string[i];
+    if(c >= 0x20 && c != '"' && c != '\\')
+      continue;
+
+    char escape[6] = { '\\', c, 0, 0, 0, 0 };
+    size_t length = 2;
+    switch(c) {
+      case '"': case '\\': break;
+      case '\b': escape[1] = 'b'; break;
+      case '\f': escape[1] = 'f'; break;
+      case '\n': escape[1] = 'n'; break;
+      case '\r': escape[1] = 'r'; break;
+      case '\t': escape[1] = 't'; break;
+      default:
+        escape[1] = 'u'; escape[2] = '0'; escape[3] = '0';
+        escape[4] = hex[c >> 4]; escape[5] = hex[c & 15];
+        length = 6;
+    }
+
+    if(!rlua_json_write(writer, chunk, string + i - chunk) || !rlua_json_write(writer, escape, length))
+      return "not enough memory";
+    chunk = string + i + 1;
+  }
+
+  if(!rlua_json_write(writer, chunk, string + size - chunk) || !rlua_json_write(writer, "\"", 1))
+    return "not enough memory";
+
+  return NULL;
+}
+
+static const char* rlua_json_write_value(struct rlua_json_writer* writer, lua_State* state, int index)
+{
+  char number[32];
+
+  switch(lua_type(state, index)) {
+    case LUA_TNIL:
+      return rlua_json_write(writer, "null", 4) ? NULL : "not enough memory";
+
+    case LUA_TBOOLEAN:
+      return (lua_toboolean(state, index) ? rlua_json_write(writer, "true", 4) :
+                                            rlua_json_write(writer, "false", 5)) ? NULL : "not enough memory";
+
+    case LUA_TNUMBER:
+      if(lua_isinteger(state, index)) {
+        snprintf(number, sizeof(number), "%lld", (long long) lua_tointeger(state, index));
+      } else {
+        double value = lua_tonumber(state, index);
+        if(isnan(value) || isinf(value))
+          return "cannot serialize NaN or infinity";
+
+        // shortest representation which reads back to the same number
+        snprintf(number, sizeof(number), "%.15g", value);
+        if(strtod(number, NULL) != value)
+          snprintf(number, sizeof(number), "%.17g", value);
+        if(!writer->integral_floats && strspn(number, "-0123456789") == strlen(number))
+          strcat(number, ".0");
+      }
+      return rlua_json_write(writer, number, strlen(number)) ? NULL : "not enough memory";
+
+    case LUA_TSTRING:
+      return rlua_json_write_string(writer, state, index);
+
+    case LUA_TTABLE:
+      break;
+
+    default:
+      return "cannot serialize a value which is not nil, boolean, number, string or table";
+  }
+
+  if(writer->depth >= writer->max_depth)
+    return "nesting is too deep (or the table is recursive)";
+  if(!lua_checkstack(state, 3))
+    return "not enough memory";
+
+  index = lua_absindex(state, index);
+  if(rlua_tracked(state, index)) {
+    rlua_track_field(state, index, "__index");
+    const char* error = rlua_json_write_value(writer, state, -1);
+    lua_pop(state, 1);
+    return error;
+  }
+
+  lua_Integer length = lua_rawlen(state, index), count = 0;
+  int array = 1;
+
+  lua_pushnil(state);
+  while(lua_next(state, index)) {
+    lua_pop(state, 1);
+    count++;
+    if(array && (!lua_isinteger(state, -1) || lua_tointeger(state, -1) < 1 || lua_tointeger(state, -1) > length))
+      array = 0;
+  }
+  if(count == 0)
+    array = writer->empty_array;
+
+  const char* error = NULL;
+  writer->depth++;
+
+  if(array) {
+    if(!rlua_json_write(writer, "[", 1))
+      return "not enough memory";
+    for(lua_Integer i = 1; i <= length && !error; i++) {
+      if(i > 1 && !rlua_json_write(writer, ",", 1))
+        return "not enough memory";
+      lua_rawgeti(state, index, i);
+      error = rlua_json_write_value(writer, state, -1);
+      lua_pop(state, 1);
+    }
+    if(!error && !rlua_json_write(writer, "]", 1))
+      return "not enough memory";
+  } else {
+    if(!rlua_json_write(writer, "{", 1))
+      return "not enough memory";
+    count = 0;
+    lua_pushnil(state);                                           // stack: |key |...
+    while(!error && lua_next(state, index)) {                     //        |valu|key |...
+      if(count++ && !rlua_json_write(writer, ",", 1))
+        error = "not enough memory";
+      else if(lua_type(state, -2) == LUA_TSTRING)
+        error = rlua_json_write_string(writer, state, -2);
+      else if(lua_type(state, -2) == LUA_TNUMBER) {
+        lua_pushvalue(state, -2);                                 //        |kcpy|valu|key |...
+        lua_tostring(state, -1);   // converts the copy, not the key used by lua_next
+        error = rlua_json_write_string(writer, state, -1);
+        lua_pop(state, 1);                                        //        |valu|key |...
+      } else
+        error = "cannot serialize a table key which is not a string or number";
+
+      if(!error && !rlua_json_write(writer, ":", 1))
+        error = "not enough memory";
+      if(!error)
+        error = rlua_json_write_value(writer, state, -1);
+      lua_pop(state, 1);                                          //        |key |...
+    }
+    if(error)
+      lua_pop(state, 1);                                          //        ...
+    else if(!rlua_json_write(writer, "}", 1))
+      return "not enough memory";
+  }
+
+  writer->depth--;
+  return error;
+}
+
+/*
+ * call-seq: state.push_json(json, integers: true) -> value
+ *
+ * Parses +json+ directly into Lua values and returns the result, which
+ * is a Lua::Table for objects and arrays. JSON null becomes nil. With
+ * <tt>integers: false</tt>, all numbers are parsed as floats; otherwise
+ * numbers without fraction or exponent become Lua integers. Raises
+ * ArgumentError on malformed input.
+ */
+static VALUE rbLua_push_json(int argc, VALUE* argv, VALUE self)
+{
+  VALUE json, options;
+  rb_scan_args(argc, argv, "1:", &json, &options);
+
+  lua_State* state = rlua_get_state(self);
+  rlua_json_push(state, json, options);            // stack: |valu|...
+
+  VALUE value = rlua_get_var(state);
+  lua_pop(state, 1);                               //        ...
+
+  return value;
+}
+
+/*
+ * call-seq: Lua::Table.from_json(state, json, integers: true) -> table
+ *
+ * Parses JSON object or array +json+ directly into a Lua table. See
+ * Lua::State#push_json.
+ */
+static VALUE rbLuaTable_from_json(int argc, VALUE* argv, VALUE self)
+{
+  VALUE rbLuaState, json, options;
+  rb_scan_args(argc, argv, "2:", &rbLuaState, &json, &options);
+
+  lua_State* state = rlua_get_state(rbLuaState);
+  rlua_json_push(state, json, options);            // stack: |valu|...
+
+  if(lua_type(state, -1) != LUA_TTABLE) {
+    lua_pop(state, 1);
+    rb_raise(rb_eArgError, "JSON input is not an object or array");
+  }
+
+  return rlua_wrap_ref(cLuaTable, state);
+}
+
+/*
+ * call-seq: table.to_json(empty: :object, integral_floats: :decimal) -> string
+ *
+ * Serializes the table straight from Lua. Tables whose keys are exactly
+ * 1..#table become arrays, other tables become objects with string keys
+ * (number keys are converted). Empty tables become objects unless
+ * <tt>empty: :array</tt> is given. Floats which have an integral value are
+ * written as <tt>2.0</tt>, or as <tt>2</tt> with
+ * <tt>integral_floats: :integer</tt>. Metatables are ignored.
+ *
+ * Raises ArgumentError if the table contains values which cannot be
+ * serialized, or is recursive.
+ */
+static VALUE rbLuaTable_to_json(int argc, VALUE* argv, VALUE self)
+{
+  VALUE generator, options;
+  rb_scan_args(argc, argv, "01:", &generator, &options);   // JSON.generate passes its state
+
+  lua_State* state = rlua_get_state(self);
+  struct rlua_json_writer writer;
+  memset(&writer, 0, sizeof(writer));
+  writer.max_depth = RLUA_STATE(state)->max_depth;
+  if(options != Qnil) {
+    writer.empty_array = rb_hash_aref(options, ID2SYM(rb_intern("empty"))) == ID2SYM(rb_intern("array"));
+    writer.integral_floats = rb_hash_aref(options, ID2SYM(rb_intern("integral_floats"))) == ID2SYM(rb_intern("integer"));
+  }
+
+  rlua_push_var(state, self);                      // stack: |this|...
+  const char* error = rlua_json_write_value(&writer, state, -1);
+  lua_pop(state, 1);                               //        ...
+
+  if(error) {
+    rlua_packet_free(&writer.buffer);
+    rb_raise(rb_eArgError, "%s", error);
+  }
+
+  VALUE json = rb_utf8_str_new(writer.buffer.data, writer.buffer.size);
+  rlua_packet_free(&writer.buffer);
+
+  return json;
+}
+
+/*
+ * Lua::Buffer is an output sink for Lua code: it appends to a C buffer, or
+ * to a target Ruby String, without calling into Ruby per write.
+ */
+typedef struct {
+  rlua_Anchor anchor;            // target String, or Qnil
+  rlua_Packet data;              // used if there is no target
+} rlua_Buffer;
+
+// Target is changed under rb_protect: it may have been frozen meanwhile.
+struct rlua_buffer_target {
+  VALUE target;
+  const char* data;        // NULL to clear the target
+  size_t size;
+};
+
+static VALUE rlua_buffer_update_target(VALUE data)
+{
+  struct rlua_buffer_target* update = (struct rlua_buffer_target*) data;
+
+  if(update->data) {
+    rb_str_cat(update->target, update->data, update->size);
+  } else {
+    rb_str_modify(update->target);
+    rb_str_set_len(update->target, 0);
+  }
+
+  return Qnil;
+}
+
+static void rlua_buffer_target(lua_State* state, rlua_Buffer* buffer, const char* data, size_t size)
+{
+  struct rlua_buffer_target update = { buffer->anchor.value, data, size };
+  int error;
+
+  rb_protect(rlua_buffer_update_target, (VALUE) &update, &error);
+  if(error) {
+    rb_set_errinfo(Qnil);
+    luaL_error(state, "cannot modify target String");
+  }
+}
+
+static void rlua_buffer_add(lua_State* state, rlua_Buffer* buffer, const char* data, size_t size)
+{
+  if(buffer->anchor.value != Qnil)
+    rlua_buffer_target(state, buffer, data, size);
+  else if(!rlua_packet_write(&buffer->data, data, size))
+    luaL_error(state, "not enough memory");
+}
+
+static int rlua_buffer_write(lua_State* state)
+{
+  rlua_Buffer* buffer = luaL_checkudata(state, 1, "rlua.buffer");
+  int top = lua_gettop(state);
+
+  for(int i = 2; i <= top; i++) {
+    size_t size;
+    const char* data;
+
+    if(lua_type(state, i) == LUA_TSTRING || lua_type(state, i) == LUA_TNUMBER) {
+      data = lua_tolstring(state, i, &size);
+      rlua_buffer_add(state, buffer, data, size);
+    } else {
+      data = luaL_tolstring(state, i, &size);
+      rlua_buffer_add(state, buffer, data, size);
+      lua_pop(state, 1);
+    }
+  }
+
+  lua_settop(state, 1);
+  return 1;
+}
+
+static int rlua_buffer_writef(lua_State* state)
+{
+  rlua_Buffer* buffer = luaL_checkudata(state, 1, "rlua.buffer");
+  luaL_checkstring(state, 2);
+
+  int top = lua_gettop(state);
+  luaL_checkstack(state, top + 2, "too many arguments");
+
+  lua_getfield(state, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  if(lua_getfield(state, -1, LUA_STRLIBNAME) != LUA_TTABLE ||
+     lua_getfield(state, -1, "format") != LUA_TFUNCTION)
+    return luaL_error(state, "writef requires the string library");
+
+  for(int i = 2; i <= top; i++)
+    lua_pushvalue(state, i);
+  lua_call(state, top - 1, 1);
+
+  size_t size;
+  const char* data = lua_tolstring(state, -1, &size);
+  rlua_buffer_add(state, buffer, data, size);
+
+  lua_settop(state, 1);
+  return 1;
+}
+
+static int rlua_buffer_clear(lua_State* state)
+{
+  rlua_Buffer* buffer = luaL_checkudata(state, 1, "rlua.buffer");
+
+  if(buffer->anchor.value == Qnil)
+    buffer->data.size = 0;
+  else
+    rlua_buffer_target(state, buffer, NULL, 0);
+
+  lua_settop(state, 1);
+  return 1;
+}
+
+static int rlua_buffer_len(lua_State* state)
+{
+  rlua_Buffer* buffer = luaL_checkudata(state, 1, "rlua.buffer");
+
+  lua_pushinteger(state, buffer->anchor.value == Qnil ? (lua_Integer) buffer->data.size :
+                                                        (lua_Integer) RSTRING_LEN(buffer->anchor.value));
+  return 1;
+}
+
+static int rlua_buffer_tostring(lua_State* state)
+{
+  rlua_Buffer* buffer = luaL_checkudata(state, 1, "rlua.buffer");
+
+  if(buffer->anchor.value == Qnil)
+    lua_pushlstring(state, buffer->data.data ? buffer->data.data : "", buffer->data.size);
+  else
+    lua_pushlstring(state, RSTRING_PTR(buffer->anchor.value), RSTRING_LEN(buffer->anchor.value));
+  return 1;
+}
+
+static int rlua_buffer_gc(lua_State* state)
+{
+  rlua_Buffer* buffer = lua_touserdata(state, 1);
+
+  if(buffer->anchor.value != Qnil)
+    rlua_anchor_unlink(&buffer->anchor);
+  rlua_packet_free(&buffer->data);
+
+  return 0;
+}
+
+static const luaL_Reg rlua_buffer_methods[] = {
+  {"write", rlua_buffer_write},
+  {"writef", rlua_buffer_writef},
+  {"clear", rlua_buffer_clear},
+  {NULL, NULL}
+};
+
+static void rlua_buffer_register(lua_State* state)
+{
+  luaL_newmetatable(state, "rlua.buffer");
+  lua_pushcfunction(state, rlua_buffer_len);
+  lua_setfield(state, -2, "__len");
+  lua_pushcfunction(state, rlua_buffer_tostring);
+  lua_setfield(state, -2, "__tostring");
+  lua_pushcfunction(state, rlua_buffer_gc);
+  lua_setfield(state, -2, "__gc");
+  luaL_newlib(state, rlua_buffer_methods);
+  lua_setfield(state, -2, "__index");
+  lua_pop(state, 1);
+}
+
+static rlua_Buffer* rlua_get_buffer(VALUE self)
+{
+  lua_State* state = rlua_get_state(self);
+
+  rlua_push_ref(state, RLUA_STATE(state), self);
+  rlua_Buffer* buffer = lua_touserdata(state, -1);   // kept alive by the reference
+  lua_pop(state, 1);
+
+  return buffer;
+}
+
+/*
+ * call-seq: Lua::Buffer.new(state[, target]) -> buffer
+ *
+ * Creates an output buffer which Lua code in +state+ can append to:
+ *
+ *   out = Lua::Buffer.new(state)
+ *   state.out = out
+ *   state.__eval 'for i = 1, 3 do out:write("<li>", i, "</li>") end'
+ *   out.to_s # => "<li>1</li><li>2</li><li>3</li>"
+ *
+ * Lua methods are <tt>write(...)</tt>, which appends its arguments
+ * converted like +tostring+ does, <tt>writef(format, ...)</tt>, which
+ * appends <tt>string.format(format, ...)</tt>, and <tt>clear()</tt>. All of
+ * them return the buffer; <tt>#buffer</tt> is its size in bytes.
+ *
+ * Output is collected in C memory and copied into a String once, by #to_s.
+ * If a +target+ String is given, it is appended to directly instead.
+ */
+static VALUE rbLuaBuffer_initialize(int argc, VALUE* argv, VALUE self)
+{
+  VALUE rbLuaState, target;
+  rb_scan_args(argc, argv, "11", &rbLuaState, &target);
+
+  if(!rb_typeddata_is_kind_of(rbLuaState, &rlua_state_type))
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Lua::State)", rb_obj_classname(rbLuaState));
+  if(target != Qnil) {
+    StringValue(target);
+    rb_str_modify(target);
+  }
+
+  rlua_Ref* ref = rlua_get_ref(self);
+  lua_State* state = rlua_get_state(rbLuaState);
+
+  rlua_Buffer* buffer = lua_newuserdatauv(state, sizeof(rlua_Buffer), 0);
+  memset(buffer, 0, sizeof(rlua_Buffer));
+  buffer->anchor.value = target;
+  if(target != Qnil)
+    rlua_anchor_link(RLUA_STATE(state), &buffer->anchor);
+  luaL_setmetatable(state, "rlua.buffer");
+
+  rlua_ref_attach(ref, RLUA_STATE(state), rlua_makeref(state));
+  lua_pop(state, 1);
+
+  return self;
+}
+
+/*
+ * call-seq: buffer.to_s -> string
+ *
+ * Returns the output: a new String, or the target String.
+ */
+static VALUE rbLuaBuffer_to_s(VALUE self)
+{
+  rlua_Buffer* buffer = rlua_get_buffer(self);
+
+  if(buffer->anchor.value != Qnil)
+    return buffer->anchor.value;
+  return rb_enc_str_new(buffer->data.data, buffer->data.size, rb_default_external_encoding());
+}
+
+/*
+ * call-seq: buffer.size -> int
+ *
+ * Returns size of the output in bytes.
+ */
+static VALUE rbLuaBuffer_size(VALUE self)
+{
+  rlua_Buffer* buffer = rlua_get_buffer(self);
+
+  if(buffer->anchor.value != Qnil)
+    return LONG2NUM(RSTRING_LEN(buffer->anchor.value));
+  return SIZET2NUM(buffer->data.size);
+}
+
+/*
+ * call-seq: buffer.clear -> buffer
+ *
+ * Discards the output, keeping allocated memory for reuse.
+ */
+static VALUE rbLuaBuffer_clear(VALUE self)
+{
+  rlua_Buffer* buffer = rlua_get_buffer(self);
+
+  if(buffer->anchor.value != Qnil) {
+    rb_str_modify(buffer->anchor.value);
+    rb_str_set_len(buffer->anchor.value, 0);
+  } else {
+    buffer->data.size = 0;
+  }
+
+  return self;
+}
+
+/*
+ * Lua::Channel is a bounded queue of packets shared by any number of Lua
+ * states and Ruby threads. Values are serialized by the sender and
+ * deserialized by the receiver; nothing else is copied, and no Ruby objects
+ * are created when both ends are Lua code.
+ */
+typedef struct rlua_ChannelItem {
+  rlua_Packet packet;
+  struct rlua_ChannelItem* next;
+} rlua_ChannelItem;
+
+typedef struct {
+  rb_atomic_t refs;              // Lua::Channel object plus every Lua userdata
+  rb_nativethread_lock_t lock;
+  rb_nativethread_cond_t readable, writable;
+  rlua_ChannelItem *head, *tail;
+  long count, capacity;
+  int closed;
+} rlua_Channel;
+
+enum rlua_channel_status {
+  RLUA_CHANNEL_OK, RLUA_CHANNEL_BUSY, RLUA_CHANNEL_CLOSED, RLUA_CHANNEL_INTERRUPTED
+};
+
+// One send (if +item+ is set) or receive, possibly waiting without the GVL.
+struct rlua_channel_op {
+  rlua_Channel* channel;
+  rlua_ChannelItem* item;
+  int sending, block, interrupted;
+  enum rlua_channel_status status;
+};
+
+static void rlua_channel_item_free(rlua_ChannelItem* item)
+{
+  rlua_packet_free(&item->packet);
+  free(item);
+}
+
+static void rlua_channel_release(rlua_Channel* channel)
+{
+  if(RUBY_ATOMIC_FETCH_SUB(channel->refs, 1) != 1)
+    return;
+
+  rlua_ChannelItem* item;
+  while((item = channel->head) != NULL) {
+    channel->head = item->next;
+    rlua_channel_item_free(item);
+  }
+
+  rb_native_cond_destroy(&channel->readable);
+  rb_native_cond_destroy(&channel->writable);
+  rb_native_mutex_destroy(&channel->lock);
+  free(channel);
+}
+
+static void* rlua_channel_transfer(void* data)
+{
+  struct rlua_channel_op* op = data;
+  rlua_Channel* channel = op->channel;
+
+  rb_native_mutex_lock(&channel->lock);
+  for(;;) {
+    if(op->sending) {
+      if(channel->closed) {
+        op->status = RLUA_CHANNEL_CLOSED;
+        break;
+      } else if(channel->count < channel->capacity) {
+        op->item->next = NULL;
+        if(channel->tail)
+          channel->tail->next = op->item;
+        else
+          channel->head = op->item;
+        channel->tail = op->item;
+        channel->count++;
+        op->item = NULL;
+
+        rb_native_cond_signal(&channel->readable);
+        op->status = RLUA_CHANNEL_OK;
+        break;
+      }
+    } else {
+      if(channel->count > 0) {
+        op->item = channel->head;
+        channel->head = op->item->next;
+        if(channel->head == NULL)
+          channel->tail = NULL;
+        channel->count--;
+
+        rb_native_cond_signal(&channel->writable);
+        op->status = RLUA_CHANNEL_OK;
+        break;
+      } else if(channel->closed) {
+        op->status = RLUA_CHANNEL_CLOSED;
+        break;
+      }
+    }
+
+    if(!op->block) {
+      op->status = RLUA_CHANNEL_BUSY;
+      break;
+    } else if(op->interrupted) {
+      op->status = RLUA_CHANNEL_INTERRUPTED;
+      break;
+    }
+
+    rb_native_cond_wait(op->sending ? &channel->writable : &channel->readable, &channel->lock);
+  }
+  op->interrupted = 0;
+  rb_native_mutex_unlock(&channel->lock);
+
+  return NULL;
+}
+
+static void rlua_channel_interrupt(void* data)
+{
+  struct rlua_channel_op* op = data;
+  rlua_Channel* channel = op->channel;
+
+  rb_native_mutex_lock(&channel->lock);
+  op->interrupted = 1;
+  rb_native_cond_broadcast(&channel->readable);
+  rb_native_cond_broadcast(&channel->writable);
+  rb_native_mutex_unlock(&channel->lock);
+}
+
+/*
+ * Blocking operations wait without the GVL. rb_thread_call_without_gvl2
+ * returns on pending interrupts instead of raising them, as a raise would
+ * unwind through Lua frames (or drop a received item); callers handle
+ * RLUA_CHANNEL_INTERRUPTED by checking interrupts themselves. The status
+ * is preset for the case where the wait does not even start.
+ */
+static void rlua_channel_run(struct rlua_channel_op* op)
+{
+  if(op->block) {
+    op->status = RLUA_CHANNEL_INTERRUPTED;
+    rb_thread_call_without_gvl2(rlua_channel_transfer, op, rlua_channel_interrupt, op);
+  } else {
+    rlua_channel_transfer(op);
+  }
+}
+
+/*
+ * Lets Ruby handle the interrupt which woke a Lua channel operation. Returns
+ * nonzero if it raised: the Lua call must then be unwound, and the exception
+ * is re-raised by rlua_check_pending, like for rlua_interrupt_hook.
+ */
+static int rlua_channel_interrupted(lua_State* state)
+{
+  rlua_State* rstate = RLUA_STATE(state);
+
+  if(!rstate->pending_tag) {
+    rb_protect(rlua_check_ints, Qnil, &rstate->pending_tag);
+    if(!rstate->pending_tag)
+      return 0;
+    rstate->pending = rb_errinfo();
+  }
+
+  return 1;
+}
+
+static void rlua_channel_lua_run(lua_State* state, struct rlua_channel_op* op)
+{
+  rlua_State* rstate = RLUA_STATE(state);
+
+  if(op->block && rstate->pending_tag) {
+    op->status = RLUA_CHANNEL_INTERRUPTED;
+    return;
+  }
+
+  // While the GVL is released, other threads must stay out of the state;
+  // see rlua_get_rstate.
+  VALUE waiter = rstate->waiter;
+  if(op->block)
+    rstate->waiter = rb_thread_current();
+
+  do
+    rlua_channel_run(op);
+  while(op->status == RLUA_CHANNEL_INTERRUPTED && !rlua_channel_interrupted(state));
+
+  rstate->waiter = waiter;
+}
+
+static rlua_Channel* rlua_check_channel(lua_State* state)
+{
+  return *(rlua_Channel**) luaL_checkudata(state, 1, "rlua.channel");
+}
+
+static int rlua_channel_lua_send(lua_State* state, int block)
+{
+  rlua_Channel* channel = rlua_check_channel(state);
+  luaL_checkany(state, 2);
+
+  rlua_ChannelItem* item = calloc(1, sizeof(rlua_ChannelItem));
+  if(item == NULL)
+    return luaL_error(state, "not enough memory");
+
+  const char* error = rlua_packet_from_lua(&item->packet, state, 2, 0);
+  if(error) {
+    rlua_channel_item_free(item);
+    return luaL_error(state, "cannot send value: %s", error);
+  }
+
+  struct rlua_channel_op op = { channel, item, 1, block, 0, RLUA_CHANNEL_OK };
+  rlua_channel_lua_run(state, &op);
+  if(op.item)
+    rlua_channel_item_free(op.item);
+
+  switch(op.status) {
+    case RLUA_CHANNEL_CLOSED:
+      return luaL_error(state, "channel is closed");
+    case RLUA_CHANNEL_INTERRUPTED:
+      return luaL_error(state, "interrupted by Ruby");
+    default:
+      lua_pushboolean(state, op.status == RLUA_CHANNEL_OK);
+      return 1;
+  }
+}
+
+static int rlua_channel_decode(lua_State* state)
+{
+  rlua_ChannelItem* item = lua_touserdata(state, 1);
+  const char* cursor = item->packet.data;
+
+  rlua_packet_to_lua(state, &cursor, cursor + item->packet.size);
+  return 1;
+}
+
+static int rlua_channel_lua_recv(lua_State* state, int block)
+{
+  rlua_Channel* channel = rlua_check_channel(state);
+  luaL_checkstack(state, 3, NULL);
+
+  struct rlua_channel_op op = { channel, NULL, 0, block, 0, RLUA_CHANNEL_OK };
+  rlua_channel_lua_run(state, &op);
+
+  if(op.status == RLUA_CHANNEL_INTERRUPTED)
+    return luaL_error(state, "interrupted by Ruby");
+
+  if(op.status != RLUA_CHANNEL_OK) {
+    lua_pushnil(state);
+    lua_pushboolean(state, 0);
+    return 2;
+  }
+
+  // Decoded in protected mode, so that the item is freed even on errors.
+  lua_pushcfunction(state, rlua_channel_decode);
+  lua_pushlightuserdata(state, op.item);
+  int status = lua_pcall(state, 1, 1, 0);
+  rlua_channel_item_free(op.item);
+  if(status != LUA_OK)
+    return lua_error(state);
+
+  lua_pushboolean(state, 1);
+  return 2;
+}
+
+static int rlua_channel_send(lua_State* state)
+{
+  return rlua_channel_lua_send(state, 1);
+}
+
+static int rlua_channel_try_send(lua_State* state)
+{
+  return rlua_channel_lua_send(state, 0);
+}
+
+static int rlua_channel_recv(lua_State* state)
+{
+  return rlua_channel_lua_recv(state, 1);
+}
+
+static int rlua_channel_try_recv(lua_State* state)
+{
+  return rlua_channel_lua_recv(state, 0);
+}
+
+static void rlua_channel_close(rlua_Channel* channel)
+{
+  rb_native_mutex_lock(&channel->lock);
+  channel->closed = 1;
+  rb_native_cond_broadcast(&channel->readable);
+  rb_native_cond_broadcast(&channel->writable);
+  rb_native_mutex_unlock(&channel->lock);
+}
+
+static int rlua_channel_lua_close(lua_State* state)
+{
+  rlua_channel_close(rlua_check_channel(state));
+  return 0;
+}
+
+static long rlua_channel_count(rlua_Channel* channel)
+{
+  rb_native_mutex_lock(&channel->lock);
+  long count = channel->count;
+  rb_native_mutex_unlock(&channel->lock);
+
+  return count;
+}
+
+static int rlua_channel_len(lua_State* state)
+{
+  lua_pushinteger(state, rlua_channel_count(rlua_check_channel(state)));
+  return 1;
+}
+
+static int rlua_channel_tostring(lua_State* state)
+{
+  lua_pushfstring(state, "channel: %p", (void*) rlua_check_channel(state));
+  return 1;
+}
+
+static int rlua_channel_gc(lua_State* state)
+{
+  rlua_channel_release(*(rlua_Channel**) lua_touserdata(state, 1));
+  return 0;
+}
+
+static const luaL_Reg rlua_channel_methods[] = {
+  {"send", rlua_channel_send},
+  {"try_send", rlua_channel_try_send},
+  {"recv", rlua_channel_recv},
+  {"try_recv", rlua_channel_try_recv},
+  {"close", rlua_channel_lua_close},
+  {NULL, NULL}
+};
+
+static void rlua_channel_register(lua_State* state)
+{
+  luaL_newmetatable(state, "rlua.channel");
+  lua_pushcfunction(state, rlua_channel_len);
+  lua_setfield(state, -2, "__len");
+  lua_pushcfunction(state, rlua_channel_tostring);
+  lua_setfield(state, -2, "__tostring");
+  lua_pushcfunction(state, rlua_channel_gc);
+  lua_setfield(state, -2, "__gc");
+  luaL_newlib(state, rlua_channel_methods);
+  lua_setfield(state, -2, "__index");
+  lua_pop(state, 1);
+}
+
+static void rlua_channel_free(void* ptr)
+{
+  rlua_channel_release(ptr);
+}
+
+static const rb_data_type_t rlua_channel_type = {
+  .wrap_struct_name = "rlua_channel",
+  .function = {
+    .dfree = rlua_channel_free,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+};
+
+static int rlua_push_channel(lua_State* state, VALUE value)
+{
+  if(!rb_typeddata_is_kind_of(value, &rlua_channel_type))
+    return 0;
+
+  rlua_Channel* channel = DATA_PTR(value);
+  rlua_Channel** box = lua_newuserdatauv(state, sizeof(rlua_Channel*), 0);
+  *box = channel;
+  RUBY_ATOMIC_INC(channel->refs);
+  luaL_setmetatable(state, "rlua.channel");
+
+  return 1;
+}
+
+static VALUE rlua_channel_alloc(VALUE klass)
+{
+  rlua_Channel* channel = calloc(1, sizeof(rlua_Channel));
+  if(channel == NULL)
+    rb_raise(rb_eNoMemError, "cannot allocate channel");
+
+  channel->refs = 1;
+  channel->capacity = 1;
+  rb_native_mutex_initialize(&channel->lock);
+  rb_native_cond_initialize(&channel->readable);
+  rb_native_cond_initialize(&channel->writable);
+
+  return TypedData_Wrap_Struct(klass, &rlua_channel_type, channel);
+}
+
+static rlua_Channel* rlua_get_channel(VALUE self)
+{
+  return rb_check_typeddata(self, &rlua_channel_type);
+}
+
+/*
+ * call-seq: Lua::Channel.new(capacity = 64) -> channel
+ *
+ * Creates a queue of at most +capacity+ values which can be assigned to
+ * variables of any number of Lua states, on any threads or Ractors, and
+ * used from Lua code:
+ *
+ *   channel = Lua::Channel.new
+ *   parser.out = enricher.input = channel
+ *   Thread.new { parser.__eval 'for _, row in ipairs(rows) do out:send(row) end; out:close()' }
+ *   enricher.__eval 'for row in input.recv, input do enrich(row) end'
+ *
+ * Lua methods are <tt>send(value)</tt>, which waits while the channel is
+ * full, <tt>recv()</tt>, which waits while it is empty and returns the
+ * value and +true+ (or +nil+ and +false+ once the channel is closed and
+ * drained), their non-blocking variants <tt>try_send(value)</tt> and
+ * <tt>try_recv()</tt>, which return +false+ instead of waiting, and
+ * <tt>close()</tt>. Sending to a closed channel is an error.
+ *
+ * Values are nil, booleans, numbers, strings and tables of them; they are
+ * serialized once by the sender and rebuilt once by the receiver. Waiting
+ * releases the GVL and can be interrupted by Thread#raise or Timeout.
+ *
+ * Channels connect states, not threads sharing one state: use each
+ * Lua::State from one thread at a time. While Lua code waits in +send+ or
+ * +recv+, calls into its state from any other thread raise ThreadError.
+ */
+static VALUE rbLuaChannel_initialize(int argc, VALUE* argv, VALUE self)
+{
+  VALUE capacity;
+  rb_scan_args(argc, argv, "01", &capacity);
+
+  long value = capacity == Qnil ? 64 : NUM2LONG(capacity);
+  if(value < 1)
+    rb_raise(rb_eArgError, "capacity must be positive");
+
+  rlua_get_channel(self)->capacity = value;
+
+  return rb_obj_freeze(self);
+}
+
+// Waits in Ruby, running interrupts between waits; +op->item+ is freed if they raise.
+static void rlua_channel_ruby_run(struct rlua_channel_op* op)
+{
+  int error;
+
+  for(;;) {
+    rlua_channel_run(op);
+    if(op->status != RLUA_CHANNEL_INTERRUPTED)
+      return;
+
+    rb_protect(rlua_check_ints, Qnil, &error);
+    if(error) {
+      if(op->item)
+        rlua_channel_item_free(op->item);
+      rb_jump_tag(error);
+    }
+  }
+}
+
+static VALUE rlua_channel_ruby_send(VALUE self, VALUE value, int block)
+{
+  rlua_Channel* channel = rlua_get_channel(self);
+
+  rlua_Packet packet = { NULL, 0, 0 };
+  rlua_packet_from_ruby(&packet, value);
+
+  rlua_ChannelItem* item = calloc(1, sizeof(rlua_ChannelItem));
+  if(item == NULL) {
+    rlua_packet_free(&packet);
+    rb_raise(rb_eNoMemError, "cannot allocate channel item");
+  }
+  item->packet = packet;
+
+  struct rlua_channel_op op = { channel, item, 1, block, 0, RLUA_CHANNEL_OK };
+  rlua_channel_ruby_run(&op);
+  if(op.item)
+    rlua_channel_item_free(op.item);
+
+  if(op.status == RLUA_CHANNEL_CLOSED)
+    rb_raise(rb_path2class("ClosedQueueError"), "channel is closed");
+
+  return op.status == RLUA_CHANNEL_OK ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: channel.push(value) -> channel
+ *
+ * Sends +value+, waiting while the channel is full. Raises ClosedQueueError
+ * if the channel is closed.
+ */
+static VALUE rbLuaChannel_push(VALUE self, VALUE value)
+{
+  rlua_channel_ruby_send(self, value, 1);
+  return self;
+}
+
+/*
+ * call-seq: channel.try_push(value) -> true or false
+ *
+ * Sends +value+ if the channel is not full, without waiting.
+ */
+static VALUE rbLuaChannel_try_push(VALUE self, VALUE value)
+{
+  return rlua_channel_ruby_send(self, value, 0);
+}
+
+static VALUE rlua_channel_ruby_recv(VALUE self, int block, int* received)
+{
+  struct rlua_channel_op op = { rlua_get_channel(self), NULL, 0, block, 0, RLUA_CHANNEL_OK };
+  rlua_channel_ruby_run(&op);
+
+  *received = op.status == RLUA_CHANNEL_OK;
+  if(!*received)
+    return Qnil;
+
+  struct rlua_packet_reader reader = { op.item->packet.data, op.item->packet.data + op.item->packet.size };
+  int error;
+
+  VALUE value = rb_protect(rlua_packet_to_ruby_protected, (VALUE) &reader, &error);
+  rlua_channel_item_free(op.item);
+  if(error)
+    rb_jump_tag(error);
+
+  return value;
+}
+
+/*
+ * call-seq: channel.pop -> value
+ *
+ * Receives a value, waiting while the channel is empty. Returns +nil+ once
+ * the channel is closed and drained. Tables arrive as Hashes and Arrays.
+ */
+static VALUE rbLuaChannel_pop(VALUE self)
+{
+  int received;
+  return rlua_channel_ruby_recv(self, 1, &received);
+}
+
+/*
+ * call-seq: channel.try_pop -> [value] or nil
+ *
+ * Receives a value if there is one, without waiting. It is wrapped in an
+ * Array to tell a received +nil+ from an empty channel.
+ */
+static VALUE rbLuaChannel_try_pop(VALUE self)
+{
+  int received;
+  VALUE value = rlua_channel_ruby_recv(self, 0, &received);
+  return received ? rb_ary_new_from_args(1, value) : Qnil;
+}
+
+/*
+ * call-seq: channel.close -> channel
+ *
+ * Closes the channel: values can no longer be sent, and receivers get the
+ * values already queued, then +nil+. Waiting senders raise.
+ */
+static VALUE rbLuaChannel_close(VALUE self)
+{
+  rlua_channel_close(rlua_get_channel(self));
+  return self;
+}
+
+/*
+ * call-seq: channel.closed? -> true or false
+ */
+static VALUE rbLuaChannel_closed_p(VALUE self)
+{
+  rlua_Channel* channel = rlua_get_channel(self);
+
+  rb_native_mutex_lock(&channel->lock);
+  int closed = channel->closed;
+  rb_native_mutex_unlock(&channel->lock);
+
+  return closed ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: channel.size -> int
+ *
+ * Returns the number of queued values.
+ */
+static VALUE rbLuaChannel_size(VALUE self)
+{
+  return LONG2NUM(rlua_channel_count(rlua_get_channel(self)));
+}
+
+/*
+ * call-seq: channel.capacity -> int
+ */
+static VALUE rbLuaChannel_capacity(VALUE self)
+{
+  return LONG2NUM(rlua_get_channel(self)->capacity);
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Worker pool: N native threads, each owning a Lua interpreter. Jobs and
+ * their results cross between Ruby and workers only as packets.
+ */
+typedef struct rlua_Job {
+  long id;
+  char* function;
+  rlua_Packet args, result;
+  int ok;
+  struct rlua_Job* next;
+} rlua_Job;
+
+typedef struct {
+  int nworkers;
+  pthread_t* threads;
+  lua_State** states;
+  rb_nativethread_lock_t lock;
+  rb_nativethread_cond_t work, done;
+  rlua_Job *queue, *queue_tail;
+  rlua_Job *finished, *finished_tail;
+  long next_id;
+  rb_atomic_t refs;              // Lua::WorkerPool object plus every started worker
+  int started, stopping, interrupted;
+} rlua_Pool;
+
+typedef struct {
+  rlua_Pool* pool;
+  int index;
+} rlua_Worker;
+
+static void rlua_job_free(rlua_Job* job)
+{
+  free(job->function);
+  rlua_packet_free(&job->args);
+  rlua_packet_free(&job->result);
+  free(job);
+}
+
+static int rlua_worker_call(lua_State* state)
+{
+  rlua_Job* job = lua_touserdata(state, 1);
+  const char *cursor = job->args.data, *end = job->args.data + job->args.size;
+  uint32_t i, argc;
+  char tag;
+
+  lua_settop(state, 0);
+  if(lua_getglobal(state, job->function) != LUA_TFUNCTION)
+    return luaL_error(state, "attempt to call a %s value (global '%s')", luaL_typename(state, -1), job->function);
+
+  if(!rlua_packet_read(&cursor, end, &tag, 1) || tag != RLUA_PACKET_ARRAY ||
+     !rlua_packet_read(&cursor, end, &argc, sizeof(argc)))
+    return luaL_error(state, "malformed arguments");
+
+  luaL_checkstack(state, argc, "too many arguments");
+  for(i = 0; i < argc; i++)
+    rlua_packet_to_lua(state, &cursor, end);
+
+  lua_call(state, argc, LUA_MULTRET);
+
+  uint32_t n = lua_gettop(state);
+  if(!rlua_packet_write_tag(&job->result, RLUA_PACKET_ARRAY, &n, sizeof(n)))
+    return luaL_error(state, "not enough memory");
+
+  for(i = 1; i <= n; i++) {
+    const char* error = rlua_packet_from_lua(&job->result, state, i, 0);
+    if(error)
+      return luaL_error(state, "cannot return value #%d: %s", i, error);
+  }
+
+  return 0;
+}
+
+static void rlua_pool_release(rlua_Pool* pool);
+
+static void* rlua_worker_main(void* data)
+{
+  rlua_Worker* worker = data;
+  rlua_Pool* pool = worker->pool;
+  lua_State* state = pool->states[worker->index];
+  free(worker);
+
+  for(;;) {
+    rb_native_mutex_lock(&pool->lock);
+    while(pool->queue == NULL && !pool->stopping)
+      rb_native_cond_wait(&pool->work, &pool->lock);
+
+    rlua_Job* job = pool->queue;
+    if(job == NULL) {
+      rb_native_mutex_unlock(&pool->lock);
+      break;
+    }
+
+    pool->queue = job->next;
+    if(pool->queue == NULL)
+      pool->queue_tail = NULL;
+    rb_native_mutex_unlock(&pool->lock);
+
+    lua_settop(state, 0);
+    lua_pushcfunction(state, rlua_worker_call);
+    lua_pushlightuserdata(state, job);
+    job->ok = lua_pcall(state, 1, 0, 0) == LUA_OK;
+
+    if(!job->ok) {
+      size_t length;
+      const char* message = lua_tolstring(state, -1, &length);
+      uint32_t one = 1;
+      uint64_t size = message ? length : 0;
+
+      rlua_packet_free(&job->result);
+      rlua_packet_write_tag(&job->result, RLUA_PACKET_ARRAY, &one, sizeof(one));
+      rlua_packet_write_tag(&job->result, RLUA_PACKET_STRING, &size, sizeof(size));
+      rlua_packet_write(&job->result, message, size);
+    }
+
+    lua_settop(state, 0);
+
+    rb_native_mutex_lock(&pool->lock);
+    job->next = NULL;
+    if(pool->finished_tail)
+      pool->finished_tail->next = job;
+    else
+      pool->finished = job;
+    pool->finished_tail = job;
+    rb_native_cond_broadcast(&pool->done);
+    rb_native_mutex_unlock(&pool->lock);
   }
+
+  rlua_pool_release(pool);
+  return NULL;
 }
 
-static int bootstrap_pairs (lua_State *L) {
-  luaL_checkany(L, 1);
-  if (luaL_getmetafield(L, 1, "__pairs") == LUA_TNIL) {  /* no metamethod? */
-    lua_pushcfunction(L, bootstrap_next);  /* will return generator, */
-    lua_pushvalue(L, 1);  /* state, */
-    lua_pushnil(L);  /* and initial value */
+static void* rlua_pool_join(void* data)
+{
+  rlua_Pool* pool = data;
+
+  for(int i = 0; i < pool->started; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  return NULL;
+}
+
+// Closes the states and drops all jobs. No worker may be running.
+static void rlua_pool_clear(rlua_Pool* pool)
+{
+  if(pool->states == NULL)
+    return;
+
+  for(int i = 0; i < pool->nworkers; i++)
+    if(pool->states[i])
+      lua_close(pool->states[i]);
+
+  rlua_Job* job;
+  while((job = pool->queue) != NULL) {
+    pool->queue = job->next;
+    rlua_job_free(job);
   }
-  else {
-    lua_pushvalue(L, 1);  /* argument 'self' to metamethod */
-    lua_call(L, 1, 3);  /* get 3 values from metamethod */
+  while((job = pool->finished) != NULL) {
+    pool->finished = job->next;
+    rlua_job_free(job);
   }
-  return 3;
-}
+  pool->queue_tail = pool->finished_tail = NULL;
 
-static int bootstrap_inext (lua_State *L) {
-  lua_Integer i = luaL_checkinteger(L, 2);
-  luaL_checktype(L, 1, LUA_TTABLE);
-  i++;  /* next value */
-  lua_pushinteger(L, i);
-  lua_rawgeti(L, 1, i);
-  return (lua_isnil(L, -1)) ? 0 : 2;
+  free(pool->threads);
+  free(pool->states);
+  pool->threads = NULL;
+  pool->states = NULL;
+  pool->started = 0;
 }
 
-static int ipairsaux (lua_State *L) {
-  lua_Integer i = luaL_checkinteger(L, 2) + 1;
-  lua_pushinteger(L, i);
-  return (lua_geti(L, 1, i) == LUA_TNIL) ? 1 : 2;
+/*
+ * The Ruby object and every started worker hold a reference; whoever drops
+ * the last one frees the pool. This may be a worker thread.
+ */
+static void rlua_pool_release(rlua_Pool* pool)
+{
+  if(RUBY_ATOMIC_FETCH_SUB(pool->refs, 1) != 1)
+    return;
+
+  rlua_pool_clear(pool);
+  rb_native_cond_destroy(&pool->work);
+  rb_native_cond_destroy(&pool->done);
+  rb_native_mutex_destroy(&pool->lock);
+  free(pool);
 }
 
-static int bootstrap_ipairs (lua_State *L) {
-  luaL_checkany(L, 1);
-  lua_pushcfunction(L, ipairsaux);  /* iteration function */
-  lua_pushvalue(L, 1);  /* state */
-  lua_pushinteger(L, 0);  /* initial value */
-  return 3;
+static void rlua_pool_signal_stop(rlua_Pool* pool)
+{
+  rb_native_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  rb_native_cond_broadcast(&pool->work);
+  rb_native_mutex_unlock(&pool->lock);
 }
 
-static int bootstrap_select (lua_State *L) {
-  int n = lua_gettop(L);
-  if (lua_type(L, 1) == LUA_TSTRING && *lua_tostring(L, 1) == '#') {
-    lua_pushinteger(L, n-1);
-    return 1;
-  }
-  else {
-    lua_Integer i = luaL_checkinteger(L, 1);
-    if (i < 0) i = n + i;
-    else if (i > n) i = n;
-    luaL_argcheck(L, 1 <= i, 1, "index out of range");
-    return n - (int)i;
-  }
-}
+static void rlua_pool_stop(rlua_Pool* pool)
+{
+  if(pool->states == NULL)
+    return;
 
-static int bootstrap_assert (lua_State *L) {
-  if (lua_toboolean(L, 1))  /* condition is true? */
-    return lua_gettop(L);  /* return all arguments */
-  else {  /* error */
-    luaL_checkany(L, 1);  /* there must be a condition */
-    lua_remove(L, 1);  /* remove it */
-    lua_pushliteral(L, "assertion failed!");  /* default message */
-    lua_settop(L, 1);  /* leave only message (default if no other one) */
-    return bootstrap_error(L);  /* call 'error' */
-  }
+  rlua_pool_signal_stop(pool);
+  rb_thread_call_without_gvl(rlua_pool_join, pool, NULL, NULL);
+  rlua_pool_clear(pool);
 }
 
-static int finishpcall (lua_State *L, int status, lua_KContext extra) {
-  if (status != LUA_OK && status != LUA_YIELD) {  /* error? */
-    lua_pushboolean(L, 0);  /* first result (false) */
-    lua_pushvalue(L, -2);  /* error message */
-    return 2;  /* return false, msg */
+/*
+ * Joining here could block the whole VM inside GC behind a long running
+ * job, so the workers are detached instead and the last one to finish
+ * frees the pool.
+ */
+static void rlua_pool_free(void* ptr)
+{
+  rlua_Pool* pool = ptr;
+
+  if(pool->states != NULL) {
+    rlua_pool_signal_stop(pool);
+    for(int i = 0; i < pool->started; i++)
+      pthread_detach(pool->threads[i]);
   }
-  else
-    return lua_gettop(L) - (int)extra;  /* return all results */
-}
 
-static int bootstrap_pcall (lua_State *L) {
-  int status;
-  luaL_checkany(L, 1);
-  lua_pushboolean(L, 1);  /* first result if no errors */
-  lua_insert(L, 1);  /* put it in place */
-  status = lua_pcallk(L, lua_gettop(L) - 2, LUA_MULTRET, 0, 0, finishpcall);
-  return finishpcall(L, status, 0);
+  rlua_pool_release(pool);
 }
 
-static int bootstrap_xpcall (lua_State *L) {
-  int status;
-  int n = lua_gettop(L);
-  luaL_checktype(L, 2, LUA_TFUNCTION);  /* check error function */
-  lua_pushboolean(L, 1);  /* first result */
-  lua_pushvalue(L, 1);  /* function */
-  lua_rotate(L, 3, 2);  /* move them below function's arguments */
-  status = lua_pcallk(L, n - 2, LUA_MULTRET, 2, 2, finishpcall);
-  return finishpcall(L, status, 2);
+static const rb_data_type_t rlua_pool_type = {
+  .wrap_struct_name = "rlua_pool",
+  .function = {
+    .dfree = rlua_pool_free,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE rlua_pool_alloc(VALUE klass)
+{
+  rlua_Pool* pool = calloc(1, sizeof(rlua_Pool));
+  if(pool == NULL)
+    rb_raise(rb_eNoMemError, "cannot allocate worker pool");
+
+  pool->refs = 1;
+  rb_native_mutex_initialize(&pool->lock);
+  rb_native_cond_initialize(&pool->work);
+  rb_native_cond_initialize(&pool->done);
+
+  return TypedData_Wrap_Struct(klass, &rlua_pool_type, pool);
 }
 
-static const
-  struct { const char* name; lua_CFunction func; }
-  stdlib[] = {
-    { "type",     bootstrap_type     },
-    { "next",     bootstrap_next     },
-    { "tonumber", bootstrap_tonumber },
-    { "tostring", bootstrap_tostring },
-    { "select",   bootstrap_select   },
-    { "error",    bootstrap_error    },
-    { "assert",   bootstrap_assert   },
-    { "pcall",    bootstrap_pcall    },
-    { "xpcall",   bootstrap_xpcall   },
-  };
+static rlua_Pool* rlua_get_pool(VALUE self)
+{
+  rlua_Pool* pool = rb_check_typeddata(self, &rlua_pool_type);
+  if(pool->states == NULL)
+    rb_raise(rb_eArgError, "worker pool is not running");
 
-/*
- * call-seq: state.__bootstrap() -> true
- *
- * Deploys an absolute minimum of functions required to write minimally
- * useful Lua programs. This is really a subset of Lua _base_ library
- * (copied from Lua 5.3 sources) that may be handy if you don't like standard
- * function layout. All of these functions can be implemented in pure Ruby,
- * but that will slow down Lua code incredibly.
- *
- * <b>If you want to get familiar layout described in Lua documentation, check
- * #__load_stdlib function.</b>
- *
- * Exact list of functions defined: type, next, tonumber, tostring, select,
- * error, assert, pcall, xpcall.
- */
-static VALUE rbLua_bootstrap(VALUE self)
+  return pool;
+}
+
+/* :nodoc: */
+static VALUE rbLuaWorkerPool_start(VALUE self, VALUE threads, VALUE setup)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
+  rlua_Pool* pool = rb_check_typeddata(self, &rlua_pool_type);
+  if(pool->states != NULL || pool->stopping)
+    rb_raise(rb_eArgError, "worker pool is already started");
+
+  int nworkers = NUM2INT(threads);
+  if(nworkers < 1)
+    rb_raise(rb_eArgError, "worker pool needs at least one thread");
+  if(setup != Qnil)
+    StringValue(setup);
+
+  pool->nworkers = nworkers;
+  pool->threads = calloc(nworkers, sizeof(pthread_t));
+  pool->states = calloc(nworkers, sizeof(lua_State*));
+  if(pool->threads == NULL || pool->states == NULL)
+    rb_raise(rb_eNoMemError, "cannot allocate worker pool");
+
+  for(int i = 0; i < nworkers; i++) {
+    lua_State* state = pool->states[i] = luaL_newstate();
+    if(state == NULL) {
+      rlua_pool_stop(pool);
+      rb_raise(rb_eNoMemError, "cannot create Lua state");
+    }
 
-  for(size_t nf = 0; nf < sizeof(stdlib) / sizeof(stdlib[0]); nf++) {
-    lua_pushcclosure(state, stdlib[nf].func, 0);
-    lua_setglobal(state, stdlib[nf].name);
+    luaL_openlibs(state);
+
+    if(setup != Qnil) {
+      if(luaL_loadbuffer(state, RSTRING_PTR(setup), RSTRING_LEN(setup), "=<setup>") != LUA_OK ||
+         lua_pcall(state, 0, 0, 0) != LUA_OK) {
+        // Avoid __tostring, which could raise outside of a protected call.
+        VALUE error = lua_type(state, -1) == LUA_TSTRING ?
+          rb_str_new_cstr(lua_tostring(state, -1)) :
+          rb_sprintf("(error object is a %s value)", luaL_typename(state, -1));
+        rlua_pool_stop(pool);
+        rb_exc_raise(rb_exc_new3(rb_eRuntimeError, error));
+      }
+    }
   }
 
-  lua_pushcfunction(state, bootstrap_next);
-  lua_pushcclosure(state, bootstrap_pairs, 1);
-  lua_setglobal(state, "pairs");
+  for(int i = 0; i < nworkers; i++) {
+    rlua_Worker* worker = malloc(sizeof(rlua_Worker));
+    if(worker != NULL) {
+      worker->pool = pool;
+      worker->index = i;
+    }
 
-  lua_pushcfunction(state, bootstrap_inext);
-  lua_pushcclosure(state, bootstrap_ipairs, 1);
-  lua_setglobal(state, "ipairs");
+    RUBY_ATOMIC_INC(pool->refs);
+    if(worker == NULL || pthread_create(&pool->threads[i], NULL, rlua_worker_main, worker) != 0) {
+      RUBY_ATOMIC_DEC(pool->refs);
+      free(worker);
+      rlua_pool_stop(pool);
+      rb_raise(rb_eRuntimeError, "cannot start worker thread");
+    }
 
-  return Qtrue;
+    pool->started++;
+  }
+
+  return self;
 }
 
-// from lua5.3/linit.c
-static void rlua_openlib(lua_State* state, const char* name, lua_CFunction func)
+/* :nodoc: */
+static VALUE rbLuaWorkerPool_submit(VALUE self, VALUE function, VALUE args)
 {
-  luaL_requiref(state, name, func, 1);
-  lua_pop(state, 1);  /* remove lib */
+  rlua_Pool* pool = rlua_get_pool(self);
+
+  // Everything which can raise happens before anything is allocated, except
+  // for the packet, which rlua_packet_from_ruby frees itself. The name is
+  // frozen so that serializing the arguments cannot change it.
+  Check_Type(args, T_ARRAY);
+  function = rb_str_new_frozen(rb_obj_as_string(function));
+  const char* name = StringValueCStr(function);
+
+  rlua_Packet packet = { NULL, 0, 0 };
+  rlua_packet_from_ruby(&packet, args);
+
+  rlua_Job* job = calloc(1, sizeof(rlua_Job));
+  char* copy = malloc(strlen(name) + 1);
+  if(job == NULL || copy == NULL) {
+    free(job);
+    free(copy);
+    rlua_packet_free(&packet);
+    rb_raise(rb_eNoMemError, "cannot allocate job");
+  }
+  strcpy(copy, name);
+  job->function = copy;
+  job->args = packet;
+
+  rb_native_mutex_lock(&pool->lock);
+  job->id = ++pool->next_id;
+  if(pool->queue_tail)
+    pool->queue_tail->next = job;
+  else
+    pool->queue = job;
+  pool->queue_tail = job;
+  rb_native_cond_signal(&pool->work);
+  rb_native_mutex_unlock(&pool->lock);
+
+  return LONG2NUM(job->id);
 }
 
-static const
-  struct { const char* alias; const char* name; lua_CFunction func; }
-  libs[] = {
-  {"base", "_G", luaopen_base},
-  {NULL, LUA_LOADLIBNAME, luaopen_package},
-  {NULL, LUA_COLIBNAME, luaopen_coroutine},
-  {NULL, LUA_TABLIBNAME, luaopen_table},
-  {NULL, LUA_IOLIBNAME, luaopen_io},
-  {NULL, LUA_OSLIBNAME, luaopen_os},
-  {NULL, LUA_STRLIBNAME, luaopen_string},
-  {NULL, LUA_MATHLIBNAME, luaopen_math},
-  {NULL, LUA_UTF8LIBNAME, luaopen_utf8},
-  {NULL, LUA_DBLIBNAME, luaopen_debug},
+struct rlua_pool_wait {
+  rlua_Pool* pool;
+  unsigned long msec;
 };
 
+static void* rlua_pool_wait_nogvl(void* data)
+{
+  struct rlua_pool_wait* wait = data;
+  rlua_Pool* pool = wait->pool;
+
+  rb_native_mutex_lock(&pool->lock);
+  if(pool->finished == NULL && !pool->interrupted)
+    rb_native_cond_timedwait(&pool->done, &pool->lock, wait->msec);
+  pool->interrupted = 0;
+  rb_native_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+static void rlua_pool_wait_interrupt(void* data)
+{
+  rlua_Pool* pool = data;
+
+  rb_native_mutex_lock(&pool->lock);
+  pool->interrupted = 1;
+  rb_native_cond_broadcast(&pool->done);
+  rb_native_mutex_unlock(&pool->lock);
+}
+
+/* :nodoc: */
+static VALUE rbLuaWorkerPool_wait(VALUE self, VALUE timeout)
+{
+  rlua_Pool* pool = rlua_get_pool(self);
+  struct rlua_pool_wait wait = { pool, (unsigned long) (NUM2DBL(timeout) * 1000) };
+
+  rb_native_mutex_lock(&pool->lock);
+  int idle = pool->finished == NULL;
+  rb_native_mutex_unlock(&pool->lock);
+
+  if(idle && wait.msec > 0)
+    rb_thread_call_without_gvl(rlua_pool_wait_nogvl, &wait, rlua_pool_wait_interrupt, pool);
+
+  rb_native_mutex_lock(&pool->lock);
+  rlua_Job* job = pool->finished;
+  if(job) {
+    pool->finished = job->next;
+    if(pool->finished == NULL)
+      pool->finished_tail = NULL;
+  }
+  rb_native_mutex_unlock(&pool->lock);
+
+  if(job == NULL)
+    return Qnil;
+
+  struct rlua_packet_reader reader = { job->result.data, job->result.data + job->result.size };
+  VALUE ok = job->ok ? Qtrue : Qfalse, id = LONG2NUM(job->id);
+  int error;
+
+  VALUE results = rb_protect(rlua_packet_to_ruby_protected, (VALUE) &reader, &error);
+  rlua_job_free(job);
+  if(error)
+    rb_jump_tag(error);
+
+  return rb_ary_new_from_args(3, id, ok, results);
+}
+
 /*
- * call-seq: state.__load_stdlib(*libs) -> true
- *
- * Loads Lua standard libraries. There are two ways of calling this function:
- *
- * If you will call it as __load_stdlib(:all), it is equivalent to calling
- * C +luaL_openlibs+ function.
- *
- * If you will pass it symbolized names of separate libraries (like :base),
- * it is equivalent to calling corresponding +luaopen_*+ functions.
- *
- * Examples:
- *
- *   # Load all standard libraries
- *   state = Lua::State.new
- *   state.__load_stdlib :all
+ * call-seq: pool.shutdown -> nil
  *
- *   # Load only math, string and table libraries
- *   state = Lua::State.new
- *   state.__load_stdlib :math, :string, :table
+ * Stops worker threads after they finish the jobs they are running and
+ * closes their Lua states. Queued jobs which were not started are dropped.
  *
- * Exact list of libraries recognized: <tt>:base</tt>, <tt>:table</tt>,
- * <tt>:math</tt>, <tt>:string</tt>, <tt>:debug</tt>, <tt>:io</tt>,
- * <tt>:os</tt>, <tt>:package</tt>.
- * <b>Anything not included in this list will be silently ignored.</b>
+ * A pool which is garbage collected without being shut down does not wait
+ * for its workers; they stop in the background once their current jobs
+ * finish.
  */
-static VALUE rbLua_load_stdlib(VALUE self, VALUE args)
+static VALUE rbLuaWorkerPool_shutdown(VALUE self)
 {
-  lua_State* state;
-  Data_Get_Struct(rb_iv_get(self, "@state"), lua_State, state);
-
-  if(rb_ary_includes(args, ID2SYM(rb_intern("all")))) {
-    luaL_openlibs(state);
-  } else {
-    for(size_t nl = 0; nl < sizeof(libs) / sizeof(libs[0]); nl++) {
-      const char* name = libs[nl].alias != NULL ? libs[nl].alias : libs[nl].name;
-      if (rb_ary_includes(args, ID2SYM(rb_intern(name)))) {
-        rlua_openlib(state, libs[nl].name, libs[nl].func);
-      }
-    }
-  }
+  rlua_Pool* pool = rb_check_typeddata(self, &rlua_pool_type);
+  rlua_pool_stop(pool);
 
-  return Qtrue;
+  return Qnil;
 }
+#endif
 
 void Init_rlua()
 {
+  rb_ext_ractor_safe(true);
+
+  id_call = rb_intern("call");
+  id_args = rb_intern("@args");
+  id_keys = rb_intern("@keys");
+  id_trace = rb_intern("@__lua_trace");
+  id_source_location = rb_intern("source_location");
+  id_keyword_init = rb_intern("keyword_init?");
+
+  if(rb_const_defined(rb_cObject, rb_intern("Data"))) {
+    VALUE data = rb_const_get(rb_cObject, rb_intern("Data"));
+    if(RB_TYPE_P(data, T_CLASS))
+      rlua_cData = data;
+  }
+  rb_gc_register_address(&rlua_cData);
+
   /*
    * Main module that encapsulates all RLua classes and methods.
    */
   mLua = rb_define_module("Lua");
 
+  /*
+   * Lua implementation the extension was compiled against: +:lua+ for
+   * Lua 5.4 or +:luajit+ (see README).
+   */
+  rb_define_const(mLua, "BACKEND", ID2SYM(rb_intern(RLUA_BACKEND)));
+  /*
+   * Version string of the Lua implementation, e.g. "Lua 5.4.6".
+   */
+  rb_define_const(mLua, "BACKEND_VERSION", rb_obj_freeze(rb_str_new_cstr(RLUA_BACKEND_VERSION)));
+
   /*
    * Lua::State represents Lua interpreter state which is one thread of
    * execution.
    */
   cLuaState = rb_define_class_under(mLua, "State", rb_cObject);
-  rb_define_method(cLuaState, "initialize", rbLua_initialize, 0);
+  rb_define_alloc_func(cLuaState, rlua_state_alloc);
+  rb_define_method(cLuaState, "initialize", rbLua_initialize, -1);
   rb_define_method(cLuaState, "__eval", rbLua_eval, -1);
+  rb_define_method(cLuaState, "try_eval", rbLua_try_eval, -1);
+  rb_define_method(cLuaState, "__eval_async", rbLua_eval_async, -1);
   rb_define_method(cLuaState, "__bootstrap", rbLua_bootstrap, 0);
   rb_define_method(cLuaState, "__load_stdlib", rbLua_load_stdlib, -2);
   rb_define_method(cLuaState, "__get_metatable", rbLua_get_metatable, 1);
   rb_define_method(cLuaState, "__set_metatable", rbLua_set_metatable, 2);
+  rb_define_method(cLuaState, "gc", rbLua_gc, -1);
+  rb_define_method(cLuaState, "stats", rbLua_stats, 0);
+  rb_define_method(cLuaState, "reset", rbLua_reset, 0);
+  rb_define_method(cLuaState, "interrupt_check_interval", rbLua_get_interrupt_interval, 0);
+  rb_define_method(cLuaState, "interrupt_check_interval=", rbLua_set_interrupt_interval, 1);
+  rb_define_method(cLuaState, "symbolize_keys", rbLua_get_symbolize_keys, 0);
+  rb_define_method(cLuaState, "symbolize_keys=", rbLua_set_symbolize_keys, 1);
+  rb_define_method(cLuaState, "profile_callbacks", rbLua_get_profile_callbacks, 0);
+  rb_define_method(cLuaState, "profile_callbacks=", rbLua_set_profile_callbacks, 1);
+  rb_define_method(cLuaState, "callback_profile", rbLua_callback_profile, 0);
+  rb_define_method(cLuaState, "reset_callback_profile", rbLua_reset_callback_profile, 0);
+  rb_define_method(cLuaState, "max_conversion_depth", rbLua_get_max_depth, 0);
+  rb_define_method(cLuaState, "max_conversion_depth=", rbLua_set_max_depth, 1);
+  rb_define_method(cLuaState, "max_conversion_elements", rbLua_get_max_elements, 0);
+  rb_define_method(cLuaState, "max_conversion_elements=", rbLua_set_max_elements, 1);
+  rb_define_method(cLuaState, "mount_bundle", rbLua_mount_bundle, 1);
+  rb_define_method(cLuaState, "dig", rbLua_dig, -1);
+  rb_define_method(cLuaState, "push_json", rbLua_push_json, -1);
+  rb_define_method(cLuaState, "set_globals", rbLua_set_globals, 1);
   rb_define_method(cLuaState, "[]", rbLua_get_global, 1);
   rb_define_method(cLuaState, "[]=", rbLua_set_global, 2);
   rb_define_method(cLuaState, "method_missing", rbLua_method_missing, -1);
@@ -1235,8 +7245,11 @@ void Init_rlua()
    * #call function.
    */
   cLuaFunction = rb_define_class_under(mLua, "Function", rb_cObject);
+  rb_define_alloc_func(cLuaFunction, rlua_ref_alloc);
   rb_define_method(cLuaFunction, "initialize", rbLuaFunction_initialize, -1);
   rb_define_method(cLuaFunction, "call", rbLuaFunction_call, -2);
+  rb_define_method(cLuaFunction, "try_call", rbLuaFunction_try_call, -2);
+  rb_define_method(cLuaFunction, "call_async", rbLuaFunction_call_async, -2);
   rb_define_method(cLuaFunction, "__equal", rbLua_rawequal, 1);
   rb_define_method(cLuaFunction, "==", rbLua_equal, 1);
 
@@ -1248,11 +7261,23 @@ void Init_rlua()
    * See also #method_missing function for a convenient way to access tables.
    */
   cLuaTable = rb_define_class_under(mLua, "Table", rb_cObject);
+  rb_define_alloc_func(cLuaTable, rlua_ref_alloc);
   rb_define_singleton_method(cLuaTable, "next", rbLuaTable_next, 2);
+  rb_define_singleton_method(cLuaTable, "from_packed", rbLuaTable_from_packed, 3);
+  rb_define_singleton_method(cLuaTable, "from_json", rbLuaTable_from_json, -1);
   rb_define_method(cLuaTable, "initialize", rbLuaTable_initialize, -1);
   rb_define_method(cLuaTable, "__metatable", rbLuaTable_get_metatable, 0);
   rb_define_method(cLuaTable, "__metatable=", rbLuaTable_set_metatable, 1);
   rb_define_method(cLuaTable, "__length", rbLuaTable_length, 0);
+  rb_define_method(cLuaTable, "dig", rbLuaTable_dig, -1);
+  rb_define_method(cLuaTable, "merge!", rbLuaTable_merge, -1);
+  rb_define_method(cLuaTable, "concat", rbLuaTable_concat, -1);
+  rb_define_method(cLuaTable, "to_packed", rbLuaTable_to_packed, 1);
+  rb_define_method(cLuaTable, "to_struct", rbLuaTable_to_struct, 1);
+  rb_define_method(cLuaTable, "track_changes!", rbLuaTable_track_changes, -1);
+  rb_define_method(cLuaTable, "changes", rbLuaTable_changes, 0);
+  rb_define_method(cLuaTable, "reset_changes", rbLuaTable_reset_changes, 0);
+  rb_define_method(cLuaTable, "to_json", rbLuaTable_to_json, -1);
   rb_define_method(cLuaTable, "__get", rbLuaTable_rawget, 1);
   rb_define_method(cLuaTable, "__set", rbLuaTable_rawset, 2);
   rb_define_method(cLuaTable, "__equal", rbLua_rawequal, 1);
@@ -1260,4 +7285,76 @@ void Init_rlua()
   rb_define_method(cLuaTable, "[]=", rbLuaTable_set, 2);
   rb_define_method(cLuaTable, "==", rbLua_equal, 1);
   rb_define_method(cLuaTable, "method_missing", rbLuaTable_method_missing, -1);
+
+  /*
+   * Lua::Path is a precompiled sequence of keys for Lua::Table#dig and
+   * Lua::State#dig.
+   */
+  cLuaPath = rb_define_class_under(mLua, "Path", rb_cObject);
+  rb_define_method(cLuaPath, "initialize", rbLuaPath_initialize, 1);
+  rb_define_method(cLuaPath, "keys", rbLuaPath_keys, 0);
+
+  /*
+   * Lua::Bundle is an archive of precompiled Lua modules which can be
+   * mounted into a state with Lua::State#mount_bundle. See lib/rlua.rb.
+   */
+  cLuaBundle = rb_define_class_under(mLua, "Bundle", rb_cObject);
+  rb_define_singleton_method(cLuaBundle, "compile", rbLuaBundle_compile, 2);
+
+  /*
+   * Lua::Error is raised for runtime errors in Lua code. Its backtrace
+   * starts with Lua frames active at the moment of error.
+   */
+  cLuaError = rb_define_class_under(mLua, "Error", rb_eRuntimeError);
+
+  /*
+   * Lua::SharedTable is an immutable tree of data which Lua states read in
+   * place without copying. See Lua::SharedTable.build.
+   */
+  cLuaSharedTable = rb_define_class_under(mLua, "SharedTable", rb_cObject);
+  rb_undef_alloc_func(cLuaSharedTable);
+  rb_define_singleton_method(cLuaSharedTable, "build", rbLuaSharedTable_build, 1);
+  rb_define_singleton_method(cLuaSharedTable, "load", rbLuaSharedTable_load, 1);
+  rb_define_method(cLuaSharedTable, "save", rbLuaSharedTable_save, 1);
+  rb_define_method(cLuaSharedTable, "bytesize", rbLuaSharedTable_bytesize, 0);
+
+  /*
+   * Lua::Buffer collects output of Lua code. See Lua::Buffer.new.
+   */
+  cLuaBuffer = rb_define_class_under(mLua, "Buffer", rb_cObject);
+  rb_define_alloc_func(cLuaBuffer, rlua_ref_alloc);
+  rb_define_method(cLuaBuffer, "initialize", rbLuaBuffer_initialize, -1);
+  rb_define_method(cLuaBuffer, "to_s", rbLuaBuffer_to_s, 0);
+  rb_define_method(cLuaBuffer, "size", rbLuaBuffer_size, 0);
+  rb_define_method(cLuaBuffer, "clear", rbLuaBuffer_clear, 0);
+
+  /*
+   * Lua::Channel passes values between Lua states, and Ruby threads. See
+   * Lua::Channel.new.
+   */
+  cLuaChannel = rb_define_class_under(mLua, "Channel", rb_cObject);
+  rb_define_alloc_func(cLuaChannel, rlua_channel_alloc);
+  rb_define_method(cLuaChannel, "initialize", rbLuaChannel_initialize, -1);
+  rb_define_method(cLuaChannel, "push", rbLuaChannel_push, 1);
+  rb_define_method(cLuaChannel, "try_push", rbLuaChannel_try_push, 1);
+  rb_define_method(cLuaChannel, "pop", rbLuaChannel_pop, 0);
+  rb_define_method(cLuaChannel, "try_pop", rbLuaChannel_try_pop, 0);
+  rb_define_method(cLuaChannel, "close", rbLuaChannel_close, 0);
+  rb_define_method(cLuaChannel, "closed?", rbLuaChannel_closed_p, 0);
+  rb_define_method(cLuaChannel, "size", rbLuaChannel_size, 0);
+  rb_define_method(cLuaChannel, "capacity", rbLuaChannel_capacity, 0);
+
+#ifdef HAVE_PTHREAD_H
+  /*
+   * Lua::WorkerPool runs Lua functions on native threads, each owning its
+   * own Lua interpreter, without holding the GVL. See lib/rlua.rb for
+   * the Ruby interface.
+   */
+  cLuaWorkerPool = rb_define_class_under(mLua, "WorkerPool", rb_cObject);
+  rb_define_alloc_func(cLuaWorkerPool, rlua_pool_alloc);
+  rb_define_method(cLuaWorkerPool, "__start", rbLuaWorkerPool_start, 2);
+  rb_define_method(cLuaWorkerPool, "__submit", rbLuaWorkerPool_submit, 2);
+  rb_define_method(cLuaWorkerPool, "__wait", rbLuaWorkerPool_wait, 1);
+  rb_define_method(cLuaWorkerPool, "shutdown", rbLuaWorkerPool_shutdown, 0);
+#endif
 }
@@ -0,0 +1,302 @@
+/*
+ * Lua headers and, when building against LuaJIT (extconf.rb --with-luajit),
+ * shims for the Lua 5.4 API subset used by rlua.c.
+ *
+ * LuaJIT implements the Lua 5.1 API with a few 5.2 additions. The shims
+ * below are only as complete as rlua.c needs them to be; in particular
+ * numbers are always doubles, userdata carry a single (table) user value
+ * and C functions cannot yield with a continuation.
+ */
+#ifndef RLUA_COMPAT_H
+#define RLUA_COMPAT_H
+
+#ifdef RLUA_LUAJIT
+
+#include <stdint.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <luajit.h>
+
+#define RLUA_BACKEND         "luajit"
+#define RLUA_BACKEND_VERSION LUAJIT_VERSION
+#define RLUA_SEARCHERS       "loaders"
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#define LUA_LOADED_TABLE "_LOADED"
+
+#define LUA_OPEQ 0
+#define LUA_OPLT 1
+#define LUA_OPLE 2
+
+typedef size_t lua_Unsigned;
+typedef intptr_t lua_KContext;
+typedef int (*lua_KFunction)(lua_State* L, int status, lua_KContext ctx);
+
+/*
+ * Functions first: they are written against the native LuaJIT API, which
+ * the macros further down shadow.
+ */
+
+static inline int rlua_compat_absindex(lua_State* L, int idx)
+{
+  return (idx > 0 || idx <= LUA_REGISTRYINDEX) ? idx : lua_gettop(L) + idx + 1;
+}
+
+// Integral doubles which survive a round trip through lua_Integer.
+static inline int rlua_compat_isinteger(lua_State* L, int idx)
+{
+  if(lua_type(L, idx) != LUA_TNUMBER)
+    return 0;
+
+  lua_Number n = lua_tonumber(L, idx);
+  return n >= -9223372036854775808.0 && n < 9223372036854775808.0 &&
+         (lua_Number)(lua_Integer) n == n;
+}
+
+static inline int rlua_compat_compare(lua_State* L, int a, int b, int op)
+{
+  switch(op) {
+    case LUA_OPEQ: return lua_equal(L, a, b);
+    case LUA_OPLT: return lua_lessthan(L, a, b);
+    default:       return lua_lessthan(L, a, b) || lua_equal(L, a, b);
+  }
+}
+
+static inline int rlua_compat_getfield(lua_State* L, int idx, const char* k)
+{
+  lua_getfield(L, idx, k);
+  return lua_type(L, -1);
+}
+
+static inline int rlua_compat_gettable(lua_State* L, int idx)
+{
+  lua_gettable(L, idx);
+  return lua_type(L, -1);
+}
+
+static inline int rlua_compat_rawget(lua_State* L, int idx)
+{
+  lua_rawget(L, idx);
+  return lua_type(L, -1);
+}
+
+static inline int rlua_compat_rawgeti(lua_State* L, int idx, int n)
+{
+  lua_rawgeti(L, idx, n);
+  return lua_type(L, -1);
+}
+
+static inline int rlua_compat_geti(lua_State* L, int idx, lua_Integer n)
+{
+  idx = rlua_compat_absindex(L, idx);
+  lua_pushinteger(L, n);
+  lua_gettable(L, idx);
+  return lua_type(L, -1);
+}
+
+static inline void rlua_compat_seti(lua_State* L, int idx, lua_Integer n)
+{
+  idx = rlua_compat_absindex(L, idx);
+  lua_pushinteger(L, n);
+  lua_insert(L, -2);
+  lua_settable(L, idx);
+}
+
+static inline int rlua_compat_rawgetp(lua_State* L, int idx, const void* p)
+{
+  idx = rlua_compat_absindex(L, idx);
+  lua_pushlightuserdata(L, (void*) p);
+  lua_rawget(L, idx);
+  return lua_type(L, -1);
+}
+
+static inline void rlua_compat_rawsetp(lua_State* L, int idx, const void* p)
+{
+  idx = rlua_compat_absindex(L, idx);
+  lua_pushlightuserdata(L, (void*) p);
+  lua_insert(L, -2);
+  lua_rawset(L, idx);
+}
+
+static inline void rlua_compat_rotate(lua_State* L, int idx, int n)
+{
+  idx = rlua_compat_absindex(L, idx);
+  for(; n > 0; n--)
+    lua_insert(L, idx);
+  for(; n < 0; n++) {
+    lua_pushvalue(L, idx);
+    lua_remove(L, idx);
+  }
+}
+
+static inline size_t rlua_compat_stringtonumber(lua_State* L, const char* s)
+{
+  lua_pushstring(L, s);
+  if(lua_type(L, -1) == LUA_TSTRING && lua_isnumber(L, -1)) {
+    lua_Number n = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    lua_pushnumber(L, n);
+    return strlen(s) + 1;
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+static inline const char* rlua_compat_tolstring(lua_State* L, int idx, size_t* len)
+{
+  idx = rlua_compat_absindex(L, idx);
+  if(luaL_callmeta(L, idx, "__tostring")) {
+    if(!lua_isstring(L, -1))
+      luaL_error(L, "'__tostring' must return a string");
+  } else {
+    switch(lua_type(L, idx)) {
+      case LUA_TNUMBER:
+      case LUA_TSTRING:
+        lua_pushvalue(L, idx);
+        break;
+      case LUA_TBOOLEAN:
+        lua_pushstring(L, lua_toboolean(L, idx) ? "true" : "false");
+        break;
+      case LUA_TNIL:
+        lua_pushliteral(L, "nil");
+        break;
+      default:
+        lua_pushfstring(L, "%s: %p", luaL_typename(L, idx), lua_topointer(L, idx));
+        break;
+    }
+  }
+  return lua_tolstring(L, -1, len);
+}
+
+static inline int rlua_compat_getsubtable(lua_State* L, int idx, const char* name)
+{
+  idx = rlua_compat_absindex(L, idx);
+  lua_getfield(L, idx, name);
+  if(lua_type(L, -1) == LUA_TTABLE)
+    return 1;
+
+  lua_pop(L, 1);
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, idx, name);
+  return 0;
+}
+
+static inline void rlua_compat_requiref(lua_State* L, const char* name, lua_CFunction open, int global)
+{
+  rlua_compat_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  lua_getfield(L, -1, name);
+  if(!lua_toboolean(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushcfunction(L, open);
+    lua_pushstring(L, name);
+    lua_call(L, 1, 1);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, name);
+  }
+  lua_remove(L, -2);
+  if(global) {
+    lua_pushvalue(L, -1);
+    lua_setglobal(L, name);
+  }
+}
+
+static inline int rlua_compat_getiuservalue(lua_State* L, int idx, int n)
+{
+  (void) n;
+  lua_getfenv(L, idx);
+  return lua_type(L, -1);
+}
+
+static inline int rlua_compat_resume(lua_State* L, lua_State* from, int nargs, int* nres)
+{
+  (void) from;
+  int status = lua_resume(L, nargs);
+  *nres = lua_gettop(L);
+  return status;
+}
+
+/*
+ * There is no per-state extra space; keep a pointer-sized block in the
+ * registry instead. The registry is shared by all threads of a state, like
+ * the extra space of the main thread is inherited by new threads in 5.4.
+ * This costs a registry lookup, so rlua.c looks the state up once per call
+ * from Lua or conversion and passes it down (see rlua_Callback.owner).
+ */
+static char rlua_compat_extraspace_key;
+
+static inline void* rlua_compat_getextraspace(lua_State* L)
+{
+  void* space;
+  if(rlua_compat_rawgetp(L, LUA_REGISTRYINDEX, &rlua_compat_extraspace_key) == LUA_TUSERDATA) {
+    space = lua_touserdata(L, -1);
+  } else {
+    lua_pop(L, 1);
+    space = lua_newuserdata(L, sizeof(void*));
+    memset(space, 0, sizeof(void*));
+    lua_pushvalue(L, -1);
+    rlua_compat_rawsetp(L, LUA_REGISTRYINDEX, &rlua_compat_extraspace_key);
+  }
+  lua_pop(L, 1);
+  return space;
+}
+
+#define RLUA_GC_(L, what, data, ...) (lua_gc)(L, what, data)
+
+#define lua_absindex(L, i)              rlua_compat_absindex(L, i)
+#define lua_isinteger(L, i)             rlua_compat_isinteger(L, i)
+#define lua_rawlen(L, i)                lua_objlen(L, i)
+#define lua_compare(L, a, b, op)        rlua_compat_compare(L, a, b, op)
+#define lua_getfield(L, i, k)           rlua_compat_getfield(L, i, k)
+#define lua_gettable(L, i)              rlua_compat_gettable(L, i)
+#define lua_rawget(L, i)                rlua_compat_rawget(L, i)
+#define lua_rawgeti(L, i, n)            rlua_compat_rawgeti(L, i, n)
+#define lua_geti(L, i, n)               rlua_compat_geti(L, i, n)
+#define lua_seti(L, i, n)               rlua_compat_seti(L, i, n)
+#define lua_rawgetp(L, i, p)            rlua_compat_rawgetp(L, i, p)
+#define lua_rawsetp(L, i, p)            rlua_compat_rawsetp(L, i, p)
+#define lua_rotate(L, i, n)             rlua_compat_rotate(L, i, n)
+#define lua_stringtonumber(L, s)        rlua_compat_stringtonumber(L, s)
+#define luaL_tolstring(L, i, len)       rlua_compat_tolstring(L, i, len)
+#define luaL_getsubtable(L, i, name)    rlua_compat_getsubtable(L, i, name)
+#define luaL_requiref(L, name, f, glb)  rlua_compat_requiref(L, name, f, glb)
+#define lua_newuserdatauv(L, size, nuv) lua_newuserdata(L, size)
+#define lua_getiuservalue(L, i, n)      rlua_compat_getiuservalue(L, i, n)
+#define lua_setiuservalue(L, i, n)      lua_setfenv(L, i)
+#define lua_resume(L, from, n, nres)    rlua_compat_resume(L, from, n, nres)
+#define lua_resetthread(L)              ((void)(L))
+#define lua_pcallk(L, n, r, f, ctx, k)  lua_pcall(L, n, r, f)
+#define lua_yieldk(L, n, ctx, k)        lua_yield(L, n)
+#define lua_isyieldable(L)              ((void)(L), 0)
+#define lua_dump(L, writer, data, strip) lua_dump(L, writer, data)
+#define lua_load(L, reader, data, name, mode) lua_loadx(L, reader, data, name, mode)
+#define lua_gc(...)                     RLUA_GC_(__VA_ARGS__, 0, 0)
+#define lua_getextraspace(L)            rlua_compat_getextraspace(L)
+
+#ifndef lua_pushglobaltable
+#define lua_pushglobaltable(L)          lua_pushvalue(L, LUA_GLOBALSINDEX)
+#endif
+
+#ifndef luaL_newlib
+#define luaL_newlib(L, l) \
+  (lua_createtable(L, 0, sizeof(l) / sizeof((l)[0]) - 1), luaL_setfuncs(L, l, 0))
+#endif
+
+#else
+
+#include <lua5.4/lua.h>
+#include <lua5.4/lauxlib.h>
+#include <lua5.4/lualib.h>
+
+#define RLUA_BACKEND         "lua"
+#define RLUA_BACKEND_VERSION LUA_RELEASE
+#define RLUA_SEARCHERS       "searchers"
+
+#endif
+
+#endif
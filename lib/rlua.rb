@@ -1,6 +1,26 @@
+require 'etc'
 require 'rlua.so'
 
 module Lua
+  class State
+    # Runs incremental garbage collector steps until a collection cycle
+    # finishes or +budget+ seconds have elapsed. Returns true if the cycle
+    # was finished.
+    #
+    # This is meant to be called from request idle time: stop the automatic
+    # collector with <tt>gc(:stop)</tt> once, then call #gc_idle between
+    # requests, so that Lua never pauses in the middle of serving one.
+    # +step+ is passed to <tt>gc(:step)</tt> as the size of each step
+    # in kilobytes.
+    def gc_idle(budget=0.001, step=0)
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + budget
+      until gc(:step, step)
+        return false if Process.clock_gettime(Process::CLOCK_MONOTONIC) >= deadline
+      end
+      true
+    end
+  end
+
   class Table
     # Traverses the table using Lua::Table.next function.
     def each(&block)
@@ -64,4 +84,190 @@ module Lua
       end
     end
   end
+
+  class Error
+    # A Lua stack frame, similar to Thread::Backtrace::Location.
+    Location = Struct.new(:path, :lineno, :label) do
+      def to_s
+        if lineno > 0
+          "#{path}:#{lineno}:in `#{label}'"
+        else
+          "#{path}:in `#{label}'"
+        end
+      end
+    end
+
+    # Returns Lua frames which were active when the error was raised,
+    # innermost first, as Location objects. Frames are captured in raw form
+    # when the error happens and only parsed here.
+    def lua_backtrace_locations
+      @lua_backtrace_locations ||=
+        (@__lua_trace || '').split("\0").each_slice(3).map { |path, line, label|
+          Location.new(path, line.to_i, label)
+        }.freeze
+    end
+
+    # Returns Lua frames formatted like Ruby backtrace lines.
+    def lua_backtrace
+      lua_backtrace_locations.map(&:to_s)
+    end
+
+    # Returns Lua frames followed by the Ruby backtrace.
+    def backtrace
+      ruby = super
+      ruby && lua_backtrace + ruby
+    end
+  end
+
+  # Lua::Bundle is an archive of Lua modules precompiled to bytecode, which
+  # lets states +require+ them straight from memory with
+  # Lua::State#mount_bundle.
+  #
+  #   bundle = Lua::Bundle.build('lua')       # lua/app/init.lua => app
+  #   bundle.save('app.rlub')                 # lua/app/util.lua => app.util
+  #
+  #   state.__load_stdlib :all
+  #   state.mount_bundle Lua::Bundle.load('app.rlub')
+  #   state.__eval "require 'app.util'"
+  class Bundle
+    MAGIC = 'RLUB'.b.freeze
+
+    # Compiles every <tt>.lua</tt> file under +dir+. Module names are derived
+    # from file paths the same way <tt>package.path</tt> resolves them.
+    # Raises ArgumentError if two files map to the same module (like
+    # <tt>foo.lua</tt> and <tt>foo/init.lua</tt>) or for an +init.lua+
+    # directly in +dir+, which has no module name.
+    def self.build(dir)
+      modules = {}
+      sources = {}
+      Dir.glob('**/*.lua', base: dir).sort.each do |path|
+        name = path.chomp('.lua').sub(%r{(\A|/)init\z}, '').tr('/', '.')
+        raise ArgumentError, "#{path} has no module name" if name.empty?
+        if sources[name]
+          raise ArgumentError, "#{path} and #{sources[name]} both define module #{name}"
+        end
+        sources[name] = path
+        modules[name] = compile(File.read(File.join(dir, path)), "@#{path}")
+      end
+      new(modules)
+    end
+
+    # Reads a bundle written by #save. Lua does not verify bytecode, and
+    # malformed bytecode can crash the process or worse when it runs, so
+    # only load archives produced by a trusted build.
+    def self.load(path)
+      new(File.binread(path))
+    end
+
+    # Creates a bundle from a Hash of module names and bytecode, or from an
+    # existing archive String.
+    def initialize(modules)
+      if modules.is_a? String
+        raise ArgumentError, 'not a Lua bundle' unless modules.start_with? MAGIC
+        @data = modules.b.freeze
+      else
+        data = MAGIC + [modules.size].pack('V')
+        modules.each do |name, code|
+          data << [name.bytesize].pack('V') << name.b
+          data << [code.bytesize].pack('V') << code.b
+        end
+        @data = data.freeze
+      end
+    end
+
+    # Returns the archive as a frozen binary String.
+    attr_reader :data
+
+    # Writes the archive to +path+.
+    def save(path)
+      File.binwrite(path, @data)
+    end
+  end
+
+  # Lua::WorkerPool runs Lua functions on a fixed set of native threads,
+  # each of which owns a separate Lua interpreter with all standard libraries
+  # loaded. Workers never touch Ruby objects and run without the GVL, so Lua
+  # code can use every core while Ruby threads keep running.
+  #
+  # Arguments and results are copied between Ruby and workers; only nil,
+  # booleans, numbers, strings (symbols are sent as strings) and nested
+  # arrays, hashes or tables of them can be passed.
+  #
+  #   pool = Lua::WorkerPool.new(threads: 4, setup: <<-LUA)
+  #     function score(record) return record.a * 2 + record.b end
+  #   LUA
+  #   futures = records.map { |record| pool.submit('score', [record]) }
+  #   futures.map(&:value)
+  class WorkerPool
+    # A result of a job submitted to WorkerPool.
+    class Future
+      def initialize(pool) # :nodoc:
+        @pool = pool
+        @done = false
+      end
+
+      # Returns true if the job has finished.
+      def done?
+        @pool.__dispatch(self, false) unless @done
+        @done
+      end
+
+      # Waits for the job to finish and returns the values returned by the
+      # Lua function with Lua::Function#call conventions. Raises RuntimeError
+      # if the function has raised a Lua error.
+      def value
+        @pool.__dispatch(self, true) unless @done
+        raise RuntimeError, @error if @error
+        @value
+      end
+
+      def __resolved? # :nodoc:
+        @done
+      end
+
+      def __resolve(ok, results) # :nodoc:
+        if !ok
+          @error = results.first
+        elsif results.size > 1
+          @value = results
+        else
+          @value = results.first
+        end
+        @done = true
+      end
+    end
+
+    # Starts +threads+ workers. +setup+ is Lua code which is run in every
+    # worker interpreter before any jobs, and usually defines the functions
+    # which will be submitted.
+    def initialize(threads: Etc.nprocessors, setup: nil)
+      @futures = {}
+      @lock = Mutex.new
+      __start(threads, setup)
+    end
+
+    # Queues a call of global Lua function +function+ with +args+ and returns
+    # a Future for its result.
+    def submit(function, args=[])
+      future = Future.new(self)
+      @lock.synchronize { @futures[__submit(function, args)] = future }
+      future
+    end
+
+    # Delivers finished jobs from the completion queue to their futures,
+    # until +future+ is resolved if +block+ is true. The lock is held for
+    # one wait at a time, so that other threads may submit jobs and take
+    # turns in delivering them meanwhile.
+    def __dispatch(future, block) # :nodoc:
+      loop do
+        id = nil
+        @lock.synchronize do
+          return if future.__resolved?
+          id, ok, results = __wait(block ? 0.1 : 0)
+          @futures.delete(id).__resolve(ok, results) if id
+        end
+        return unless id || block
+      end
+    end
+  end
 end
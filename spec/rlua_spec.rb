@@ -1,5 +1,8 @@
 # encoding: utf-8
 require 'rlua'
+require 'tmpdir'
+require 'fileutils'
+require 'timeout'
 
 describe Lua::State do
   context 'ruby' do
@@ -62,18 +65,21 @@ describe Lua::State do
       end
 
       it 'converts small Integer to integer' do
+        skip 'LuaJIT numbers are always floats' if Lua::BACKEND == :luajit
         subject.value = 1
         subject.__eval 't = math.type(value)'
         expect(subject.t).to eq("integer")
       end
 
       it 'converts large Integer to float' do
+        skip 'LuaJIT numbers are always floats' if Lua::BACKEND == :luajit
         subject.value = 2**64
         subject.__eval 't = math.type(value)'
         expect(subject.t).to eq("float")
       end
 
       it 'converts Float to float' do
+        skip 'LuaJIT numbers are always floats' if Lua::BACKEND == :luajit
         subject.value = 1.0
         subject.__eval 't = math.type(value)'
         expect(subject.t).to eq("float")
@@ -239,6 +245,7 @@ describe Lua::State do
       end
 
       it 'converts float to Float' do
+        skip 'LuaJIT numbers are always floats' if Lua::BACKEND == :luajit
         subject.__eval 'value = 1.0'
         expect(subject.value.class).to eq(Float)
       end
@@ -251,7 +258,9 @@ describe Lua::State do
 
     context '__load_stdlib' do
       it "creates a global name for most libraries" do
-        [:math, :table, :utf8, :io, :os, :package].each do |lib|
+        libs = [:math, :table, :io, :os, :package]
+        libs << (Lua::BACKEND == :luajit ? :bit : :utf8)
+        libs.each do |lib|
           subject.__load_stdlib(lib)
           subject.__eval "value = (#{lib} == nil)"
           expect(subject.value).to eq(false)
@@ -263,6 +272,773 @@ describe Lua::State do
         subject.__eval "value = (base == nil)"
         expect(subject.value).to eq(true)
       end
+
+      it "loads libraries on first access when lazy" do
+        subject.__load_stdlib :lazy
+        expect(subject.__eval('return rawget(_G, "math") == nil, math.floor(2.5)')).to eq([true, 2])
+        expect(subject.__eval('return rawget(_G, "math") ~= nil, rawget(_G, "os") == nil')).to eq([true, true])
+        expect(subject.__eval('return ("abc"):upper()')).to eq('ABC')
+      end
+
+      it "loads pending libraries through require when lazy" do
+        subject.__load_stdlib :lazy
+        expect(subject.__eval('return require("math").floor(2.5), require("os") == os')).to eq([2, true])
+        expect(subject.__eval('return require("math") == math')).to eq(true)
+      end
+
+      it "coerces strings in arithmetic when lazy, like with :all" do
+        subject.__load_stdlib :lazy
+        expect(subject.__eval('return "10" + 1')).to eq(11)
+      end
+
+      it "removes the lazy loader once everything is loaded" do
+        subject.__load_stdlib :lazy
+        subject.__eval 'local _ = package, coroutine, table, io, os, string, math, utf8, debug, bit, jit'
+        expect(subject.__eval('return getmetatable(_G) == nil, type(require)')).to eq([true, 'function'])
+      end
+
+      it "makes lazy states smaller than fully loaded ones" do
+        full = Lua::State.new
+        full.__load_stdlib :all
+        subject.__load_stdlib :lazy
+        expect(subject.gc(:count)).to be < full.gc(:count)
+      end
+    end
+  end
+
+  describe 'gc' do
+    it 'reports memory in use' do
+      expect(subject.gc(:count)).to be > 0
+    end
+
+    it 'stops and restarts the collector' do
+      subject.gc(:stop)
+      expect(subject.gc(:running)).to eq(false)
+      subject.gc(:restart)
+      expect(subject.gc(:running)).to eq(true)
+    end
+
+    it 'switches collector modes' do
+      if Lua::BACKEND == :luajit
+        expect { subject.gc(:generational) }.to raise_error(NotImplementedError)
+        next
+      end
+
+      expect(subject.gc(:generational, minor: 20)).to eq(:incremental)
+      expect(subject.gc(:incremental, pause: 150)).to eq(:generational)
+    end
+
+    it 'finishes a cycle in idle time' do
+      subject.gc(:stop)
+      expect(subject.gc_idle(1)).to eq(true)
+    end
+
+    it 'counts references held by Ruby' do
+      before = subject.stats
+      tables = Array.new(3) { subject.__eval 'return {}' }
+      subject.callback = lambda { }
+      after = subject.stats
+      expect(after[:refs] - before[:refs]).to eq(3)
+      expect(after[:anchors] - before[:anchors]).to eq(1)
+      expect(after[:memory]).to be > 0
+      expect(tables.size).to eq(3)
+    end
+  end
+
+  describe 'ruby callbacks' do
+    before { subject.__bootstrap }
+
+    it 'passes arguments in order' do
+      subject.join = lambda { |a, b, c, d| [a, b, c, d].join(',') }
+      subject.__eval 'value = join(1, "two", 3, "four")'
+      expect(subject.value).to eq('1,two,3,four')
+    end
+
+    it 'returns multiple values with Lua.multret' do
+      subject.pair = lambda { Lua.multret(1, 2) }
+      subject.__eval 'a, b = pair()'
+      expect([subject.a, subject.b]).to eq([1, 2])
+    end
+
+    it 'turns Ruby exceptions into Lua errors' do
+      subject.explode = lambda { raise ArgumentError, 'boom' }
+      subject.__eval 'ok, err = pcall(explode)'
+      expect(subject.ok).to eq(false)
+      expect(subject.err).to eq('boom')
+    end
+
+    it 're-raises exceptions Lua does not handle' do
+      subject.explode = lambda { raise ArgumentError, 'boom' }
+      expect { subject.__eval 'explode()' }.to raise_error(ArgumentError, 'boom')
+    end
+
+    it 'does not let Lua catch non-standard exceptions' do
+      subject.stop = lambda { raise Interrupt }
+      expect { subject.__eval 'pcall(stop)' }.to raise_error(Interrupt)
+    end
+
+    it 'does not let Lua catch throw' do
+      subject.leave = lambda { throw :out, 42 }
+      expect(catch(:out) { subject.__eval 'pcall(leave); return 1' }).to eq(42)
+    end
+  end
+
+  describe 'packed arrays' do
+    it 'creates a table from packed floats' do
+      table = Lua::Table.from_packed(subject, [1.5, 2.5, 3.5].pack('d*'), :f64)
+      expect(table.to_a).to eq([1.5, 2.5, 3.5])
+    end
+
+    it 'round-trips packed integers' do
+      data = [1, -2, 3].pack('l*')
+      table = Lua::Table.from_packed(subject, data, :i32)
+      expect(table.to_packed(:i32)).to eq(data)
+      expect(table.to_packed(:i64).unpack('q*')).to eq([1, -2, 3])
+    end
+
+    it 'rejects non-numeric elements' do
+      subject.__eval 'value = { 1, "two" }'
+      expect { subject.value.to_packed(:f64) }.to raise_error(TypeError)
+    end
+  end
+
+  describe 'references' do
+    it 'keeps the state alive while its tables are reachable' do
+      table = Lua::State.new.tap { |state| state.__eval 'value = { answer = 42 }' }.value
+      GC.start
+      expect(table['answer']).to eq(42)
+    end
+
+    it 'refuses to pass tables between states' do
+      other = Lua::State.new
+      other.__eval 'value = {}'
+      expect { subject.value = other.value }.to raise_error(TypeError)
+    end
+  end
+
+  describe 'bundles' do
+    around do |example|
+      Dir.mktmpdir { |dir| @dir = dir; example.run }
+    end
+
+    before do
+      FileUtils.mkdir_p File.join(@dir, 'app')
+      File.write File.join(@dir, 'app', 'init.lua'), 'return { name = "app" }'
+      File.write File.join(@dir, 'app', 'util.lua'), 'return { double = function(x) return x * 2 end }'
+      subject.__load_stdlib :base, :package
+    end
+
+    it 'requires modules from a mounted bundle' do
+      subject.mount_bundle Lua::Bundle.build(@dir)
+      subject.__eval 'value = require("app.util").double(21) .. require("app").name'
+      expect(subject.value).to eq('42app')
+    end
+
+    it 'survives saving and loading' do
+      path = File.join(@dir, 'app.rlub')
+      Lua::Bundle.build(@dir).save(path)
+      subject.mount_bundle Lua::Bundle.load(path)
+      subject.__eval 'value = select(2, require("app.util"))'
+      expect(subject.value).to eq(':bundle:')
+    end
+
+    it 'reports syntax errors at build time' do
+      File.write File.join(@dir, 'broken.lua'), 'return {'
+      expect { Lua::Bundle.build(@dir) }.to raise_error(SyntaxError)
+    end
+
+    it 'rejects files mapping to the same module' do
+      File.write File.join(@dir, 'app.lua'), 'return {}'
+      expect { Lua::Bundle.build(@dir) }.to raise_error(ArgumentError, /app\/init.lua and app.lua/)
+    end
+
+    it 'rejects init.lua at the top' do
+      File.write File.join(@dir, 'init.lua'), 'return {}'
+      expect { Lua::Bundle.build(@dir) }.to raise_error(ArgumentError, /init.lua has no module name/)
+    end
+  end
+
+  describe 'deep conversion' do
+    it 'preserves shared values and cycles' do
+      shared = [1, 2]
+      hash = { 'a' => shared, 'b' => shared }
+      hash['self'] = hash
+      subject.value = hash
+      subject.__eval 'same = value.a == value.b and value.self == value'
+      expect(subject.same).to eq(true)
+    end
+
+    it 'limits nesting depth' do
+      subject.max_conversion_depth = 3
+      expect { subject.value = [[[[1]]]] }.to raise_error(ArgumentError)
+      subject.value = [[[1]]]
+      expect(subject.value[1][1][1]).to eq(1)
+    end
+
+    it 'limits element count' do
+      subject.max_conversion_elements = 3
+      expect { subject.value = { 'a' => [1, 2], 'b' => 3 } }.to raise_error(ArgumentError)
+      subject.max_conversion_elements = nil
+      subject.value = { 'a' => [1, 2], 'b' => 3 }
+      expect(subject.value['b']).to eq(3)
+    end
+  end
+
+  describe 'symbols' do
+    it 'accepts Symbols as keys and values' do
+      subject[:value] = { name: :zaphod }
+      expect(subject[:value]['name']).to eq('zaphod')
+      expect(subject.value[:name]).to eq('zaphod')
+    end
+
+    it 'optionally returns table keys as Symbols' do
+      subject.__eval 'value = { answer = 42, [1] = true }'
+      subject.symbolize_keys = true
+      expect(subject.value.to_hash).to eq({ answer: 42, 1 => true })
+    end
+
+    it 'uses Symbols made from table keys as keys again' do
+      subject.__eval 'value = { ["made up by lua 1f3a"] = 1 }'
+      subject.symbolize_keys = true
+      key = subject.value.to_hash.keys.first
+      expect(key).to be_a(Symbol)
+      expect(key.to_s).to eq('made up by lua 1f3a')
+      subject.value[key] = 2
+      expect(subject.__eval('return value["made up by lua 1f3a"]')).to eq(2)
+    end
+  end
+
+  describe 'dig' do
+    before do
+      subject.__eval 'config = { server = { limits = { rps = 100 }, hosts = { "a", "b" } } }'
+    end
+
+    it 'resolves nested keys' do
+      expect(subject.dig(:config, :server, :limits, :rps)).to eq(100)
+      expect(subject.config.dig('server', 'hosts', 2)).to eq('b')
+      expect(subject.dig(:config, :client, :limits)).to be_nil
+    end
+
+    it 'resolves precompiled paths' do
+      path = Lua::Path.new('server.hosts.1')
+      expect(path.keys).to eq([:server, :hosts, 1])
+      expect(subject.dig(:config, path)).to eq('a')
+    end
+
+    it 'refuses to index non-tables' do
+      expect { subject.dig(:config, :server, :limits, :rps, :max) }.to raise_error(TypeError)
+    end
+  end
+
+  describe 'bulk writes' do
+    it 'sets many globals at once' do
+      subject.set_globals('a' => 1, b: [2, 3])
+      expect(subject.a).to eq(1)
+      expect(subject.b.to_ary).to eq([2, 3])
+    end
+
+    it 'merges and concatenates into tables' do
+      subject.__eval 'value = { 1, 2 }'
+      subject.value.merge!(name: 'list').concat([3, 4])
+      expect(subject.value.to_ary).to eq([1, 2, 3, 4])
+      expect(subject.value.name).to eq('list')
+    end
+
+    it 'never adopts registry slots given by number' do
+      expect { Lua::Function.new(subject, 2) }.to raise_error(ArgumentError)
+      Lua::Table.new(subject, 2)
+      GC.start
+      subject.value = 1
+      expect(subject.value).to eq(1)
+    end
+
+    it 'bypasses __newindex on raw writes' do
+      subject.__load_stdlib :base
+      subject.__eval 'log = {}; value = setmetatable({}, { __newindex = function(t, k, v) log[#log + 1] = k; rawset(t, k, v) end })'
+      subject.value.merge!({ a: 1 }, raw: true)
+      subject.value.merge!(b: 2)
+      expect(subject.log.to_ary).to eq(['b'])
+    end
+
+    it 'raises errors of __newindex as Lua errors' do
+      subject.__load_stdlib :base
+      subject.__eval 'value = setmetatable({}, { __newindex = function() error("read-only", 0) end })'
+      expect { subject.value.merge!(a: 1) }.to raise_error(Lua::Error, 'read-only')
+      expect { subject.value.concat([1]) }.to raise_error(Lua::Error, 'read-only')
+      subject.set_globals('a' => 1)
+      expect(subject.a).to eq(1)
+    end
+  end
+
+  describe 'non-raising calls' do
+    before do
+      subject.__load_stdlib :base
+    end
+
+    it 'returns results with a true status' do
+      expect(subject.try_eval('return 1, 2')).to eq([true, 1, 2])
+      subject.__eval 'function add(a, b) return a + b end'
+      expect(subject[:add].try_call(1, 2)).to eq([true, 3])
+    end
+
+    it 'returns the message and the original error value' do
+      subject.__eval 'function check(x) error({ code = x }) end'
+      ok, message, error = subject[:check].try_call(7)
+      expect(ok).to eq(false)
+      expect(message).to eq('(error object is a table value)')
+      expect(error.code).to eq(7)
+    end
+
+    it 'reports syntax errors' do
+      ok, message = subject.try_eval('return +')
+      expect(ok).to eq(false)
+      expect(message).to match(/unexpected symbol/)
+    end
+  end
+
+  describe 'tracebacks' do
+    before do
+      subject.__load_stdlib :base
+      subject.__eval <<-LUA, '=script'
+        local function inner() error("deep") end
+        function outer()
+          inner()
+        end
+      LUA
+    end
+
+    it 'captures Lua frames of runtime errors' do
+      expect { subject.__eval 'outer()' }.to raise_error(Lua::Error) { |error|
+        expect(error.lua_backtrace_locations.map(&:label)).to include('inner', 'outer')
+        expect(error.lua_backtrace).to include("script:3:in `outer'")
+        expect(error.backtrace.first).to eq("[C]:in `error'")
+      }
+    end
+
+    it 'keeps runtime errors RuntimeErrors' do
+      expect { subject.__eval 'outer()' }.to raise_error(RuntimeError, 'script:1: deep')
+    end
+  end
+
+  describe 'interrupts' do
+    it 'are ignored by default' do
+      expect(subject.interrupt_check_interval).to be_nil
+    end
+
+    it 'stop long-running code with Timeout' do
+      subject.__load_stdlib :base
+      subject.interrupt_check_interval = 1000
+      expect {
+        Timeout.timeout(0.1) { subject.__eval 'while true do pcall(function() end) end' }
+      }.to raise_error(Timeout::Error)
+      expect(subject.try_eval('return 1')).to eq([true, 1])
+    end
+  end
+
+  describe 'pooled allocator' do
+    subject { Lua::State.new(allocator: :pool) }
+
+    it 'runs code' do
+      subject.__load_stdlib :all
+      subject.value = (1..1000).map { |i| { 'n' => i.to_s * 3 } }
+      subject.__eval 'count = 0; for _, v in ipairs(value) do count = count + #v.n end'
+      expect(subject.count).to eq((1..1000).sum { |i| i.to_s.size * 3 })
+    end
+
+    it 'rejects unknown allocators' do
+      expect { Lua::State.new(allocator: :magic) }.to raise_error(ArgumentError)
+    end
+
+    it 'starts over on reset and keeps settings' do
+      subject.symbolize_keys = true
+      subject.__eval 'value = { a = 1 }'
+      old = subject.value
+      expect(subject.reset).to be(subject)
+      expect(subject.value).to be_nil
+      expect(subject.symbolize_keys).to be(true)
+      expect { old.to_hash }.to raise_error(ArgumentError)
+      subject.__eval 'value = { b = 2 }'
+      expect(subject.value.to_hash).to eq(b: 2)
+    end
+
+    it 'cannot be reset while Lua code runs' do
+      subject.reset_now = lambda { subject.reset }
+      expect { subject.__eval 'reset_now()' }.to raise_error(RuntimeError, /cannot reset/)
+    end
+  end
+
+  describe 'shared tables' do
+    let(:shared) {
+      Lua::SharedTable.build('rates' => { 'us' => 1.5, 7 => :seven }, 'list' => [1, 'two', nil, true])
+    }
+
+    before do
+      subject.__load_stdlib :base
+    end
+
+    it 'is read in place by many states' do
+      other = Lua::State.new
+      [subject, other].each do |state|
+        state.data = shared
+        state.__eval 'rate, seven, size, two = data.rates.us, data.rates[7.0], #data.list, data.list[2]'
+        expect([state.rate, state.seven, state.size, state.two]).to eq([1.5, 'seven', 4, 'two'])
+      end
+    end
+
+    it 'supports pairs and refuses writes' do
+      skip 'LuaJIT ignores __pairs' if Lua::BACKEND == :luajit
+      subject.data = shared
+      subject.__eval 'n = 0; for k, v in pairs(data.list) do n = n + 1 end'
+      expect(subject.n).to eq(3)
+      expect { subject.__eval 'data.rates.us = 2' }.to raise_error(Lua::Error, /shared table/)
+    end
+
+    it 'survives saving and loading' do
+      Dir.mktmpdir do |dir|
+        shared.save(File.join(dir, 'data.rlus'))
+        subject.data = Lua::SharedTable.load(File.join(dir, 'data.rlus'))
+        subject.__eval 'rate = data.rates.us'
+        expect(subject.rate).to eq(1.5)
+      end
+    end
+
+    it 'is shareable between Ractors' do
+      expect(Ractor.shareable?(shared)).to eq(true)
+    end
+
+    it 'rejects duplicate keys' do
+      expect { Lua::SharedTable.build('a' => 1, a: 2) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'json' do
+    it 'parses JSON into Lua tables' do
+      table = Lua::Table.from_json(subject, '{"name": "caf\\u00e9", "items": [1, 2.5, true, null], "empty": {}}')
+      expect(table.name).to eq('café')
+      expect(table.items.to_ary).to eq([1, 2.5, true])
+      expect(subject.push_json('[1, 2]', integers: false).to_ary).to eq([1.0, 2.0])
+    end
+
+    it 'rejects malformed input' do
+      expect { subject.push_json('{"a": }') }.to raise_error(ArgumentError, /offset 6/)
+      expect { subject.push_json('[1] 2') }.to raise_error(ArgumentError)
+    end
+
+    it 'parses numbers which end a shared substring' do
+      number = "1.#{'0' * 1000}"
+      json = "#{number}e999 and more"[0, number.size]
+      expect(subject.push_json(json)).to eq(1.0)
+    end
+
+    it 'serializes Lua tables' do
+      subject.__eval 'value = { list = { 1, 2.0, "a\\"b" }, empty = {} }'
+      expect(subject.value.list.to_json).to eq('[1,2.0,"a\\"b"]')
+      expect(subject.value.list.to_json(integral_floats: :integer)).to eq('[1,2,"a\\"b"]')
+      expect(subject.value.empty.to_json).to eq('{}')
+      expect(subject.value.empty.to_json(empty: :array)).to eq('[]')
+    end
+
+    it 'refuses recursive tables' do
+      subject.__eval 'value = {}; value.self = value'
+      expect { subject.value.to_json }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'buffers' do
+    before do
+      subject.__load_stdlib :base, :string
+    end
+
+    it 'collects output written from Lua' do
+      out = Lua::Buffer.new(subject)
+      subject.out = out
+      subject.__eval 'for i = 1, 3 do out:write("<li>", i, "</li>") end; out:writef("%05.1f", 2.5)'
+      expect(out.to_s).to eq('<li>1</li><li>2</li><li>3</li>002.5')
+      expect(out.size).to eq(35)
+      expect(out.clear.to_s).to eq('')
+    end
+
+    it 'appends to a target String' do
+      target = +'<ul>'
+      subject.out = Lua::Buffer.new(subject, target)
+      subject.__eval 'out:write("<li>", #out, "</li>")'
+      expect(target).to eq('<ul><li>4</li>')
+    end
+  end
+
+  describe 'callback profiling' do
+    it 'times named callbacks' do
+      subject.work = Lua::Function.new(subject, lambda { |x| x * 2 }, 'work')
+      subject.other = lambda { |x| x }
+      subject.__eval 'for i = 1, 10 do work(i); other(i) end'
+
+      profile = subject.callback_profile
+      expect(profile.keys).to eq(['work'])
+      expect(profile['work'][:calls]).to eq(10)
+      expect(profile['work'][:total]).to be > 0
+      expect(profile['work'][:histogram].values.sum).to eq(10)
+      expect(profile['work'][:histogram].keys).to all(satisfy { |k| k & (k - 1) == 0 })
+
+      subject.reset_callback_profile
+      expect(subject.callback_profile['work'][:calls]).to eq(0)
+    end
+
+    it 'keys unnamed callbacks by source location' do
+      subject.profile_callbacks = true
+      line = __LINE__ + 1
+      subject.f = lambda { nil }
+      subject.__eval 'f(); f()'
+      expect(subject.callback_profile["#{__FILE__}:#{line}"][:calls]).to eq(2)
+    end
+  end
+
+  describe 'channels' do
+    let(:consumer) { Lua::State.new }
+
+    it 'passes values between states' do
+      channel = Lua::Channel.new(4)
+      subject.out = channel
+      consumer.input = channel
+      subject.__eval 'out:send({ 1, 2, name = "x" }); out:send("two")'
+      expect(channel.size).to eq(2)
+      consumer.__eval 'a = input:recv(); b = input:recv(); ok = a[2] == 2 and a.name == "x"'
+      expect(consumer.ok).to be(true)
+      expect(consumer.b).to eq('two')
+    end
+
+    it 'does not wait in try_send and try_recv' do
+      subject.ch = Lua::Channel.new(1)
+      subject.__eval 'a = ch:try_send(1); b = ch:try_send(2); x, c = ch:try_recv(); y, d = ch:try_recv()'
+      expect([subject.a, subject.b, subject.c, subject.d]).to eq([true, false, true, false])
+      expect(subject.x).to eq(1)
+    end
+
+    it 'drains and then ends when closed' do
+      channel = Lua::Channel.new
+      channel.push('last')
+      channel.close
+      subject.ch = channel
+      subject.__eval 'a, ok1 = ch:recv(); b, ok2 = ch:recv()'
+      expect([subject.a, subject.ok1, subject.b, subject.ok2]).to eq(['last', true, nil, false])
+      expect { channel.push(1) }.to raise_error(ClosedQueueError)
+      expect { subject.__eval 'ch:send(1)' }.to raise_error(Lua::Error, /closed/)
+    end
+
+    it 'blocks senders and receivers on different threads' do
+      channel = Lua::Channel.new(2)
+      subject.out = channel
+      consumer.input = channel
+      producer = Thread.new { subject.__eval 'for i = 1, 100 do out:send(i) end; out:close()' }
+      consumer.__eval 'sum = 0; for v in input.recv, input do sum = sum + v end'
+      producer.join
+      expect(consumer.sum).to eq(5050)
+    end
+
+    it 'is used from Ruby' do
+      channel = Lua::Channel.new
+      subject.ch = channel
+      channel.push({ 'a' => [1, 2] })
+      subject.__eval 'v = ch:recv(); ch:send(v.a[2])'
+      expect(channel.try_pop).to eq([2])
+      expect(channel.try_pop).to be_nil
+    end
+
+    it 'keeps other threads out of a state which waits' do
+      channel = Lua::Channel.new
+      subject.ch = channel
+      waiter = Thread.new { subject.__eval 'v = ch:recv()' }
+      Timeout.timeout(5) do
+        Thread.pass until (subject.__eval('x = 1') rescue $!).is_a?(ThreadError)
+      end
+      channel.push(1)
+      waiter.join
+      expect(subject.v).to eq(1)
+    end
+
+    it 'can be interrupted while waiting' do
+      subject.ch = Lua::Channel.new
+      expect { Timeout.timeout(0.1) { subject.__eval 'ch:recv()' } }.to raise_error(Timeout::Error)
+      expect { subject.__eval 'error("after")' }.to raise_error(Lua::Error, /after/)
+      expect(Thread.new { subject.__eval 'return 1 + 1' }.value).to eq(2)
+    end
+
+    it 'keeps values received from Ruby when interrupted' do
+      channel = Lua::Channel.new
+      expect { Timeout.timeout(0.1) { channel.pop } }.to raise_error(Timeout::Error)
+      channel.push(1)
+      expect(channel.pop).to eq(1)
+    end
+  end
+
+  describe 'async callbacks' do
+    it 'runs async callbacks outside of Lua so fibers can interleave' do
+      skip 'LuaJIT cannot yield from C functions with a continuation' if Lua::BACKEND == :luajit
+      log = []
+      subject.wait = Lua::Function.new(subject, lambda { |x| log << x; Fiber.yield; x * 2 }, async: true)
+      a = Fiber.new { subject.__eval_async 'return wait(1) + wait(2)' }
+      b = Fiber.new { subject.__eval_async 'return wait(10)' }
+
+      a.resume
+      b.resume
+      expect(log).to eq([1, 10])
+      expect(b.resume).to eq(20)
+      a.resume
+      expect(log).to eq([1, 10, 2])
+      expect(a.resume).to eq(6)
+    end
+
+    it 'calls async callbacks directly outside of async calls' do
+      subject.double = Lua::Function.new(subject, lambda { |x| x * 2 }, async: true)
+      subject.__eval 'function f(x) return double(x), double(x + 1) end'
+      expect(subject.__eval('return double(4)')).to eq(8)
+      expect(subject[:f].call_async(1)).to eq([2, 4])
+    end
+
+    it 'turns exceptions of async callbacks into Lua errors' do
+      subject.__load_stdlib :base
+      subject.fail = Lua::Function.new(subject, lambda { raise 'boom' }, async: true)
+      expect(subject.__eval_async('return pcall(fail)')).to eq([false, 'boom'])
+      expect { subject.__eval_async 'fail()' }.to raise_error(RuntimeError, 'boom')
+    end
+  end
+
+  describe 'structs' do
+    point = Struct.new(:x, :y)
+    keyed = Struct.new(:name, :tags, keyword_init: true)
+
+    # Data only exists since Ruby 3.2.
+    let(:coord) do
+      skip 'Data needs Ruby 3.2' unless defined?(Data.define)
+      Data.define(:lat, :lon)
+    end
+
+    it 'converts Struct objects to tables' do
+      subject.p = point.new(1, [2, 3])
+      expect(subject.__eval('return p.x, p.y[2]')).to eq([1, 3])
+    end
+
+    it 'converts Data objects to tables' do
+      subject.c = coord.new(lat: 1.5, lon: -2.5)
+      expect(subject.__eval('return c.lat, c.lon')).to eq([1.5, -2.5])
+    end
+
+    it 'converts tables back to Structs' do
+      table = subject.__eval('return { x = 1, y = "two", z = 3 }')
+      expect(table.to_struct(point)).to eq(point.new(1, 'two'))
+      expect(subject.__eval('return { name = "n" }').to_struct(keyed)).to eq(keyed.new(name: 'n'))
+    end
+
+    it 'converts tables back to Data objects' do
+      expect(subject.__eval('return { lat = 1 }').to_struct(coord)).to eq(coord.new(lat: 1, lon: nil))
+    end
+
+    it 'rejects classes which are not structs' do
+      expect { subject.__eval('return {}').to_struct(String) }.to raise_error(TypeError)
+    end
+
+    it 'does not treat other T_STRUCT objects as structs' do
+      expect { subject.r = 1..2 }.to raise_error(TypeError, 'wrong argument type Range')
+      expect { subject.r = [1..2] }.to raise_error(TypeError, 'wrong argument type Range')
+    end
+  end
+
+  describe 'change tracking' do
+    let(:config) { subject.__eval 'config = { name = "a", list = { 1, 2 }, limits = { rps = 10 } } return config' }
+
+    it 'journals writes made by Lua' do
+      config.track_changes!
+      subject.__eval 'config.name = "a"; config.port = 80; config.list = nil'
+      expect(config.changes).to eq('port' => 80, 'list' => nil)
+      config.reset_changes
+      expect(config.changes).to eq({})
+      subject.__eval 'config.port = 81'
+      expect(config.changes).to eq('port' => 81)
+    end
+
+    it 'reports changes of nested tables under their key' do
+      config.track_changes!(nested: true)
+      subject.__eval 'config.limits.rps = 20; config.extra = { x = 1 }; config.extra.x = 2'
+      changes = config.changes
+      expect(changes['limits']).to eq('rps' => 20)
+      expect(changes['extra'].to_hash).to eq('x' => 2)
+      config.reset_changes
+      subject.__eval 'config.extra.x = 3'
+      expect(config.changes).to eq('extra' => { 'x' => 3 })
+    end
+
+    it 'keeps the contents visible' do
+      config.track_changes!(nested: true)
+      expect(config.to_hash.keys).to contain_exactly('name', 'list', 'limits')
+      expect(config.list.__length).to eq(2)
+      expect(config.to_json).to include('"rps":10')
+      unless Lua::BACKEND == :luajit
+        subject.__load_stdlib :base
+        expect(subject.__eval('local n = 0 for k in pairs(config) do n = n + 1 end return n, #config.list')).to eq([3, 2])
+      end
+    end
+
+    it 'refuses tables with a metatable and untracked tables' do
+      expect { config.changes }.to raise_error(ArgumentError, /track/)
+      config.__metatable = {}
+      expect { config.track_changes! }.to raise_error(ArgumentError, /metatable/)
+    end
+  end
+
+  describe 'backend' do
+    it 'reports the Lua implementation' do
+      expect([:lua, :luajit]).to include(Lua::BACKEND)
+      expect(Lua::BACKEND_VERSION).to match(/\A(Lua|LuaJIT) \d/)
     end
+
+    it 'round-trips integers and tables the same way on every backend' do
+      subject.__load_stdlib :base
+      subject.value = { 'list' => [1, 2, 3], 'big' => 2**40 }
+      expect(subject.__eval('return #value.list, value.big, tostring(value.list[2])')).to eq([3, 2**40, '2'])
+    end
+  end
+
+  describe 'ractors' do
+    it 'creates and uses states inside a Ractor' do
+      ractor = Ractor.new do
+        state = Lua::State.new
+        state.__eval 'value = 6 * 7'
+        state.value
+      end
+      expect(ractor.take).to eq(42)
+    end
+  end
+end
+
+describe Lua::WorkerPool do
+  subject { Lua::WorkerPool.new(threads: 2, setup: <<-LUA) }
+    function add(a, b) return a + b end
+    function pick(t) return t.list[2], t.name end
+    function fail(message) error(message, 0) end
+  LUA
+
+  after { subject.shutdown }
+
+  it 'runs jobs on worker threads' do
+    futures = 10.times.map { |i| subject.submit('add', [i, 1]) }
+    expect(futures.map(&:value)).to eq((1..10).to_a)
+  end
+
+  it 'copies nested values in both directions' do
+    future = subject.submit('pick', [{ 'list' => ['a', 'b'], 'name' => 'x' }])
+    expect(future.value).to eq(['b', 'x'])
+  end
+
+  it 'raises Lua errors when the value is requested' do
+    future = subject.submit('fail', ['nope'])
+    expect { future.value }.to raise_error(RuntimeError, 'nope')
+  end
+
+  it 'lets several threads wait for their futures' do
+    futures = 4.times.map { |i| subject.submit('add', [i, i]) }
+    expect(futures.map { |future| Thread.new { future.value } }.map(&:value)).to eq([0, 2, 4, 6])
+  end
+
+  it 'reports setup errors which are not strings' do
+    expect { Lua::WorkerPool.new(threads: 1, setup: 'error({})') }.to raise_error(RuntimeError, /table value/)
   end
 end
@@ -0,0 +1,132 @@
+# Soak test: drives a long run of mixed Ruby/Lua crossings (tables,
+# functions, callbacks and errors) through one state and samples resource
+# usage as it goes. Every sample is written to a CSV file for plotting;
+# the run fails if a metric keeps growing after warm-up.
+#
+#   rake soak
+#   ruby -Ilib spec/soak.rb [iterations] [csv]
+#
+# SOAK_ITERATIONS and SOAK_CSV stand in for the arguments (defaults 2000000
+# and tmp/soak.csv), SOAK_SAMPLES sets the number of samples (default 100),
+# SOAK_THRESHOLD the allowed relative growth between the first and the last
+# quarter of the samples taken after warm-up (default 0.1).
+
+require 'csv'
+require 'fileutils'
+require 'rlua'
+
+ITERATIONS = (ARGV[0] || ENV['SOAK_ITERATIONS'] || 2_000_000).to_i
+CSV_PATH   = ARGV[1] || ENV['SOAK_CSV'] || 'tmp/soak.csv'
+SAMPLES    = (ENV['SOAK_SAMPLES'] || 100).to_i
+THRESHOLD  = (ENV['SOAK_THRESHOLD'] || 0.1).to_f
+
+# Growth below these absolute amounts is noise, whatever its relative size.
+METRICS = {
+  refs:       100,
+  anchors:    100,
+  registry:   1_000,
+  lua_kb:     512,
+  heap_slots: 20_000,
+  rss_kb:     16_384,
+}
+
+def rss_kb
+  File.read('/proc/self/status')[/VmRSS:\s+(\d+)/, 1].to_i
+rescue Errno::ENOENT
+  0
+end
+
+state = Lua::State.new
+state.__load_stdlib :all
+state.__eval <<-LUA
+  function make(i)
+    return { id = i, name = "item" .. i, tags = { "a", "b", i } }
+  end
+
+  function adder(n)
+    return function(x) return x + n end
+  end
+
+  function call_back(i)
+    return ruby_double(i) + #ruby_list(i)
+  end
+
+  function fail(i)
+    error("failure " .. i)
+  end
+
+  function guarded(i)
+    return pcall(ruby_raise, i)
+  end
+LUA
+state.ruby_double = lambda { |x| x * 2 }
+state.ruby_list   = lambda { |n| Array.new(n.to_i % 5) { |i| i } }
+state.ruby_raise  = lambda { |i| raise ArgumentError, "raised #{i}" }
+
+crossings = [
+  # Tables in both directions.
+  ->(i) { state.item = { 'id' => i, 'list' => [i, i + 1] }; state.make(i).to_hash },
+  # Lua functions held and called from Ruby.
+  ->(i) { state.adder(i).call(1) },
+  # Ruby callbacks called from Lua, including a fresh proc every time.
+  ->(i) { state.call_back(i); state.transient = lambda { i } },
+  # Errors raised in Lua and in Ruby callbacks.
+  ->(i) { begin; state.fail(i); rescue Lua::Error; end; state.guarded(i) },
+]
+
+def sample(state, iteration, started)
+  GC.start
+  state.gc(:collect)
+  stats = state.stats
+
+  {
+    time:       (Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).round(3),
+    iteration:  iteration,
+    refs:       stats[:refs],
+    anchors:    stats[:anchors],
+    registry:   stats[:registry],
+    lua_kb:     stats[:memory].round(1),
+    heap_slots: GC.stat(:heap_live_slots),
+    rss_kb:     rss_kb,
+  }
+end
+
+interval = [ITERATIONS / SAMPLES, 1].max
+started  = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+rows     = []
+
+FileUtils.mkdir_p(File.dirname(CSV_PATH))
+CSV.open(CSV_PATH, 'w') do |csv|
+  csv << sample(state, 0, started).keys
+
+  ITERATIONS.times do |i|
+    crossings[i % crossings.size].call(i)
+    next unless (i + 1) % interval == 0
+
+    rows << sample(state, i + 1, started)
+    csv << rows.last.values
+    csv.flush
+    $stderr.print "\r#{i + 1}/#{ITERATIONS} #{rows.last.inspect[0, 120]}"
+  end
+end
+$stderr.puts
+
+# Warm-up covers interpreter caches, the Symbol table and heap page growth.
+steady = rows.drop(rows.size / 5)
+if steady.size < 8
+  abort "soak: #{steady.size} samples after warm-up are not enough to judge a trend"
+end
+
+quarter = steady.size / 4
+failures = METRICS.filter_map do |metric, floor|
+  first = steady.first(quarter).sum { |row| row[metric] } / quarter.to_f
+  last  = steady.last(quarter).sum { |row| row[metric] } / quarter.to_f
+  growth = last - first
+  next if growth <= [first * THRESHOLD, floor].max
+
+  format('%s grew from %.1f to %.1f', metric, first, last)
+end
+
+puts "soak: #{ITERATIONS} crossings, #{rows.size} samples written to #{CSV_PATH}"
+abort "soak: #{failures.join('; ')}" unless failures.empty?
+puts 'soak: no upward trend'